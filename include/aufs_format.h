@@ -0,0 +1,163 @@
+#ifndef __AUFS_FORMAT_H__
+#define __AUFS_FORMAT_H__
+
+/*
+ * On-disk format shared by the kernel module and the tools. Every field
+ * is big endian. The kernel sees plain __be32/__be64, user space may
+ * define AUFS_BE32/AUFS_BE64 to wrapper types before including.
+ */
+
+#if defined(__KERNEL__)
+#include <linux/types.h>
+#include <linux/stddef.h>
+#include <linux/build_bug.h>
+#ifndef AUFS_BE32
+#define AUFS_BE32 __be32
+#define AUFS_BE64 __be64
+#endif
+#define AUFS_STATIC_ASSERT(expr, msg) static_assert(expr, msg)
+#else
+#include <stdint.h>
+#include <stddef.h>
+#ifndef AUFS_BE32
+#define AUFS_BE32 uint32_t
+#define AUFS_BE64 uint64_t
+#endif
+#ifdef __cplusplus
+#define AUFS_STATIC_ASSERT(expr, msg) static_assert(expr, msg)
+#else
+#define AUFS_STATIC_ASSERT(expr, msg) _Static_assert(expr, msg)
+#endif
+#endif
+
+#define AUFS_MAGIC_NUMBER		0x13131313u
+
+/* super block features */
+#define AUFS_FEATURE_INLINE		0x00000001u
+#define AUFS_FEATURE_COMPRESS	0x00000002u
+/* bitmaps may span several blocks, inodes may hold several extents */
+#define AUFS_FEATURE_LARGE		0x00000004u
+/* directories hold struct aufs_dir_record instead of aufs_dir_entry */
+#define AUFS_FEATURE_DIRENTS	0x00000008u
+/* file extents at block 0 are holes, see struct aufs_dextent */
+#define AUFS_FEATURE_SPARSE		0x00000010u
+
+/* where images without AUFS_FEATURE_LARGE keep the inode bitmap and table */
+#define AUFS_LEGACY_INODE_BITMAP	2
+#define AUFS_LEGACY_INODE_TABLE		3
+
+/* inode flags live in the upper half of the on-disk mode */
+#define AUFS_INODE_FLAGS_MASK	0xFFFF0000u
+/* file data is stored in the inode table slots following the inode */
+#define AUFS_INODE_INLINE		0x00010000u
+/* file data is split into clusters compressed with lz4 or zstd */
+#define AUFS_INODE_LZ4			0x00020000u
+#define AUFS_INODE_ZSTD			0x00040000u
+#define AUFS_INODE_COMPRESSED	(AUFS_INODE_LZ4 | AUFS_INODE_ZSTD)
+/* the next inode table slot holds struct aufs_dinode_ext */
+#define AUFS_INODE_EXTENDED		0x00080000u
+
+#define AUFS_FILENAME_MAXLEN	28
+#define AUFS_NAME_MAXLEN		255
+#define AUFS_INLINE_EXTENTS		2
+/* compression clusters are a page at least and 1 MiB at most */
+#define AUFS_MAX_CLUSTER_BITS	20
+
+/* block 0 */
+struct aufs_dsuper_block
+{
+	AUFS_BE32 magic;
+	AUFS_BE32 block_size;
+	AUFS_BE32 root_ino;
+	AUFS_BE32 features;
+	AUFS_BE32 cluster_bits;
+	AUFS_BE32 blocks_count;
+	AUFS_BE32 inodes_count;
+	AUFS_BE32 inode_bitmap;
+	AUFS_BE32 inode_table;
+};
+
+struct aufs_dinode
+{
+	AUFS_BE32 block;
+	AUFS_BE32 blocks;
+	AUFS_BE32 length;
+	AUFS_BE32 uid;
+	AUFS_BE32 gid;
+	AUFS_BE32 mode;
+	AUFS_BE64 ctime;
+};
+
+/*
+ * Extents map consecutive file blocks. Block 0 holds the super block and
+ * never file data, an extent starting there is a hole that reads as zeros.
+ */
+struct aufs_dextent
+{
+	AUFS_BE32 block;
+	AUFS_BE32 blocks;
+};
+
+/*
+ * Extended inodes take the next table slot as well: it keeps the upper
+ * half of the length, the link count and the extent list. Lists that do
+ * not fit in the slot are kept in a separate overflow block. Files with
+ * several links are always extended, nlink 0 reads as a single link.
+ */
+struct aufs_dinode_ext
+{
+	AUFS_BE32 length_hi;
+	AUFS_BE32 nlink;
+	AUFS_BE32 extents;
+	AUFS_BE32 overflow;
+	struct aufs_dextent extent[AUFS_INLINE_EXTENTS];
+};
+
+struct aufs_dir_entry
+{
+	char name[AUFS_FILENAME_MAXLEN];
+	AUFS_BE32 inode_no;
+};
+
+/*
+ * Variable length directory record, the name (not terminated) follows
+ * the header. Records are packed in the order they were added and never
+ * cross a block boundary; a zero name_len ends the records of a block.
+ * type is the S_IFMT part of the child mode shifted down, as in DT_*.
+ */
+struct aufs_dir_record
+{
+	uint8_t name_len;
+	uint8_t type;
+	uint8_t reserved[2];
+	AUFS_BE32 inode_no;
+};
+
+#define AUFS_DIR_RECORD_ALIGN	4
+#define AUFS_DIR_RECORD_SIZE(name_len) \
+	((sizeof(struct aufs_dir_record) + (name_len) + AUFS_DIR_RECORD_ALIGN - 1) & \
+		~(size_t)(AUFS_DIR_RECORD_ALIGN - 1))
+
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dsuper_block) == 36, "super block size");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dsuper_block, cluster_bits) == 16, "super block layout");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dsuper_block, inode_table) == 32, "super block layout");
+
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dinode) == 32, "inode size");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dinode, mode) == 20, "inode layout");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dinode, ctime) == 24, "inode layout");
+
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dextent) == 8, "extent size");
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dinode_ext) == sizeof(struct aufs_dinode),
+		"inode extension takes one slot");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dinode_ext, extent) == 16, "inode extension layout");
+
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dir_entry) == 32, "directory entry size");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dir_entry, inode_no) == AUFS_FILENAME_MAXLEN,
+		"directory entry layout");
+
+AUFS_STATIC_ASSERT(sizeof(struct aufs_dir_record) == 8, "directory record size");
+AUFS_STATIC_ASSERT(offsetof(struct aufs_dir_record, inode_no) == 4, "directory record layout");
+AUFS_STATIC_ASSERT(AUFS_DIR_RECORD_SIZE(AUFS_NAME_MAXLEN) < 1024,
+		"the longest record fits the smallest block");
+
+#endif /*__AUFS_FORMAT_H__*/
@@ -0,0 +1,255 @@
+#include <linux/highmem.h>
+#include <linux/lz4.h>
+#include <linux/mm.h>
+#include <linux/pagemap.h>
+#include <linux/slab.h>
+#include <linux/zstd.h>
+
+#include "super.h"
+#include "inode.h"
+#include "compress.h"
+
+struct aufs_decompressor
+{
+	struct mutex lock;
+	void *in;
+	void *out;
+	void *workspace;
+	ZSTD_DCtx *zstd;
+};
+
+int aufs_decompressor_init(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	size_t const cluster_size = (size_t)1 << asb->cluster_bits;
+	size_t const workspace_size = ZSTD_DCtxWorkspaceBound();
+	struct aufs_decompressor *d = NULL;
+
+	d = kzalloc(sizeof(struct aufs_decompressor), GFP_KERNEL);
+	if (!d)
+		return -ENOMEM;
+	asb->decomp = d;
+
+	mutex_init(&d->lock);
+	d->in = kvmalloc(cluster_size, GFP_KERNEL);
+	d->out = kvmalloc(cluster_size, GFP_KERNEL);
+	d->workspace = kvmalloc(workspace_size, GFP_KERNEL);
+	if (!d->in || !d->out || !d->workspace)
+		goto nomem;
+
+	d->zstd = ZSTD_initDCtx(d->workspace, workspace_size);
+	if (!d->zstd)
+		goto nomem;
+
+	return 0;
+
+nomem:
+	aufs_decompressor_fini(sb);
+	return -ENOMEM;
+}
+
+void aufs_decompressor_fini(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	struct aufs_decompressor *d = asb->decomp;
+
+	if (!d)
+		return;
+
+	kvfree(d->in);
+	kvfree(d->out);
+	kvfree(d->workspace);
+	kfree(d);
+	asb->decomp = NULL;
+}
+
+static int aufs_read_bytes(struct inode *inode, size_t offset,
+		void *buf, size_t len)
+{
+	size_t const block_size = AUFS_SB(inode->i_sb)->block_size;
+	char *to = (char *)buf;
+
+	while (len)
+	{
+		size_t const in_block = offset % block_size;
+		size_t const count = len < block_size - in_block ?
+					len : block_size - in_block;
+		sector_t const block = aufs_map_block(inode, offset / block_size, NULL);
+		struct buffer_head *bh = NULL;
+
+		if (!block)
+		{
+			pr_err("compress: offset %lu is out of inode %lu\n",
+					(unsigned long)offset, (unsigned long)inode->i_ino);
+			return -EIO;
+		}
+
+		bh = aufs_bread(inode->i_sb, block);
+		if (!bh)
+		{
+			pr_err("compress: cannot read block %u\n", (unsigned)block);
+			return -EIO;
+		}
+
+		memcpy(to, bh->b_data + in_block, count);
+		brelse(bh);
+
+		to += count;
+		offset += count;
+		len -= count;
+	}
+
+	return 0;
+}
+
+/* decompresses cluster into decomp->out, caller holds decomp->lock */
+static int aufs_decompress_cluster(struct inode *inode, pgoff_t cluster,
+		size_t *len)
+{
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	struct aufs_super_block const *const asb = AUFS_SB(inode->i_sb);
+	struct aufs_decompressor *d = asb->decomp;
+	size_t const cluster_size = (size_t)1 << asb->cluster_bits;
+	size_t const extent = (size_t)inode->i_blocks * asb->block_size;
+	loff_t const start = (loff_t)cluster << asb->cluster_bits;
+	size_t const length = inode->i_size - start < cluster_size ?
+				inode->i_size - start : cluster_size;
+
+	__be32 bounds[2];
+	uint32_t from = 0, to = 0;
+	int err = 0;
+
+	err = aufs_read_bytes(inode, cluster * sizeof(__be32),
+			bounds, sizeof(bounds));
+	if (err)
+		return err;
+
+	from = be32_to_cpu(bounds[0]);
+	to = be32_to_cpu(bounds[1]);
+	if (to < from || to - from > length || to > extent)
+	{
+		pr_err("corrupted cluster %lu of inode %lu\n",
+				(unsigned long)cluster, (unsigned long)inode->i_ino);
+		return -EIO;
+	}
+
+	if (to - from == length)
+	{
+		*len = length;
+		return aufs_read_bytes(inode, from, d->out, length);
+	}
+
+	err = aufs_read_bytes(inode, from, d->in, to - from);
+	if (err)
+		return err;
+
+	if (ai->flags & AUFS_INODE_LZ4)
+	{
+		int const ret = LZ4_decompress_safe((char const *)d->in,
+				(char *)d->out, to - from, length);
+		if (ret != (int)length)
+			err = -EIO;
+	}
+	else if (ai->flags & AUFS_INODE_ZSTD)
+	{
+		size_t const ret = ZSTD_decompressDCtx(d->zstd, d->out, cluster_size,
+				d->in, to - from);
+		if (ZSTD_isError(ret) || ret != length)
+			err = -EIO;
+	}
+	else
+		err = -EINVAL;
+
+	if (err)
+	{
+		pr_err("cannot decompress cluster %lu of inode %lu\n",
+				(unsigned long)cluster, (unsigned long)inode->i_ino);
+		return err;
+	}
+
+	*len = length;
+	return 0;
+}
+
+static void aufs_fill_page(struct page *page, void const *data, size_t len)
+{
+	void *const addr = kmap_atomic(page);
+
+	memcpy(addr, data, len);
+	memset((char *)addr + len, 0, PAGE_SIZE - len);
+	kunmap_atomic(addr);
+	flush_dcache_page(page);
+	SetPageUptodate(page);
+}
+
+/*
+ * Decompresses the whole cluster the page belongs to and fills the other
+ * pages of the cluster that are not cached yet, like squashfs does.
+ */
+static int aufs_compressed_readpage(struct file *fp, struct page *page)
+{
+	struct address_space *mapping = page->mapping;
+	struct inode *inode = mapping->host;
+	struct aufs_super_block const *const asb = AUFS_SB(inode->i_sb);
+	struct aufs_decompressor *d = asb->decomp;
+	unsigned const shift = asb->cluster_bits - PAGE_SHIFT;
+	pgoff_t const cluster = page->index >> shift;
+	pgoff_t const first = cluster << shift;
+	pgoff_t const pages = (pgoff_t)1 << shift;
+	pgoff_t it = 0;
+	size_t len = 0;
+	int err = 0;
+
+	if ((loff_t)page->index << PAGE_SHIFT >= i_size_read(inode))
+	{
+		zero_user_segment(page, 0, PAGE_SIZE);
+		SetPageUptodate(page);
+		unlock_page(page);
+		return 0;
+	}
+
+	mutex_lock(&d->lock);
+	err = aufs_decompress_cluster(inode, cluster, &len);
+	if (err)
+	{
+		mutex_unlock(&d->lock);
+		SetPageError(page);
+		unlock_page(page);
+		return err;
+	}
+
+	for (; it != pages && (it << PAGE_SHIFT) < len; ++it)
+	{
+		size_t const offset = it << PAGE_SHIFT;
+		size_t const count = len - offset < PAGE_SIZE ? len - offset : PAGE_SIZE;
+		struct page *p = page;
+
+		if (first + it != page->index)
+		{
+			p = grab_cache_page_nowait(mapping, first + it);
+			if (!p)
+				continue;
+			if (PageUptodate(p))
+			{
+				unlock_page(p);
+				put_page(p);
+				continue;
+			}
+		}
+
+		aufs_fill_page(p, (char const *)d->out + offset, count);
+		if (p != page)
+		{
+			unlock_page(p);
+			put_page(p);
+		}
+	}
+	mutex_unlock(&d->lock);
+
+	unlock_page(page);
+	return 0;
+}
+
+struct address_space_operations const aufs_compressed_aops = {
+	.readpage = aufs_compressed_readpage,
+};
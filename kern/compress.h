@@ -0,0 +1,23 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include <linux/fs.h>
+
+#include <aufs_format.h>
+
+/*
+ * Compressed file extent starts with a table of (clusters + 1) big endian
+ * byte offsets relative to the extent start, followed by the clusters.
+ * A cluster stored with its uncompressed size is kept raw.
+ */
+
+#define AUFS_MIN_CLUSTER_BITS	PAGE_SHIFT
+
+struct aufs_decompressor;
+
+int aufs_decompressor_init(struct super_block *sb);
+void aufs_decompressor_fini(struct super_block *sb);
+
+extern struct address_space_operations const aufs_compressed_aops;
+
+#endif /*__COMPRESS_H__*/
@@ -1,16 +1,15 @@
+#include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/fiemap.h>
+#include <linux/iomap.h>
 #include <linux/slab.h>
+#include <linux/uio.h>
 
 #include "super.h"
 #include "inode.h"
-
-#define AUFS_FILENAME_MAXLEN	0x0000001C
-
-struct aufs_dir_entry
-{
-	char name[AUFS_FILENAME_MAXLEN];
-	__be32 inode_no;
-};
+#include "compress.h"
+#include "metacache.h"
+#include "trace.h"
 
 static struct kmem_cache *aufs_inode_cache;
 
@@ -34,12 +33,13 @@ static uint32_t aufs_find_entry(struct inode *inode, char const *name,
 		size_t slot = 0;
 		struct aufs_dir_entry *dirs = NULL;
 
-		struct buffer_head *bh = sb_bread(inode->i_sb, block);
+		struct buffer_head *bh = aufs_bread(inode->i_sb, block);
 		if (!bh)
 		{
 			pr_err("find: cannot read block %u\n", (unsigned)block);
 			return 0;
 		}
+		aufs_stat_inc(inode->i_sb, AUFS_STAT_DIR_BLOCKS);
 
 		dirs = (struct aufs_dir_entry *)bh->b_data;
 		for (; slot != slots; ++slot)
@@ -58,24 +58,102 @@ static uint32_t aufs_find_entry(struct inode *inode, char const *name,
 	return 0;
 }
 
+/*
+ * Returns the record at offset of the block or NULL past the last one,
+ * records running over the block end are reported and taken as the end.
+ */
+static struct aufs_dir_record const *aufs_dir_record(struct inode *inode,
+		struct buffer_head *bh, size_t offset)
+{
+	size_t const block_size = AUFS_SB(inode->i_sb)->block_size;
+	struct aufs_dir_record const *rec = NULL;
+
+	if (offset + sizeof(struct aufs_dir_record) > block_size)
+		return NULL;
+
+	rec = (struct aufs_dir_record const *)(bh->b_data + offset);
+	if (!rec->name_len)
+		return NULL;
+
+	if (offset + AUFS_DIR_RECORD_SIZE(rec->name_len) > block_size)
+	{
+		pr_err("dir %lu has a record past the block end\n",
+				(unsigned long)inode->i_ino);
+		return NULL;
+	}
+	return rec;
+}
+
+static uint32_t aufs_find_record(struct inode *inode, char const *name,
+		size_t len)
+{
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	size_t block = ai->block;
+	size_t const end = block + inode->i_blocks;
+
+	for (; block != end; ++block)
+	{
+		struct aufs_dir_record const *rec = NULL;
+		size_t offset = 0;
+
+		struct buffer_head *bh = aufs_bread(inode->i_sb, block);
+		if (!bh)
+		{
+			pr_err("find: cannot read block %u\n", (unsigned)block);
+			return 0;
+		}
+		aufs_stat_inc(inode->i_sb, AUFS_STAT_DIR_BLOCKS);
+
+		while ((rec = aufs_dir_record(inode, bh, offset)))
+		{
+			if (rec->name_len == len &&
+					!memcmp(name, (char const *)(rec + 1), len))
+			{
+				uint32_t const ino = be32_to_cpu(rec->inode_no);
+
+				brelse(bh);
+				return ino;
+			}
+			offset += AUFS_DIR_RECORD_SIZE(rec->name_len);
+		}
+		brelse(bh);
+	}
+
+	return 0;
+}
+
 static struct dentry *aufs_lookup(struct inode *dir, struct dentry *dentry,
 		unsigned int flags)
 {
 	struct inode *inode = NULL;
 	uint32_t ino = 0;
+	u64 const start = ktime_get_ns();
+	bool const records = AUFS_SB(dir->i_sb)->features & AUFS_FEATURE_DIRENTS;
 
-	if (dentry->d_name.len <= 0 || dentry->d_name.len >= AUFS_FILENAME_MAXLEN)
-		return NULL;
+	aufs_stat_inc(dir->i_sb, AUFS_STAT_LOOKUPS);
+
+	if (dentry->d_name.len <= 0 || dentry->d_name.len >
+			(records ? AUFS_NAME_MAXLEN : AUFS_FILENAME_MAXLEN - 1))
+		goto out;
 
 	pr_debug("aufs lookup called for %s\n", dentry->d_name.name);
 
-	ino = aufs_find_entry(dir, dentry->d_name.name, (size_t)dentry->d_name.len);
+	if (records)
+		ino = aufs_find_record(dir, dentry->d_name.name,
+					(size_t)dentry->d_name.len);
+	else
+		ino = aufs_find_entry(dir, dentry->d_name.name,
+					(size_t)dentry->d_name.len);
 	if (ino)
 		inode = aufs_inode_get(dir->i_sb, ino);
 
 	if (inode)
 		d_add(dentry, inode);
 
+out:
+	if (!ino)
+		aufs_stat_inc(dir->i_sb, AUFS_STAT_LOOKUP_MISSES);
+	trace_aufs_lookup(dir, dentry, ino, ktime_get_ns() - start);
 	return NULL;
 }
 
@@ -83,6 +161,44 @@ static struct inode_operations const aufs_dir_inode_ops = {
 	.lookup = aufs_lookup,
 };
 
+/* positions past the dots are byte offsets into the directory blocks */
+static void aufs_iterate_records(struct inode *inode, struct dir_context *ctx)
+{
+	struct aufs_inode *ai = AUFS_I(inode);
+	size_t const block_size = AUFS_SB(inode->i_sb)->block_size;
+	loff_t const end = (loff_t)inode->i_blocks * block_size;
+
+	while (ctx->pos - 2 < end)
+	{
+		size_t const block = (ctx->pos - 2) / block_size;
+		size_t offset = (ctx->pos - 2) % block_size;
+		struct aufs_dir_record const *rec = NULL;
+
+		struct buffer_head *bh = aufs_bread(inode->i_sb, ai->block + block);
+		if (!bh)
+		{
+			pr_err("iterate: cannot read block %u\n",
+					(unsigned)(ai->block + block));
+			return;
+		}
+		aufs_stat_inc(inode->i_sb, AUFS_STAT_DIR_BLOCKS);
+
+		while ((rec = aufs_dir_record(inode, bh, offset)))
+		{
+			if (!dir_emit(ctx, (char const *)(rec + 1), rec->name_len,
+						be32_to_cpu(rec->inode_no), rec->type))
+			{
+				brelse(bh);
+				return;
+			}
+			offset += AUFS_DIR_RECORD_SIZE(rec->name_len);
+			ctx->pos = 2 + (loff_t)block * block_size + offset;
+		}
+		brelse(bh);
+		ctx->pos = 2 + (loff_t)(block + 1) * block_size;
+	}
+}
+
 static int aufs_iterate(struct file *fp, struct dir_context *ctx)
 {
 	struct inode *inode = file_inode(fp);
@@ -93,14 +209,22 @@ static int aufs_iterate(struct file *fp, struct dir_context *ctx)
 	size_t block = 0;
 	size_t end = 0;
 	size_t entry = 0;
+	loff_t const pos = ctx->pos;
+	u64 const start = ktime_get_ns();
 
 	pr_debug("aufs readdir %s\n", (char const *)fp->f_path.dentry->d_name.name);
 
 	if (!dir_emit_dots(fp, ctx))
-		return 0;
+		goto out;
+
+	if (AUFS_SB(inode->i_sb)->features & AUFS_FEATURE_DIRENTS)
+	{
+		aufs_iterate_records(inode, ctx);
+		goto out;
+	}
 
 	if (ctx->pos >= inode->i_size + 2)
-		return 0;
+		goto out;
 
 	block = ai->block + (ctx->pos - 2) / in_block;
 	end = ai->block + inode->i_blocks;
@@ -113,12 +237,13 @@ static int aufs_iterate(struct file *fp, struct dir_context *ctx)
 		size_t slot = entry % in_block;
 		struct aufs_dir_entry *dirs = NULL;
 
-		struct buffer_head *bh = sb_bread(inode->i_sb, block);
+		struct buffer_head *bh = aufs_bread(inode->i_sb, block);
 		if (!bh)
 		{
 			pr_err("iterate: cannot read block %u\n", (unsigned)block);
-			return 0;
+			goto out;
 		}
+		aufs_stat_inc(inode->i_sb, AUFS_STAT_DIR_BLOCKS);
 
 		dirs = (struct aufs_dir_entry *)bh->b_data;
 		for (; slot != slots; ++slot)
@@ -133,6 +258,8 @@ static int aufs_iterate(struct file *fp, struct dir_context *ctx)
 	}
 	ctx->pos = entry + 2;
 
+out:
+	trace_aufs_iterate(inode, pos, ktime_get_ns() - start);
 	return 0;
 }
 
@@ -143,63 +270,392 @@ static struct file_operations const aufs_dir_file_ops = {
 	.read = generic_read_dir,
 };
 
+/*
+ * Maps file block to the device block, count (if any) receives the number
+ * of blocks left in the extent. Returns 0 for holes, where count is set,
+ * and for blocks past the extents, where it is not.
+ */
+sector_t aufs_map_block(struct inode *inode, sector_t iblock, sector_t *count)
+{
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	uint32_t i = 0;
+
+	for (; i != ai->extents; ++i)
+	{
+		struct aufs_extent const *const ext = ai->extent + i;
 
-ssize_t aufs_read(struct file *fp, char __user *buf, size_t len, loff_t *ppos)
+		if (iblock < ext->blocks)
+		{
+			if (count)
+				*count = ext->blocks - iblock;
+			return ext->block ? ext->block + iblock : 0;
+		}
+		iblock -= ext->blocks;
+	}
+
+	return 0;
+}
+
+static int aufs_iomap_begin(struct inode *inode, loff_t pos, loff_t length,
+		unsigned flags, struct iomap *iomap, struct iomap *srcmap)
 {
-	struct inode *inode = file_inode(fp);
-	struct aufs_super_block *asb = AUFS_SB(inode->i_sb);
-	struct aufs_inode *ai = AUFS_I(inode);
-	struct buffer_head *bh = NULL;
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	size_t const block_size = AUFS_SB(inode->i_sb)->block_size;
+	sector_t const iblock = pos / block_size;
+	sector_t count = 0;
+	sector_t block = 0;
 
-	size_t const block = ai->block + *ppos / asb->block_size;
-	size_t const offset = *ppos % asb->block_size;
+	if (flags & (IOMAP_WRITE | IOMAP_ZERO))
+		return -EROFS;
 
-	size_t remain = 0, in_block = 0, count = 0;
+	iomap->bdev = inode->i_sb->s_bdev;
+	iomap->flags = 0;
 
-	if (*ppos >= inode->i_size)
+	/* only fiemap gets here for inline files, reads take another path */
+	if ((ai->flags & AUFS_INODE_INLINE) && pos < inode->i_size)
+	{
+		iomap->type = IOMAP_INLINE;
+		iomap->addr = (u64)ai->block * block_size + ai->offset;
+		iomap->offset = 0;
+		iomap->length = inode->i_size;
 		return 0;
+	}
+
+	block = aufs_map_block(inode, iblock, &count);
+	if (!block)
+	{
+		iomap->type = IOMAP_HOLE;
+		iomap->addr = IOMAP_NULL_ADDR;
+		iomap->offset = count ? (loff_t)iblock * block_size : pos;
+		iomap->length = count ? (u64)count * block_size : length;
+		return 0;
+	}
+
+	iomap->type = IOMAP_MAPPED;
+	iomap->addr = (u64)block * block_size;
+	iomap->offset = (loff_t)iblock * block_size;
+	iomap->length = (u64)count * block_size;
+	return 0;
+}
+
+static struct iomap_ops const aufs_iomap_ops = {
+	.iomap_begin = aufs_iomap_begin,
+};
+
+/*
+ * Compressed extents do not map file offsets, they are reported as
+ * encoded with logical offsets into the compressed stream.
+ */
+static int aufs_fiemap_encoded(struct inode *inode,
+		struct fiemap_extent_info *fieinfo, u64 start, u64 len)
+{
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	size_t const block_size = AUFS_SB(inode->i_sb)->block_size;
+	u64 logical = 0;
+	uint32_t i = 0;
+	int err = fiemap_prep(inode, fieinfo, start, &len, 0);
+
+	if (err)
+		return err;
+
+	for (; i != ai->extents && logical < start + len; ++i)
+	{
+		u64 const bytes = (u64)ai->extent[i].blocks * block_size;
+		u32 const flags = FIEMAP_EXTENT_ENCODED |
+				(i + 1 == ai->extents ? FIEMAP_EXTENT_LAST : 0);
+
+		if (logical + bytes > start)
+		{
+			err = fiemap_fill_next_extent(fieinfo, logical,
+					(u64)ai->extent[i].block * block_size, bytes, flags);
+			if (err)
+				return err < 0 ? err : 0;
+		}
+		logical += bytes;
+	}
 
-	remain = inode->i_size - *ppos;
-	in_block = remain < (asb->block_size - offset) ?
-				remain : asb->block_size - offset;
-	count = len < in_block ? len : in_block;
+	return 0;
+}
+
+static loff_t aufs_llseek(struct file *fp, loff_t offset, int whence)
+{
+	struct inode *inode = file_inode(fp);
+	loff_t ret = 0;
+
+	/* only plain files have holes, the rest is data up to the end */
+	if ((whence != SEEK_DATA && whence != SEEK_HOLE) ||
+			(AUFS_I(inode)->flags & (AUFS_INODE_INLINE | AUFS_INODE_COMPRESSED)))
+		return generic_file_llseek(fp, offset, whence);
+
+	inode_lock_shared(inode);
+	if (whence == SEEK_DATA)
+		ret = iomap_seek_data(inode, offset, &aufs_iomap_ops);
+	else
+		ret = iomap_seek_hole(inode, offset, &aufs_iomap_ops);
+	inode_unlock_shared(inode);
+
+	if (ret < 0)
+		return ret;
+	return vfs_setpos(fp, ret, inode->i_sb->s_maxbytes);
+}
+
+static int aufs_fiemap(struct inode *inode, struct fiemap_extent_info *fieinfo,
+		u64 start, u64 len)
+{
+	if (AUFS_I(inode)->flags & AUFS_INODE_COMPRESSED)
+		return aufs_fiemap_encoded(inode, fieinfo, start, len);
+	return iomap_fiemap(inode, fieinfo, start, len, &aufs_iomap_ops);
+}
+
+static sector_t aufs_bmap(struct address_space *mapping, sector_t block)
+{
+	return iomap_bmap(mapping, block, &aufs_iomap_ops);
+}
+
+static struct inode_operations const aufs_file_inode_ops = {
+	.fiemap = aufs_fiemap,
+};
 
-	bh = sb_bread(inode->i_sb, block);
-	if (!bh)
+static ssize_t aufs_direct_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	ssize_t ret = 0;
+
+	if (iocb->ki_flags & IOCB_NOWAIT)
 	{
-		pr_err("cannot read block %u\n", (unsigned)block);
-		return -EIO;
+		if (!inode_trylock_shared(inode))
+			return -EAGAIN;
 	}
+	else
+		inode_lock_shared(inode);
 
-	if (copy_to_user(buf, (char const *)bh->b_data + offset, count))
+	ret = iomap_dio_rw(iocb, to, &aufs_iomap_ops, NULL,
+			is_sync_kiocb(iocb));
+	inode_unlock_shared(inode);
+
+	return ret;
+}
+
+static ssize_t aufs_buffered_read(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	struct aufs_super_block *asb = AUFS_SB(inode->i_sb);
+	struct aufs_inode *ai = AUFS_I(inode);
+	ssize_t read = 0;
+
+	while (iov_iter_count(to) && iocb->ki_pos < inode->i_size)
 	{
+		loff_t const at = ai->offset + iocb->ki_pos;
+		sector_t hole = 0;
+		sector_t const block = (ai->flags & AUFS_INODE_INLINE) ?
+					ai->block + at / asb->block_size :
+					aufs_map_block(inode, at / asb->block_size, &hole);
+		size_t const offset = at % asb->block_size;
+		size_t const remain = inode->i_size - iocb->ki_pos;
+		size_t const in_block = remain < (asb->block_size - offset) ?
+					remain : asb->block_size - offset;
+		size_t copied = 0;
+		struct buffer_head *bh = NULL;
+		char const *data = NULL;
+
+		/* holes read as zeros without touching the device */
+		if (!block && hole)
+		{
+			copied = iov_iter_zero(in_block, to);
+			iocb->ki_pos += copied;
+			read += copied;
+			if (copied != in_block && iov_iter_count(to))
+				return read ? read : -EFAULT;
+			continue;
+		}
+
+		if (!block)
+		{
+			pr_err("inode %lu has no block for offset %lld\n",
+					(unsigned long)inode->i_ino, (long long)iocb->ki_pos);
+			return read ? read : -EIO;
+		}
+
+		/* inline files live in the inode table that may be pinned */
+		data = aufs_meta_block(inode->i_sb, block);
+		if (!data)
+		{
+			bh = aufs_bread(inode->i_sb, block);
+			if (!bh)
+			{
+				pr_err("cannot read block %u\n", (unsigned)block);
+				return read ? read : -EIO;
+			}
+			data = bh->b_data;
+		}
+
+		copied = copy_to_iter(data + offset, in_block, to);
 		brelse(bh);
-		pr_err("cannot copy buffer_ to userspace\n");
-		return -EFAULT;
+
+		iocb->ki_pos += copied;
+		read += copied;
+		if (copied != in_block && iov_iter_count(to))
+		{
+			pr_err("cannot copy buffer_ to userspace\n");
+			return read ? read : -EFAULT;
+		}
 	}
 
-	brelse(bh);
-	*ppos += count;
+	return read;
+}
+
+static ssize_t aufs_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct inode *inode = file_inode(iocb->ki_filp);
+	loff_t const pos = iocb->ki_pos;
+	size_t const len = iov_iter_count(to);
+	u64 const start = ktime_get_ns();
+	ssize_t ret = 0;
+
+	if (AUFS_I(inode)->flags & AUFS_INODE_COMPRESSED)
+	{
+		iocb->ki_flags &= ~IOCB_DIRECT;
+		ret = generic_file_read_iter(iocb, to);
+	}
+	else if ((iocb->ki_flags & IOCB_DIRECT) &&
+			!(AUFS_I(inode)->flags & AUFS_INODE_INLINE))
+		ret = aufs_direct_read(iocb, to);
+	else
+		ret = aufs_buffered_read(iocb, to);
+
+	if (ret > 0)
+		aufs_stat_add(inode->i_sb, AUFS_STAT_READ_BYTES, ret);
+	trace_aufs_read(inode, pos, len, ret, ktime_get_ns() - start);
+	return ret;
+}
+
+/*
+ * Small files are mostly read whole right after open, so all their blocks
+ * are read ahead here and the first read finds them in the buffer cache.
+ */
+static int aufs_file_open(struct inode *inode, struct file *fp)
+{
+	struct super_block *sb = inode->i_sb;
+	struct aufs_inode const *const ai = AUFS_I(inode);
+	sector_t const blocks = DIV_ROUND_UP(inode->i_size, AUFS_SB(sb)->block_size);
+	struct blk_plug plug;
+	sector_t iblock = 0;
+
+	/* inline data came with the inode, compressed and direct reads skip buffers */
+	if (!inode->i_size || inode->i_size > AUFS_SB(sb)->prefetch_max ||
+			(ai->flags & (AUFS_INODE_INLINE | AUFS_INODE_COMPRESSED)) ||
+			(fp->f_flags & O_DIRECT))
+		return generic_file_open(inode, fp);
+
+	blk_start_plug(&plug);
+	while (iblock < blocks)
+	{
+		sector_t count = 0;
+		sector_t const block = aufs_map_block(inode, iblock, &count);
+		sector_t i = 0;
+
+		if (!count)
+			break;
+		if (count > blocks - iblock)
+			count = blocks - iblock;
+
+		/* holes have nothing to read */
+		if (block)
+		{
+			for (i = 0; i != count; ++i)
+				sb_breadahead(sb, block + i);
+			aufs_stat_add(sb, AUFS_STAT_PREFETCH_BLOCKS, count);
+		}
+		iblock += count;
+	}
+	blk_finish_plug(&plug);
 
-	return count;
+	return generic_file_open(inode, fp);
 }
 
 static struct file_operations const aufs_file_file_ops = {
 	.owner = THIS_MODULE,
-	.read = aufs_read,
+	.open = aufs_file_open,
+	.llseek = aufs_llseek,
+	.read_iter = aufs_read_iter,
 };
 
-struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
+static struct address_space_operations const aufs_file_aops = {
+	.direct_IO = noop_direct_IO,
+	.bmap = aufs_bmap,
+};
+
+static int aufs_read_extents(struct inode *inode,
+		struct aufs_dinode_ext const *ext)
+{
+	struct super_block *sb = inode->i_sb;
+	struct aufs_inode *ai = AUFS_I(inode);
+	uint32_t const count = be32_to_cpu(ext->extents);
+	struct aufs_dextent const *dext = ext->extent;
+	struct buffer_head *bh = NULL;
+	uint32_t i = 0;
+
+	if (count > AUFS_INLINE_EXTENTS)
+	{
+		uint32_t const block = be32_to_cpu(ext->overflow);
+
+		if (count > AUFS_SB(sb)->block_size / sizeof(struct aufs_dextent))
+		{
+			pr_err("inode %lu has too many extents\n",
+					(unsigned long)inode->i_ino);
+			return -EIO;
+		}
+
+		ai->extent = kmalloc_array(count, sizeof(struct aufs_extent),
+					GFP_NOFS);
+		if (!ai->extent)
+		{
+			ai->extent = ai->ext_inline;
+			return -ENOMEM;
+		}
+
+		bh = aufs_bread(sb, block);
+		if (!bh)
+		{
+			pr_err("inode: cannot read extents block %u\n",
+					(unsigned)block);
+			return -EIO;
+		}
+		dext = (struct aufs_dextent const *)bh->b_data;
+	}
+
+	for (; i != count; ++i)
+	{
+		ai->extent[i].block = be32_to_cpu(dext[i].block);
+		ai->extent[i].blocks = be32_to_cpu(dext[i].blocks);
+		if (!ai->extent[i].block &&
+				!(AUFS_SB(sb)->features & AUFS_FEATURE_SPARSE))
+		{
+			pr_err("inode %lu has a hole on an image without holes\n",
+					(unsigned long)inode->i_ino);
+			brelse(bh);
+			return -EIO;
+		}
+	}
+	ai->extents = count;
+	brelse(bh);
+
+	return 0;
+}
+
+static struct inode *aufs_inode_read(struct super_block *sb, uint32_t no)
 {
 	struct aufs_super_block const *const asb = AUFS_SB(sb);
 	uint32_t const in_block = asb->block_size / sizeof(struct aufs_dinode);
 	struct buffer_head *bh = NULL;
-	struct aufs_dinode *di = NULL;
+	struct aufs_dinode const *di = NULL;
 	struct aufs_inode *ai = NULL;
 	struct inode *inode = NULL;
 
 	uint32_t block_no = 0;
 	uint32_t block_in = 0;
+	uint32_t slots = 1;
+	int err = -EIO;
 
 	inode = iget_locked(sb, no);
 	if (!inode)
@@ -209,23 +665,65 @@ struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
 		return inode;
 
 	ai = AUFS_I(inode);
-	block_no = 3 + no / in_block;
+	block_no = asb->inode_table + no / in_block;
 	block_in = no % in_block;
 
 	pr_debug("read inode block %u, offset = %u\n", (unsigned)block_no, (unsigned)block_in);
 
-	bh = sb_bread(sb, block_no);
-	if (!bh)
+	di = aufs_meta_block(sb, block_no);
+	if (!di)
 	{
-		pr_err("inode: cannot read block %u\n", (unsigned)block_no);
-		goto read_error;
+		bh = aufs_bread(sb, block_no);
+		if (!bh)
+		{
+			pr_err("inode: cannot read block %u\n", (unsigned)block_no);
+			goto read_error;
+		}
+		di = (struct aufs_dinode const *)bh->b_data;
 	}
+	aufs_stat_inc(sb, AUFS_STAT_INODE_READS);
 
-	di = (struct aufs_dinode *)(bh->b_data) + block_in;
+	di += block_in;
 	ai->block = be32_to_cpu(di->block);
-	inode->i_mode = be32_to_cpu(di->mode);
+	ai->offset = 0;
+	ai->flags = be32_to_cpu(di->mode) & AUFS_INODE_FLAGS_MASK;
+	inode->i_mode = be32_to_cpu(di->mode) & ~AUFS_INODE_FLAGS_MASK;
 	inode->i_size = be32_to_cpu(di->length);
 	inode->i_blocks = be32_to_cpu(di->blocks);
+
+	ai->extents = inode->i_blocks ? 1 : 0;
+	ai->ext_inline[0].block = ai->block;
+	ai->ext_inline[0].blocks = inode->i_blocks;
+	if (ai->flags & AUFS_INODE_EXTENDED)
+	{
+		struct aufs_dinode_ext const *const ext =
+					(struct aufs_dinode_ext const *)(di + 1);
+
+		if (block_in + 1 == in_block)
+		{
+			pr_err("inode %u extension is out of block\n", (unsigned)no);
+			brelse(bh);
+			goto read_error;
+		}
+
+		inode->i_size |= (loff_t)be32_to_cpu(ext->length_hi) << 32;
+		if (ext->nlink)
+			set_nlink(inode, be32_to_cpu(ext->nlink));
+		err = aufs_read_extents(inode, ext);
+		if (err)
+		{
+			brelse(bh);
+			goto read_error;
+		}
+		++slots;
+	}
+
+	if (ai->flags & AUFS_INODE_INLINE)
+	{
+		ai->block = block_no;
+		ai->offset = (block_in + slots) * sizeof(struct aufs_dinode);
+		ai->extents = 0;
+	}
 	inode->i_ctime.tv_sec = (uint32_t)be64_to_cpu(di->ctime);
 	inode->i_mtime.tv_sec = inode->i_atime.tv_sec =
 			inode->i_ctime.tv_sec;
@@ -242,8 +740,13 @@ struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
 		inode->i_fop = &aufs_dir_file_ops;
 		break;
 	case S_IFREG:
-		inode->i_op = &aufs_dir_inode_ops;
+		inode->i_op = &aufs_file_inode_ops;
 		inode->i_fop = &aufs_file_file_ops;
+		if (ai->flags & AUFS_INODE_COMPRESSED)
+			inode->i_mapping->a_ops = &aufs_compressed_aops;
+		else
+			inode->i_mapping->a_ops = &aufs_file_aops;
+		break;
 	default:
 		pr_err("undefined inode format %x\n",
 				(unsigned)inode->i_mode & S_IFMT);
@@ -251,14 +754,14 @@ struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
 	}
 
 	pr_debug("inode %u info:\n"
-				"\tlength = %u\n"
+				"\tlength = %llu\n"
 				"\tblock  = %u\n"
 				"\tblocks = %u\n"
 				"\tuid    = %u\n"
 				"\tgid    = %u\n"
 				"\tmode   = %o\n",
 				(unsigned)inode->i_ino,
-				(unsigned)inode->i_size,
+				(unsigned long long)inode->i_size,
 				(unsigned)ai->block,
 				(unsigned)inode->i_blocks,
 				(unsigned)inode->i_uid,
@@ -271,7 +774,17 @@ struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
 read_error:
 	pr_err("Cannot read inode %u\n", (unsigned)no);
 	iget_failed(inode);
-	return ERR_PTR(-EIO);
+	return ERR_PTR(err);
+}
+
+struct inode *aufs_inode_get(struct super_block *sb, uint32_t no)
+{
+	u64 const start = ktime_get_ns();
+	struct inode *const inode = aufs_inode_read(sb, no);
+
+	trace_aufs_inode_get(sb, no, IS_ERR(inode) ? (int)PTR_ERR(inode) : 0,
+			ktime_get_ns() - start);
+	return inode;
 }
 
 struct inode *aufs_alloc_inode(struct super_block *sb)
@@ -280,6 +793,8 @@ struct inode *aufs_alloc_inode(struct super_block *sb)
 		(struct aufs_inode *)kmem_cache_alloc(aufs_inode_cache, GFP_KERNEL);
 	if (!i)
 		return NULL;
+	i->extents = 0;
+	i->extent = i->ext_inline;
 	i->vfs_inode.i_sb = sb;
 	return &i->vfs_inode;
 }
@@ -287,7 +802,11 @@ struct inode *aufs_alloc_inode(struct super_block *sb)
 static void aufs_destroy_callback(struct rcu_head *head)
 {
 	struct inode *const inode = container_of(head, struct inode, i_rcu);
+	struct aufs_inode *const ai = AUFS_I(inode);
+
 	pr_debug("destroing inode %u\n", (unsigned)inode->i_ino);
+	if (ai->extent != ai->ext_inline)
+		kfree(ai->extent);
 	kmem_cache_free(aufs_inode_cache, AUFS_I(inode));
 }
 
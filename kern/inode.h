@@ -3,24 +3,27 @@
 
 #include <linux/fs.h>
 
-struct aufs_dinode
+#include <aufs_format.h>
+
+struct aufs_extent
 {
-	__be32 block;
-	__be32 blocks;
-	__be32 length;
-	__be32 uid;
-	__be32 gid;
-	__be32 mode;
-	__be64 ctime;
+	uint32_t block;
+	uint32_t blocks;
 };
 
 struct aufs_inode
 {
 	struct inode vfs_inode;
 	uint32_t block;
+	uint32_t offset;
+	uint32_t flags;
+	uint32_t extents;
+	struct aufs_extent *extent;
+	struct aufs_extent ext_inline[AUFS_INLINE_EXTENTS];
 };
 
 struct inode *aufs_inode_get(struct super_block *sb, uint32_t no);
+sector_t aufs_map_block(struct inode *inode, sector_t iblock, sector_t *count);
 
 int aufs_create_inode_cache(void);
 void aufs_destroy_inode_cache(void);
@@ -0,0 +1,67 @@
+#include <linux/blkdev.h>
+#include <linux/buffer_head.h>
+#include <linux/mm.h>
+#include <linux/printk.h>
+
+#include "super.h"
+#include "inode.h"
+#include "metacache.h"
+
+/*
+ * Pins the super block, both bitmaps and the inode table: they are laid
+ * out one after another from block 0, so it is a single sequential read.
+ */
+int aufs_metacache_init(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	size_t const in_block = asb->block_size / sizeof(struct aufs_dinode);
+	sector_t const blocks = asb->inode_table +
+				DIV_ROUND_UP(asb->inodes_count, in_block);
+	struct blk_plug plug;
+	char *meta = NULL;
+	sector_t block = 0;
+
+	if (!asb->inodes_count)
+	{
+		pr_err("image does not record its inodes count\n");
+		return -EINVAL;
+	}
+
+	meta = kvmalloc((size_t)blocks * asb->block_size, GFP_KERNEL);
+	if (!meta)
+		return -ENOMEM;
+
+	/* plugged readahead lets the block layer merge it into large requests */
+	blk_start_plug(&plug);
+	for (block = 0; block != blocks; ++block)
+		sb_breadahead(sb, block);
+	blk_finish_plug(&plug);
+
+	for (block = 0; block != blocks; ++block)
+	{
+		struct buffer_head *bh = sb_bread(sb, block);
+		if (!bh)
+		{
+			pr_err("metacache: cannot read block %u\n", (unsigned)block);
+			kvfree(meta);
+			return -EIO;
+		}
+		memcpy(meta + (size_t)block * asb->block_size, bh->b_data,
+					asb->block_size);
+		brelse(bh);
+	}
+
+	asb->meta = meta;
+	asb->meta_blocks = blocks;
+	pr_debug("aufs pinned %u metadata blocks\n", (unsigned)blocks);
+	return 0;
+}
+
+void aufs_metacache_fini(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+
+	kvfree(asb->meta);
+	asb->meta = NULL;
+	asb->meta_blocks = 0;
+}
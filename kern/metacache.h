@@ -0,0 +1,22 @@
+#ifndef __METACACHE_H__
+#define __METACACHE_H__
+
+#include <linux/fs.h>
+
+#include "super.h"
+
+int aufs_metacache_init(struct super_block *sb);
+void aufs_metacache_fini(struct super_block *sb);
+
+/* contents of a pinned metadata block or NULL if the block is not pinned */
+static inline void const *aufs_meta_block(struct super_block *sb,
+		sector_t block)
+{
+	struct aufs_super_block const *const asb = AUFS_SB(sb);
+
+	if (!asb->meta || block >= asb->meta_blocks)
+		return NULL;
+	return asb->meta + (size_t)block * asb->block_size;
+}
+
+#endif /*__METACACHE_H__*/
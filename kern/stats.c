@@ -0,0 +1,98 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "super.h"
+#include "stats.h"
+
+static char const *const aufs_stat_names[AUFS_STAT_NR] = {
+	[AUFS_STAT_LOOKUPS] = "lookups",
+	[AUFS_STAT_LOOKUP_MISSES] = "lookup_misses",
+	[AUFS_STAT_DIR_BLOCKS] = "dir_blocks_scanned",
+	[AUFS_STAT_INODE_READS] = "inode_table_reads",
+	[AUFS_STAT_READ_BYTES] = "file_bytes_read",
+	[AUFS_STAT_BREAD_MISSES] = "bread_misses",
+	[AUFS_STAT_PREFETCH_BLOCKS] = "prefetch_blocks",
+};
+
+static struct dentry *aufs_debugfs_root;
+
+static int aufs_stats_show(struct seq_file *m, void *v)
+{
+	struct super_block *sb = (struct super_block *)m->private;
+	struct aufs_stats __percpu *stats = AUFS_SB(sb)->stats;
+	int item = 0;
+
+	for (; item != AUFS_STAT_NR; ++item)
+	{
+		u64 sum = 0;
+		int cpu;
+
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(stats, cpu)->items[item];
+		seq_printf(m, "%-20s %llu\n", aufs_stat_names[item],
+				(unsigned long long)sum);
+	}
+	return 0;
+}
+
+static int aufs_stats_open(struct inode *inode, struct file *fp)
+{
+	return single_open(fp, aufs_stats_show, inode->i_private);
+}
+
+static struct file_operations const aufs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = aufs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+int aufs_stats_init(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+
+	asb->stats = alloc_percpu(struct aufs_stats);
+	if (!asb->stats)
+		return -ENOMEM;
+
+	if (!aufs_debugfs_root)
+		return 0;
+
+	asb->debugfs = debugfs_create_dir(sb->s_id, aufs_debugfs_root);
+	if (IS_ERR_OR_NULL(asb->debugfs))
+	{
+		pr_warn("cannot create debugfs entry for %s\n", sb->s_id);
+		asb->debugfs = NULL;
+		return 0;
+	}
+	debugfs_create_file("stats", 0444, asb->debugfs, sb, &aufs_stats_fops);
+	return 0;
+}
+
+void aufs_stats_fini(struct super_block *sb)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+
+	debugfs_remove_recursive(asb->debugfs);
+	asb->debugfs = NULL;
+	free_percpu(asb->stats);
+	asb->stats = NULL;
+}
+
+int aufs_create_debugfs(void)
+{
+	aufs_debugfs_root = debugfs_create_dir("aufs", NULL);
+	if (IS_ERR_OR_NULL(aufs_debugfs_root))
+	{
+		pr_warn("debugfs is not available, stats are disabled\n");
+		aufs_debugfs_root = NULL;
+	}
+	return 0;
+}
+
+void aufs_destroy_debugfs(void)
+{
+	debugfs_remove_recursive(aufs_debugfs_root);
+	aufs_debugfs_root = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <linux/fs.h>
+#include <linux/percpu.h>
+
+enum aufs_stat_item
+{
+	AUFS_STAT_LOOKUPS,
+	AUFS_STAT_LOOKUP_MISSES,
+	AUFS_STAT_DIR_BLOCKS,
+	AUFS_STAT_INODE_READS,
+	AUFS_STAT_READ_BYTES,
+	AUFS_STAT_BREAD_MISSES,
+	AUFS_STAT_PREFETCH_BLOCKS,
+	AUFS_STAT_NR
+};
+
+struct aufs_stats
+{
+	u64 items[AUFS_STAT_NR];
+};
+
+int aufs_stats_init(struct super_block *sb);
+void aufs_stats_fini(struct super_block *sb);
+
+int aufs_create_debugfs(void);
+void aufs_destroy_debugfs(void);
+
+#endif /*__STATS_H__*/
@@ -1,31 +1,117 @@
 #include <linux/init.h>
 #include <linux/module.h>
+#include <linux/parser.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/printk.h>
 
 #include "super.h"
 #include "inode.h"
+#include "compress.h"
+#include "metacache.h"
+
+#define CREATE_TRACE_POINTS
+#include "trace.h"
+
+struct buffer_head *aufs_bread(struct super_block *sb, sector_t block)
+{
+	struct buffer_head *bh = sb_find_get_block(sb, block);
+
+	if (bh && buffer_uptodate(bh))
+		return bh;
+	brelse(bh);
+
+	aufs_stat_inc(sb, AUFS_STAT_BREAD_MISSES);
+	return sb_bread(sb, block);
+}
 
 static void aufs_put_super(struct super_block *sb)
 {
 	struct aufs_super_block *asb = (struct aufs_super_block *)sb->s_fs_info;
 	if (asb != NULL)
+	{
+		aufs_metacache_fini(sb);
+		aufs_decompressor_fini(sb);
+		aufs_stats_fini(sb);
 		kfree(asb);
+	}
 	sb->s_fs_info = NULL;
 	pr_debug("aufs super block destroyed\n");
 }
 
+static int aufs_show_options(struct seq_file *m, struct dentry *root)
+{
+	struct aufs_super_block const *const asb = AUFS_SB(root->d_sb);
+
+	if (asb->mount_opts & AUFS_MOUNT_METACACHE)
+		seq_puts(m, ",metacache");
+	if (asb->prefetch_max)
+		seq_printf(m, ",prefetch=%u", (unsigned)asb->prefetch_max);
+	return 0;
+}
+
 static struct super_operations const aufs_super_ops = {
 	.alloc_inode = aufs_alloc_inode,
 	.destroy_inode = aufs_destroy_inode,
 	.put_super = aufs_put_super,
+	.show_options = aufs_show_options,
 };
 
+enum
+{
+	AUFS_OPT_METACACHE,
+	AUFS_OPT_PREFETCH,
+	AUFS_OPT_ERR
+};
+
+static match_table_t const aufs_tokens = {
+	{ AUFS_OPT_METACACHE, "metacache" },
+	{ AUFS_OPT_PREFETCH, "prefetch=%u" },
+	{ AUFS_OPT_ERR, NULL }
+};
+
+static int aufs_parse_options(struct super_block *sb, char *options)
+{
+	struct aufs_super_block *asb = AUFS_SB(sb);
+	substring_t args[MAX_OPT_ARGS];
+	char *p = NULL;
+	int value = 0;
+
+	if (!options)
+		return 0;
+
+	while ((p = strsep(&options, ",")) != NULL)
+	{
+		if (!*p)
+			continue;
+
+		switch (match_token(p, aufs_tokens, args))
+		{
+		case AUFS_OPT_METACACHE:
+			asb->mount_opts |= AUFS_MOUNT_METACACHE;
+			break;
+		case AUFS_OPT_PREFETCH:
+			if (match_int(&args[0], &value) || value < 0)
+			{
+				pr_err("bad prefetch size %s\n", p);
+				return -EINVAL;
+			}
+			asb->prefetch_max = value;
+			break;
+		default:
+			pr_err("unknown mount option %s\n", p);
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
 static struct aufs_super_block *aufs_read_super_block(struct super_block *sb)
 {
 	struct aufs_super_block *asb = (struct aufs_super_block *)
 			kzalloc(sizeof(struct aufs_super_block), GFP_NOFS);
-	struct aufs_super_block *dsb = NULL;
+	struct aufs_dsuper_block const *dsb = NULL;
 	struct buffer_head *bh = NULL;
 
 	if (!asb)
@@ -41,10 +127,21 @@ static struct aufs_super_block *aufs_read_super_block(struct super_block *sb)
 		goto fre;
 	}
 
-	dsb = (struct aufs_super_block *)bh->b_data;
+	dsb = (struct aufs_dsuper_block const *)bh->b_data;
 	asb->magic = be32_to_cpu(dsb->magic);
 	asb->block_size = be32_to_cpu(dsb->block_size);
 	asb->root_ino = be32_to_cpu(dsb->root_ino);
+	asb->features = be32_to_cpu(dsb->features);
+	asb->cluster_bits = be32_to_cpu(dsb->cluster_bits);
+	asb->blocks_count = be32_to_cpu(dsb->blocks_count);
+	asb->inodes_count = be32_to_cpu(dsb->inodes_count);
+	asb->inode_bitmap = AUFS_LEGACY_INODE_BITMAP;
+	asb->inode_table = AUFS_LEGACY_INODE_TABLE;
+	if (asb->features & AUFS_FEATURE_LARGE)
+	{
+		asb->inode_bitmap = be32_to_cpu(dsb->inode_bitmap);
+		asb->inode_table = be32_to_cpu(dsb->inode_table);
+	}
 	brelse(bh);
 
 	if (asb->magic != AUFS_MAGIC_NUMBER)
@@ -53,13 +150,40 @@ static struct aufs_super_block *aufs_read_super_block(struct super_block *sb)
 		goto fre;
 	}
 
+	if (asb->features & ~AUFS_FEATURES_SUPPORTED)
+	{
+		pr_err("unsupported features %x\n",
+				(unsigned)(asb->features & ~AUFS_FEATURES_SUPPORTED));
+		goto fre;
+	}
+
+	if ((asb->features & AUFS_FEATURE_COMPRESS) &&
+			(asb->cluster_bits < AUFS_MIN_CLUSTER_BITS ||
+			asb->cluster_bits > AUFS_MAX_CLUSTER_BITS))
+	{
+		pr_err("unsupported cluster size 2^%u\n", (unsigned)asb->cluster_bits);
+		goto fre;
+	}
+
 	pr_debug("aufs superblock info:\n"
 				"\tmagic        = %u\n"
 				"\tblock_size   = %u\n"
-				"\troot_ino     = %u\n",
+				"\troot_ino     = %u\n"
+				"\tfeatures     = %x\n"
+				"\tcluster_bits = %u\n"
+				"\tblocks_count = %u\n"
+				"\tinodes_count = %u\n"
+				"\tinode_bitmap = %u\n"
+				"\tinode_table  = %u\n",
 				(unsigned)asb->magic,
 				(unsigned)asb->block_size,
-				(unsigned)asb->root_ino);
+				(unsigned)asb->root_ino,
+				(unsigned)asb->features,
+				(unsigned)asb->cluster_bits,
+				(unsigned)asb->blocks_count,
+				(unsigned)asb->inodes_count,
+				(unsigned)asb->inode_bitmap,
+				(unsigned)asb->inode_table);
 
 	return asb;
 
@@ -72,34 +196,76 @@ static int aufs_fill_sb(struct super_block *sb, void *data, int silent)
 {
 	struct aufs_super_block *asb = NULL;
 	struct inode *root = NULL;
+	int ret = 0;
 
 	asb = aufs_read_super_block(sb);
 	if (!asb)
 		return -EINVAL;
 
 	sb->s_magic = asb->magic;
+	sb->s_maxbytes = MAX_LFS_FILESIZE;
 	sb->s_op = &aufs_super_ops;
 	sb->s_fs_info = asb;
 
+	ret = aufs_parse_options(sb, (char *)data);
+	if (ret)
+		goto release;
+
+	ret = aufs_stats_init(sb);
+	if (ret)
+	{
+		pr_err("cannot allocate stats\n");
+		goto release;
+	}
+
+	if (asb->features & AUFS_FEATURE_COMPRESS)
+	{
+		ret = aufs_decompressor_init(sb);
+		if (ret)
+		{
+			pr_err("cannot allocate decompressor\n");
+			goto release;
+		}
+	}
+
 	if (sb_set_blocksize(sb, asb->block_size) == 0)
 	{
 		pr_err("device does not support block size %u\n",
 					(unsigned)asb->block_size);
-		return -EINVAL;
+		ret = -EINVAL;
+		goto release;
+	}
+
+	if (asb->mount_opts & AUFS_MOUNT_METACACHE)
+	{
+		ret = aufs_metacache_init(sb);
+		if (ret)
+		{
+			pr_err("cannot pin metadata\n");
+			goto release;
+		}
 	}
 
 	root = aufs_inode_get(sb, asb->root_ino);
 	if (IS_ERR(root))
-		return PTR_ERR(root);
+	{
+		ret = PTR_ERR(root);
+		goto release;
+	}
 
 	sb->s_root = d_make_root(root);
 	if (!sb->s_root)
 	{
 		pr_err("root creation failed\n");
-		return -ENOMEM;
+		ret = -ENOMEM;
+		goto release;
 	}
 
 	return 0;
+
+release:
+	aufs_put_super(sb);
+	return ret;
 }
 
 static struct dentry *aufs_mount(struct file_system_type *type, int flags,
@@ -130,9 +296,11 @@ static int __init aufs_init(void)
 		pr_err("cannot create inode cache\n");
 		return ret;
 	}
+	aufs_create_debugfs();
 	ret = register_filesystem(&aufs_type);
 	if (ret)
 	{
+		aufs_destroy_debugfs();
 		aufs_destroy_inode_cache();
 		pr_err("cannot register filesystem\n");
 		return ret;
@@ -143,6 +311,7 @@ static int __init aufs_init(void)
 
 static void __exit aufs_fini(void)
 {
+	aufs_destroy_debugfs();
 	aufs_destroy_inode_cache();
 	if (unregister_filesystem(&aufs_type))
 		pr_err("aufs unregistering failed\n");
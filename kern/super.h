@@ -3,13 +3,40 @@
 
 #include <linux/buffer_head.h>
 
-#define AUFS_MAGIC_NUMBER		0x13131313
+#include <aufs_format.h>
+
+#include "stats.h"
+
+#define AUFS_FEATURES_SUPPORTED	(AUFS_FEATURE_INLINE | AUFS_FEATURE_COMPRESS | \
+								AUFS_FEATURE_LARGE | AUFS_FEATURE_DIRENTS | \
+								AUFS_FEATURE_SPARSE)
+
+/* mount options */
+#define AUFS_MOUNT_METACACHE	0x00000001
+
+struct aufs_decompressor;
 
 struct aufs_super_block
 {
 	uint32_t magic;
 	uint32_t block_size;
 	uint32_t root_ino;
+	uint32_t features;
+	uint32_t cluster_bits;
+	uint32_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t inode_bitmap;
+	uint32_t inode_table;
+
+	struct aufs_stats __percpu *stats;
+	struct dentry *debugfs;
+	struct aufs_decompressor *decomp;
+
+	uint32_t mount_opts;
+	/* plain files up to this many bytes are read ahead on open, 0 is off */
+	uint32_t prefetch_max;
+	char *meta;
+	uint32_t meta_blocks;
 };
 
 static inline struct aufs_super_block *AUFS_SB(struct super_block *sb)
@@ -17,4 +44,18 @@ static inline struct aufs_super_block *AUFS_SB(struct super_block *sb)
 	return (struct aufs_super_block *)sb->s_fs_info;
 }
 
+static inline void aufs_stat_add(struct super_block *sb,
+		enum aufs_stat_item item, u64 value)
+{
+	this_cpu_add(AUFS_SB(sb)->stats->items[item], value);
+}
+
+static inline void aufs_stat_inc(struct super_block *sb,
+		enum aufs_stat_item item)
+{
+	aufs_stat_add(sb, item, 1);
+}
+
+struct buffer_head *aufs_bread(struct super_block *sb, sector_t block);
+
 #endif /*__SUPER_H__*/
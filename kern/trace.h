@@ -0,0 +1,106 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aufs
+
+#if !defined(__AUFS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __AUFS_TRACE_H__
+
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+TRACE_EVENT(aufs_lookup,
+	TP_PROTO(struct inode *dir, struct dentry *dentry, uint32_t ino,
+			u64 latency),
+	TP_ARGS(dir, dentry, ino, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__string(name, dentry->d_name.name)
+		__field(uint32_t, ino)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__assign_str(name, dentry->d_name.name);
+		__entry->ino = ino;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d:%d dir %lu name %s ino %u latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		__get_str(name), (unsigned)__entry->ino,
+		(unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(aufs_iterate,
+	TP_PROTO(struct inode *dir, loff_t pos, u64 latency),
+	TP_ARGS(dir, pos, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, dir)
+		__field(loff_t, pos)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = dir->i_sb->s_dev;
+		__entry->dir = dir->i_ino;
+		__entry->pos = pos;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d:%d dir %lu pos %lld latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+		(long long)__entry->pos, (unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(aufs_read,
+	TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret,
+			u64 latency),
+	TP_ARGS(inode, pos, len, ret, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned long, ino)
+		__field(loff_t, pos)
+		__field(size_t, len)
+		__field(ssize_t, ret)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = inode->i_sb->s_dev;
+		__entry->ino = inode->i_ino;
+		__entry->pos = pos;
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d:%d ino %lu pos %lld len %zu ret %zd latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+		(long long)__entry->pos, __entry->len, __entry->ret,
+		(unsigned long long)__entry->latency)
+);
+
+TRACE_EVENT(aufs_inode_get,
+	TP_PROTO(struct super_block *sb, uint32_t ino, int err, u64 latency),
+	TP_ARGS(sb, ino, err, latency),
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(uint32_t, ino)
+		__field(int, err)
+		__field(u64, latency)
+	),
+	TP_fast_assign(
+		__entry->dev = sb->s_dev;
+		__entry->ino = ino;
+		__entry->err = err;
+		__entry->latency = latency;
+	),
+	TP_printk("dev %d:%d ino %u err %d latency %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev), (unsigned)__entry->ino,
+		__entry->err, (unsigned long long)__entry->latency)
+);
+
+#endif /*__AUFS_TRACE_H__*/
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE trace
+#include <trace/define_trace.h>
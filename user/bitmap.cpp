@@ -0,0 +1,145 @@
+#include <algorithm>
+
+#include "bitmap.hpp"
+
+size_t const Bitmap::npos = static_cast<size_t>(-1);
+
+size_t Bitmap::blocks_for(uint64_t bits, size_t block_size)
+{ return (bits + (block_size << 3) - 1) / (block_size << 3); }
+
+Bitmap::Bitmap()
+	: block_size_(0)
+	, hint_(0)
+{ }
+
+Bitmap::Bitmap(BlockCache &cache, size_t first, size_t blocks)
+	: block_size_(cache.block_size())
+	, hint_(0)
+{
+	for (size_t it = 0; it != blocks; ++it)
+		blocks_.push_back(cache.block(first + it));
+}
+
+size_t Bitmap::size() const
+{ return (blocks_.size() * block_size_) << 3; }
+
+uint8_t Bitmap::byte(size_t no) const
+{ return blocks_[no / block_size_]->data()[no % block_size_]; }
+
+uint8_t &Bitmap::byte(size_t no)
+{ return blocks_[no / block_size_]->data()[no % block_size_]; }
+
+bool Bitmap::test(size_t bit) const
+{ return (byte(bit >> 3) >> (bit & 7)) & 1; }
+
+void Bitmap::set(size_t from, size_t to)
+{
+	to = std::min(to, size());
+	if (from <= hint_ && hint_ < to)
+		hint_ = to;
+
+	while (from < to)
+	{
+		if (!(from & 7) && from + 8 <= to)
+		{
+			byte(from >> 3) = 0xFF;
+			from += 8;
+			continue;
+		}
+		byte(from >> 3) |= static_cast<uint8_t>(1u << (from & 7));
+		++from;
+	}
+}
+
+void Bitmap::clear(size_t from, size_t to)
+{
+	to = std::min(to, size());
+	hint_ = std::min(hint_, from);
+
+	while (from < to)
+	{
+		if (!(from & 7) && from + 8 <= to)
+		{
+			byte(from >> 3) = 0x00;
+			from += 8;
+			continue;
+		}
+		byte(from >> 3) &= static_cast<uint8_t>(~(1u << (from & 7)));
+		++from;
+	}
+}
+
+size_t Bitmap::find_clear(size_t len, size_t group) const
+{
+	size_t const bits = size();
+	size_t run = 0;
+
+	if (!len)
+		return npos;
+
+	for (size_t bit = hint_; bit < bits;)
+	{
+		if (group != npos && bit % group == 0)
+			run = 0;
+
+		uint8_t const value = byte(bit >> 3);
+		bool const whole = !(bit & 7) && (group == npos || bit % group + 8 <= group);
+		if (whole && (value == 0x00 || value == 0xFF))
+		{
+			if (value == 0xFF)
+				run = 0;
+			else if (run + 8 >= len)
+				return bit - run;
+			else
+				run += 8;
+			bit += 8;
+			continue;
+		}
+
+		if ((value >> (bit & 7)) & 1)
+			run = 0;
+		else if (++run == len)
+			return bit + 1 - len;
+		++bit;
+	}
+
+	return npos;
+}
+
+std::vector<std::pair<size_t, size_t>> Bitmap::clear_runs() const
+{
+	std::vector<std::pair<size_t, size_t>> runs;
+	size_t const bits = size();
+	size_t start = npos;
+
+	for (size_t bit = hint_; bit < bits;)
+	{
+		uint8_t const value = byte(bit >> 3);
+		if (!(bit & 7) && (value == 0x00 || value == 0xFF))
+		{
+			if (value == 0xFF && start != npos)
+			{
+				runs.emplace_back(start, bit - start);
+				start = npos;
+			}
+			else if (value == 0x00 && start == npos)
+				start = bit;
+			bit += 8;
+			continue;
+		}
+
+		bool const busy = (value >> (bit & 7)) & 1;
+		if (busy && start != npos)
+		{
+			runs.emplace_back(start, bit - start);
+			start = npos;
+		}
+		else if (!busy && start == npos)
+			start = bit;
+		++bit;
+	}
+
+	if (start != npos)
+		runs.emplace_back(start, bits - start);
+	return runs;
+}
@@ -0,0 +1,41 @@
+#ifndef __BITMAP_HPP__
+#define __BITMAP_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "cache.hpp"
+
+/* bitmap spread over consecutive blocks of the image, LSB first */
+class Bitmap
+{
+public:
+	static size_t const npos;
+
+	/* blocks a bitmap of that many bits takes */
+	static size_t blocks_for(uint64_t bits, size_t block_size);
+
+	Bitmap();
+	Bitmap(BlockCache &cache, size_t first, size_t blocks);
+
+	size_t size() const;
+	bool test(size_t bit) const;
+	void set(size_t from, size_t to);
+	void clear(size_t from, size_t to);
+
+	/* finds len clear bits in a row that do not cross a multiple of group */
+	size_t find_clear(size_t len, size_t group = npos) const;
+	std::vector<std::pair<size_t, size_t>> clear_runs() const;
+
+private:
+	uint8_t byte(size_t no) const;
+	uint8_t &byte(size_t no);
+
+	std::vector<BlockCache::BlockPtr> blocks_;
+	size_t block_size_;
+	size_t hint_;
+};
+
+#endif /*__BITMAP_HPP__*/
@@ -0,0 +1,663 @@
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <iostream>
+#include <fstream>
+#include <cstring>
+#include <cerrno>
+#include <memory>
+#include <set>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "builder.hpp"
+#include "hash.hpp"
+#include "io.hpp"
+
+namespace {
+
+	std::vector<char> read_file(std::string const &path)
+	{
+		std::vector<char> data;
+		std::ifstream file(path.c_str(), std::ios::binary);
+		if (!file)
+			throw std::runtime_error("cannot open file");
+		std::istreambuf_iterator<char> begin(file), end;
+		std::copy(begin, end, std::back_inserter(data));
+		return data;
+	}
+
+	std::vector<std::string> read_dir(std::string const &path)
+	{
+		std::vector<std::string> entries;
+		struct dirent *entryp = nullptr;
+		std::unique_ptr<DIR, int(*)(DIR *)> dirp(opendir(path.c_str()), &closedir);
+		if (!dirp.get())
+			throw std::runtime_error("cannot open dir");
+
+		while ((entryp = readdir(dirp.get())))
+		{
+			if ( strcmp(entryp->d_name, ".") &&
+					strcmp(entryp->d_name, "..") )
+				entries.push_back(std::string(entryp->d_name));
+		}
+		return entries;
+	}
+
+	std::string join(std::string const &rel, std::string const &name)
+	{ return rel.empty() ? name : rel + "/" + name; }
+
+	int64_t mtime(struct stat const &st)
+	{ return static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec; }
+
+	uint64_t hash_data(std::vector<char> const &data, size_t threads)
+	{ return content_hash(reinterpret_cast<uint8_t const *>(data.data()), data.size(), threads); }
+
+	/*
+	 * Blocks of the file that hold data as (first block, count) ranges,
+	 * widened to whole blocks. Without hole support it is all data.
+	 */
+	std::vector<Extent> data_ranges(int fd, uint64_t size, uint32_t block_size)
+	{
+		uint64_t const blocks = (size + block_size - 1) / block_size;
+		std::vector<Extent> ranges;
+		off_t offset = 0;
+
+		while (static_cast<uint64_t>(offset) < size)
+		{
+			off_t const data = lseek(fd, offset, SEEK_DATA);
+			if (data < 0 && errno == ENXIO)
+				break;
+			off_t const hole = data < 0 ? -1 : lseek(fd, data, SEEK_HOLE);
+			if (hole < 0)
+				return std::vector<Extent>(1, Extent{ 0, static_cast<uint32_t>(blocks) });
+
+			uint32_t const first = data / block_size;
+			uint32_t const last = (std::min(static_cast<uint64_t>(hole), size) + block_size - 1) / block_size;
+			if (!ranges.empty() && ranges.back().block + ranges.back().blocks >= first)
+				ranges.back().blocks = last - ranges.back().block;
+			else if (last > first)
+				ranges.push_back(Extent{ first, last - first });
+			offset = hole;
+		}
+
+		return ranges;
+	}
+
+}
+
+Builder::Builder(Formatter &format, Compressor const &compressor)
+	: format_(&format)
+	, compressor_(&compressor)
+	, manifest_(nullptr)
+	, plan_(nullptr)
+	, dedup_(false)
+	, threads_(1)
+{ }
+
+void Builder::set_dedup(bool dedup, size_t threads)
+{
+	dedup_ = dedup;
+	threads_ = threads;
+}
+
+void Builder::set_manifest(Manifest *manifest)
+{ manifest_ = manifest; }
+
+void Builder::set_plan(ImagePlan *plan)
+{ plan_ = plan; }
+
+Inode Builder::make_file(std::vector<char> const &data, std::string const &path)
+{
+	if (compressor_->algorithm() != Compressor::NONE && data.size() > format_->inline_max())
+	{
+		std::vector<uint8_t> const extent = compressor_->compress(
+				reinterpret_cast<uint8_t const *>(data.data()), data.size());
+		size_t const bs = format_->block_size();
+		if (!extent.empty() && (extent.size() + bs - 1) / bs < (data.size() + bs - 1) / bs)
+			return format_->mkcompressed(data.size(), extent, compressor_->flags());
+	}
+
+	Inode file_inode = format_->mkfile(data.size());
+
+	if (plan_ && !path.empty() && !(file_inode.flags() & AUFS_INODE_INLINE))
+	{
+		format_->set_length(file_inode, data.size());
+		plan_->add_source(format_->extents(file_inode), path, data.size());
+		return file_inode;
+	}
+
+	uint8_t const *const bytes = reinterpret_cast<uint8_t const *>(data.data());
+	if (!(file_inode.flags() & AUFS_INODE_INLINE))
+		format_->write_extents(file_inode, bytes, data.size());
+	else if (!data.empty())
+		format_->write(file_inode, bytes, data.size());
+
+	return file_inode;
+}
+
+Inode Builder::find_duplicate(std::vector<char> const &data, uint64_t hash)
+{
+	std::pair<FilesMap::iterator, FilesMap::iterator> const range = files_.equal_range(hash);
+	for (FilesMap::iterator it = range.first; it != range.second; ++it)
+	{
+		Inode const &origin = it->second.second;
+		if (origin.length() != data.size())
+			continue;
+		if (same_content(it->second.first, origin, data))
+			return format_->mkshared(origin);
+	}
+	return Inode();
+}
+
+bool Builder::same_content(std::string const &path, Inode const &origin, std::vector<char> const &data)
+{
+	if (!path.empty())
+		return read_file(path) == data;
+
+	/* archive members are gone once read, compare with what is stored */
+	uint32_t const compressed = origin.flags() & (AUFS_INODE_LZ4 | AUFS_INODE_ZSTD);
+	std::vector<uint8_t> const stored = format_->read(origin);
+	if (!compressed)
+		return std::equal(std::begin(data), std::end(data), std::begin(stored),
+				[](char l, uint8_t r) { return static_cast<uint8_t>(l) == r; });
+
+	if (compressed != compressor_->flags())
+		return false;
+
+	/* the same extent means the same offsets table and clusters */
+	std::vector<uint8_t> const extent = compressor_->compress(
+			reinterpret_cast<uint8_t const *>(data.data()), data.size());
+	return !extent.empty() && extent.size() <= stored.size() &&
+		std::equal(std::begin(extent), std::end(extent), std::begin(stored));
+}
+
+void Builder::record(std::string const &rel, struct stat const &st, Inode const &inode, uint64_t hash)
+{
+	if (!manifest_)
+		return;
+
+	Manifest::Entry entry;
+	entry.dir = S_ISDIR(st.st_mode);
+	entry.inode = inode.inode();
+	entry.size = entry.dir ? 0 : st.st_size;
+	entry.mtime = mtime(st);
+	entry.hash = hash;
+	manifest_->add(rel, entry);
+}
+
+Inode Builder::copy_file(std::string const &path)
+{
+	struct stat buffer;
+	if (stat(path.c_str(), &buffer))
+		throw std::runtime_error("cannot stat file");
+	return copy_file(path, "", buffer);
+}
+
+/*
+ * Moves a file that gets a second link to an extended inode, so it can
+ * keep the link count, and fixes up whatever refers to it so far.
+ */
+Inode Builder::extend(Inode const &inode, std::string const &rel, uint64_t hash)
+{
+	if (inode.flags() & AUFS_INODE_EXTENDED)
+		return inode;
+
+	Inode const moved = format_->extend(inode);
+
+	std::pair<FilesMap::iterator, FilesMap::iterator> const range = files_.equal_range(hash);
+	for (FilesMap::iterator it = range.first; it != range.second; ++it)
+	{
+		if (it->second.second.inode() == inode.inode())
+			it->second.second = moved;
+	}
+
+	Manifest::Entry const *const entry = manifest_ ? manifest_->find(rel) : nullptr;
+	if (entry)
+	{
+		Manifest::Entry updated = *entry;
+		updated.inode = moved.inode();
+		manifest_->add(rel, updated);
+	}
+
+	return moved;
+}
+
+/* target is where the file was imported from, inode is updated in place */
+Inode Builder::link(Inode &inode, std::string const &target, uint64_t hash)
+{
+	inode = extend(inode, target, hash);
+	format_->set_links(inode, inode.links() + 1);
+	return inode;
+}
+
+Inode Builder::copy_file(std::string const &path, std::string const &rel, struct stat const &st)
+{
+	std::pair<dev_t, ino_t> const key(st.st_dev, st.st_ino);
+	uint64_t const size = st.st_size;
+	uint64_t hash = 0;
+	Inode inode;
+
+	if (st.st_nlink > 1)
+	{
+		LinksMap::iterator const it = links_.find(key);
+		if (it != links_.end())
+		{
+			inode = link(it->second.first, "", it->second.second);
+			record(rel, st, inode, it->second.second);
+			return inode;
+		}
+	}
+
+	/* nothing needs the data in memory, it goes from the file to the image */
+	if (compressor_->algorithm() == Compressor::NONE && !dedup_ && !manifest_ &&
+			size > format_->inline_max())
+	{
+		if (plan_)
+		{
+			/* the plan reads it when emitted */
+			inode = format_->mkfile(size);
+			format_->set_length(inode, size);
+			plan_->add_source(format_->extents(inode), path, size);
+		}
+		else
+		{
+			int const fd = open(path.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("cannot open file");
+			try
+			{
+				uint64_t const blocks = (size + format_->block_size() - 1) / format_->block_size();
+				std::vector<Extent> const ranges = data_ranges(fd, size, format_->block_size());
+				if (ranges.size() == 1 && ranges.front().blocks == blocks)
+				{
+					inode = format_->mkfile(size);
+					lseek(fd, 0, SEEK_SET);
+					format_->write_extents(inode, fd, size);
+				}
+				else
+				{
+					inode = format_->mksparse(size, ranges);
+					for (Extent const &range : ranges)
+					{
+						uint64_t const from = static_cast<uint64_t>(range.block) * format_->block_size();
+						format_->write_range(inode, range.block, fd, std::min(size,
+								from + static_cast<uint64_t>(range.blocks) * format_->block_size()) - from);
+					}
+				}
+			}
+			catch (...)
+			{
+				close(fd);
+				throw;
+			}
+			close(fd);
+		}
+	}
+	else
+		inode = copy_data(read_file(path), path, rel, st, hash);
+
+	/* the other links are likely to follow, make room for the count now */
+	if (st.st_nlink > 1)
+	{
+		inode = extend(inode, rel, hash);
+		links_.emplace(key, std::make_pair(inode, hash));
+	}
+
+	return inode;
+}
+
+Inode Builder::copy_data(std::vector<char> const &data, std::string const &path,
+		std::string const &rel, struct stat const &st, uint64_t &hash)
+{
+	bool const dedup = dedup_ && data.size() > format_->inline_max();
+	Inode inode;
+
+	hash = dedup || manifest_ ? hash_data(data, threads_) : 0;
+
+	if (dedup)
+		inode = find_duplicate(data, hash);
+
+	if (!inode)
+	{
+		inode = make_file(data, path);
+		if (dedup && inode.blocks())
+			files_.emplace(hash, std::make_pair(path, inode));
+	}
+
+	record(rel, st, inode, hash);
+	return inode;
+}
+
+Inode Builder::copy_dir(std::string const &path)
+{
+	struct stat buffer;
+	if (stat(path.c_str(), &buffer))
+		throw std::runtime_error("cannot stat dir");
+	return copy_dir(path, "", buffer);
+}
+
+Inode Builder::copy_dir(std::string const &path, std::string const &rel, struct stat const &st)
+{
+	std::vector<std::string> const entries = read_dir(path);
+
+	Inode dir_inode = format_->mkdir(entries);
+
+	for (std::string const &entry : entries)
+	{
+		struct stat buffer;
+		if (!stat((path + "/" + entry).c_str(), &buffer))
+		{
+			if (S_ISDIR(buffer.st_mode))
+				format_->add_child(dir_inode, entry.c_str(),
+						copy_dir(path + "/" + entry, join(rel, entry), buffer));
+			else
+				format_->add_child(dir_inode, entry.c_str(),
+						copy_file(path + "/" + entry, join(rel, entry), buffer));
+		}
+	}
+
+	record(rel, st, dir_inode, 0);
+	return dir_inode;
+}
+
+Inode Builder::update(std::string const &path, Manifest const &old)
+{
+	struct stat buffer;
+	if (stat(path.c_str(), &buffer) || !S_ISDIR(buffer.st_mode))
+		throw std::runtime_error("cannot stat dir");
+
+	Node const root = scan(path, "", buffer, old);
+	Released const released = release(root, old);
+	Inode const inode = build(root, path, "");
+
+	/*
+	 * New data goes straight to the device, so it must not land in blocks
+	 * the old metadata on disk still points to. What is gone is freed only
+	 * now, and that reaches the disk with the new metadata.
+	 */
+	for (Extent const &extent : released.extents)
+		format_->free_blocks(extent.block, extent.blocks);
+	for (uint32_t const ino : released.inodes)
+		format_->free(format_->inode(ino));
+	return inode;
+}
+
+/* finds out what can be kept from the previous build */
+Builder::Node Builder::scan(std::string const &path, std::string const &rel,
+		struct stat const &st, Manifest const &old)
+{
+	Manifest::Entry const *const entry = old.find(rel);
+	Node node;
+	node.st = st;
+	node.keep = 0;
+	node.hash = 0;
+
+	if (!S_ISDIR(st.st_mode))
+	{
+		if (!entry || entry->dir || entry->size != static_cast<uint64_t>(st.st_size))
+			return node;
+
+		node.hash = entry->mtime == mtime(st) ? entry->hash : hash_data(read_file(path), threads_);
+		if (node.hash == entry->hash)
+			node.keep = entry->inode;
+		return node;
+	}
+
+	for (std::string const &name : read_dir(path))
+	{
+		struct stat buffer;
+		if (stat((path + "/" + name).c_str(), &buffer))
+			continue;
+		node.children.push_back(scan(path + "/" + name, join(rel, name), buffer, old));
+		node.children.back().name = name;
+	}
+
+	if (!entry || !entry->dir)
+		return node;
+
+	std::vector<std::pair<std::string, uint32_t>> const entries =
+		format_->children(format_->inode(entry->inode));
+	std::map<std::string, uint32_t> const before(std::begin(entries), std::end(entries));
+
+	if (before.size() != node.children.size())
+		return node;
+
+	for (Node const &child : node.children)
+	{
+		std::map<std::string, uint32_t>::const_iterator const it = before.find(child.name);
+		if (!child.keep || it == before.end() || it->second != child.keep)
+			return node;
+	}
+
+	node.keep = entry->inode;
+	return node;
+}
+
+/* inodes and extents of the previous build that are not kept */
+Builder::Released Builder::release(Node const &root, Manifest const &old)
+{
+	std::set<uint32_t> kept;
+	std::vector<Node const *> queue(1, &root);
+	while (!queue.empty())
+	{
+		Node const *const node = queue.back();
+		queue.pop_back();
+		if (node->keep)
+			kept.insert(node->keep);
+		for (Node const &child : node->children)
+			queue.push_back(&child);
+	}
+
+	std::set<uint32_t> live;
+	std::set<uint32_t> removed;
+	for (Manifest::EntriesMap::value_type const &p : old.entries())
+	{
+		Manifest::Entry const &entry = p.second;
+		if (!kept.count(entry.inode))
+			removed.insert(entry.inode);
+		else if (!entry.dir)
+		{
+			Inode const inode = format_->inode(entry.inode);
+			if (inode.blocks())
+				live.insert(inode.block());
+		}
+	}
+
+	Released released;
+	for (uint32_t const ino : removed)
+	{
+		Inode const inode = format_->inode(ino);
+		if (inode.blocks() && !live.count(inode.block()))
+		{
+			for (Extent const &extent : format_->extents(inode))
+			{
+				if (extent.block)
+					released.extents.push_back(extent);
+			}
+		}
+		released.inodes.push_back(ino);
+	}
+	return released;
+}
+
+Inode Builder::build(Node const &node, std::string const &path, std::string const &rel)
+{
+	if (node.keep)
+	{
+		Inode inode = format_->inode(node.keep);
+		for (Node const &child : node.children)
+			build(child, path + "/" + child.name, join(rel, child.name));
+
+		/* links are counted again, some may be gone since the last build */
+		if (!S_ISDIR(node.st.st_mode) && node.st.st_nlink > 1 &&
+				(inode.flags() & AUFS_INODE_EXTENDED))
+		{
+			std::pair<LinksMap::iterator, bool> const it = links_.emplace(
+					std::make_pair(node.st.st_dev, node.st.st_ino),
+					std::make_pair(inode, node.hash));
+			if (it.second)
+				format_->set_links(inode, 1);
+			else if (it.first->second.first.inode() == inode.inode())
+				link(it.first->second.first, rel, node.hash);
+		}
+
+		if (dedup_ && inode.blocks() && !S_ISDIR(node.st.st_mode))
+			files_.emplace(node.hash, std::make_pair(path, inode));
+		record(rel, node.st, inode, node.hash);
+		return inode;
+	}
+
+	if (!S_ISDIR(node.st.st_mode))
+		return copy_file(path, rel, node.st);
+
+	std::vector<std::string> names;
+	for (Node const &child : node.children)
+		names.push_back(child.name);
+
+	Inode dir_inode = format_->mkdir(names);
+	for (Node const &child : node.children)
+		format_->add_child(dir_inode, child.name.c_str(),
+				build(child, path + "/" + child.name, join(rel, child.name)));
+
+	record(rel, node.st, dir_inode, 0);
+	return dir_inode;
+}
+
+Inode Builder::copy_tar(TarReader &tar)
+{
+	TarDir root;
+	TarReader::Entry entry;
+
+	std::memset(&root.st, 0, sizeof(root.st));
+	root.st.st_mode = S_IFDIR | 0755;
+
+	while (tar.next(entry))
+	{
+		size_t const slash = entry.path.rfind('/');
+		std::string const parent = slash == std::string::npos ? "" : entry.path.substr(0, slash);
+		std::string const name = entry.path.substr(slash == std::string::npos ? 0 : slash + 1);
+
+		if (entry.type == TarReader::DIRECTORY)
+		{
+			tar_dir(root, entry.path).st = entry.st;
+			continue;
+		}
+
+		if (entry.path.empty())
+			throw std::runtime_error("archive member without a name");
+
+		if (entry.type == TarReader::HARDLINK)
+		{
+			size_t const at = entry.link.rfind('/');
+			TarDir &target = tar_dir(root, at == std::string::npos ? "" : entry.link.substr(0, at));
+			std::map<std::string, std::pair<Inode, uint64_t>>::iterator const it =
+				target.files.find(entry.link.substr(at == std::string::npos ? 0 : at + 1));
+			if (it == target.files.end())
+				throw std::runtime_error("hard link to unknown file: " + entry.link);
+
+			link(it->second.first, entry.link, it->second.second);
+			TarDir &dir = tar_dir(root, parent);
+			dir.dirs.erase(name);
+			dir.files[name] = it->second;
+
+			entry.st.st_mode = S_IFREG | (entry.st.st_mode & 07777);
+			entry.st.st_size = it->second.first.length();
+			record(entry.path, entry.st, it->second.first, it->second.second);
+			continue;
+		}
+
+		if (entry.type != TarReader::REGULAR)
+		{
+			std::cerr << "skipping " << entry.path << ": unsupported file type" << std::endl;
+			continue;
+		}
+
+		uint64_t hash;
+		Inode const inode = tar_file(tar, entry.path, entry.st, hash);
+		TarDir &dir = tar_dir(root, parent);
+		dir.dirs.erase(name);
+		dir.files[name] = std::make_pair(inode, hash);
+	}
+
+	return build_tar(root, "");
+}
+
+/* finds the directory creating missing ones on the way */
+Builder::TarDir &Builder::tar_dir(TarDir &root, std::string const &rel)
+{
+	TarDir *dir = &root;
+	size_t pos = 0;
+
+	while (pos < rel.size())
+	{
+		size_t const end = std::min(rel.find('/', pos), rel.size());
+		std::string const name = rel.substr(pos, end - pos);
+		std::map<std::string, TarDir>::iterator it = dir->dirs.find(name);
+
+		if (it == dir->dirs.end())
+		{
+			it = dir->dirs.emplace(name, TarDir()).first;
+			std::memset(&it->second.st, 0, sizeof(it->second.st));
+			it->second.st.st_mode = S_IFDIR | 0755;
+			dir->files.erase(name);
+		}
+
+		dir = &it->second;
+		pos = end + 1;
+	}
+
+	return *dir;
+}
+
+Inode Builder::tar_file(TarReader &tar, std::string const &rel, struct stat const &st, uint64_t &hash)
+{
+	if (compressor_->algorithm() == Compressor::NONE && !dedup_ && !manifest_)
+	{
+		/* nothing needs the whole file, so it goes to the image as read */
+		std::vector<uint8_t> buffer(COPY_SIZE);
+		Inode inode = format_->mkfile(st.st_size);
+		uint64_t left = st.st_size;
+
+		while (left)
+		{
+			size_t const count = tar.read(buffer.data(),
+					std::min(left, static_cast<uint64_t>(COPY_SIZE)));
+
+			if (inode.flags() & AUFS_INODE_INLINE)
+				format_->write(inode, buffer.data(), count);
+			else
+				format_->write_extents(inode, buffer.data(), count);
+			left -= count;
+		}
+
+		hash = 0;
+		return inode;
+	}
+
+	std::vector<char> data(st.st_size);
+	for (size_t read = 0; read != data.size();)
+		read += tar.read(data.data() + read, std::min(data.size() - read, COPY_SIZE));
+	return copy_data(data, "", rel, st, hash);
+}
+
+Inode Builder::build_tar(TarDir const &dir, std::string const &rel)
+{
+	std::vector<std::string> names;
+	for (std::map<std::string, TarDir>::value_type const &p : dir.dirs)
+		names.push_back(p.first);
+	for (std::map<std::string, std::pair<Inode, uint64_t>>::value_type const &p : dir.files)
+		names.push_back(p.first);
+
+	Inode dir_inode = format_->mkdir(names);
+
+	for (std::map<std::string, TarDir>::value_type const &p : dir.dirs)
+		format_->add_child(dir_inode, p.first.c_str(), build_tar(p.second, join(rel, p.first)));
+	for (std::map<std::string, std::pair<Inode, uint64_t>>::value_type const &p : dir.files)
+		format_->add_child(dir_inode, p.first.c_str(), p.second.first);
+
+	record(rel, dir.st, dir_inode, 0);
+	return dir_inode;
+}
@@ -0,0 +1,108 @@
+#ifndef __BUILDER_HPP__
+#define __BUILDER_HPP__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <map>
+#include <utility>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "compress.hpp"
+#include "format.hpp"
+#include "manifest.hpp"
+#include "plan.hpp"
+#include "tar.hpp"
+
+class Builder
+{
+public:
+	Builder(Formatter &format, Compressor const &compressor);
+
+	Builder(Builder const &) = delete;
+	Builder &operator=(Builder const &) = delete;
+
+	void set_dedup(bool dedup, size_t threads);
+	void set_manifest(Manifest *manifest);
+	/* uncompressed file data is referenced from the plan, not copied */
+	void set_plan(ImagePlan *plan);
+
+	Inode copy_file(std::string const &path);
+	Inode copy_dir(std::string const &path);
+
+	/*
+	 * Brings an image built from path earlier (old is the manifest
+	 * recorded back then) in sync with path, reusing inodes and extents
+	 * of everything that has not changed. Inodes and blocks of what is
+	 * gone are not reused by the same update, the image needs room for
+	 * the old and the new data at once.
+	 */
+	Inode update(std::string const &path, Manifest const &old);
+
+	/*
+	 * Imports the archive in one pass: file data goes to the image as
+	 * soon as it is read, directories are made once the archive ends.
+	 */
+	Inode copy_tar(TarReader &tar);
+
+private:
+	typedef std::multimap<uint64_t, std::pair<std::string, Inode>> FilesMap;
+	/* (st_dev, st_ino) of files with several links to their inode and hash */
+	typedef std::map<std::pair<dev_t, ino_t>, std::pair<Inode, uint64_t>> LinksMap;
+
+	struct Node
+	{
+		std::string name;
+		struct stat st;
+		uint32_t keep;
+		uint64_t hash;
+		std::vector<Node> children;
+	};
+
+	/* what an update drops, freed once the new tree is built */
+	struct Released
+	{
+		std::vector<uint32_t> inodes;
+		std::vector<Extent> extents;
+	};
+
+	struct TarDir
+	{
+		struct stat st;
+		std::map<std::string, std::pair<Inode, uint64_t>> files;
+		std::map<std::string, TarDir> dirs;
+	};
+
+	Inode make_file(std::vector<char> const &data, std::string const &path);
+	Inode find_duplicate(std::vector<char> const &data, uint64_t hash);
+	bool same_content(std::string const &path, Inode const &origin, std::vector<char> const &data);
+	Inode copy_file(std::string const &path, std::string const &rel, struct stat const &st);
+	Inode copy_data(std::vector<char> const &data, std::string const &path,
+			std::string const &rel, struct stat const &st, uint64_t &hash);
+	Inode copy_dir(std::string const &path, std::string const &rel, struct stat const &st);
+	void record(std::string const &rel, struct stat const &st, Inode const &inode, uint64_t hash);
+	Inode extend(Inode const &inode, std::string const &rel, uint64_t hash);
+	Inode link(Inode &inode, std::string const &target, uint64_t hash);
+
+	Node scan(std::string const &path, std::string const &rel, struct stat const &st,
+			Manifest const &old);
+	Released release(Node const &root, Manifest const &old);
+	Inode build(Node const &node, std::string const &path, std::string const &rel);
+
+	TarDir &tar_dir(TarDir &root, std::string const &rel);
+	Inode tar_file(TarReader &tar, std::string const &rel, struct stat const &st, uint64_t &hash);
+	Inode build_tar(TarDir const &dir, std::string const &rel);
+
+	Formatter *format_;
+	Compressor const *compressor_;
+	Manifest *manifest_;
+	ImagePlan *plan_;
+	bool dedup_;
+	size_t threads_;
+	FilesMap files_;
+	LinksMap links_;
+};
+
+#endif /*__BUILDER_HPP__*/
@@ -1,17 +1,18 @@
 #include <algorithm>
 #include <stdexcept>
 #include <tuple>
+#include <vector>
 
 #include "cache.hpp"
 
 BlockCache::BlockCache(std::string const &img, std::size_t block_size)
-	: fd_(img.c_str())
-	, block_size_(block_size)
-	, blocks_count_(device_size()/block_size_)
-{
-	if (!fd_)
-		throw std::runtime_error("image open error");
-}
+	: owned_(new FileDevice(img, block_size))
+	, device_(owned_.get())
+{ }
+
+BlockCache::BlockCache(Device &device)
+	: device_(&device)
+{ }
 
 BlockCache::~BlockCache()
 { try { flush(); } catch (...) { } }
@@ -43,29 +44,62 @@ void BlockCache::flush()
 	}
 }
 
-size_t BlockCache::block_size() const
-{ return block_size_; }
+void BlockCache::write(size_t no, uint8_t const *data, size_t bytes)
+{
+	size_t const whole = bytes / block_size();
+	size_t const tail = bytes % block_size();
 
-size_t BlockCache::blocks_count() const
-{ return blocks_count_; }
+	device_->write_blocks(no, data, whole);
+	if (tail)
+	{
+		std::vector<uint8_t> last(block_size(), 0);
+		std::copy_n(data + whole * block_size(), tail, last.data());
+		device_->write(no + whole, last.data());
+	}
 
-void BlockCache::drop_block(BlockPtr const &b)
-{
-	size_t const offset = block_no_to_offset(b->block_no());
-	b->dump(fd_.seekp(offset));
+	std::map<size_t, BlockPtr>::iterator it = blocks_.lower_bound(no);
+	for (; it != blocks_.end() && it->first < no + whole + (tail ? 1 : 0); ++it)
+	{
+		size_t const offset = (it->first - no) * block_size();
+		size_t const count = std::min(bytes - offset, block_size());
+		std::copy_n(data + offset, count, it->second->data());
+		std::fill(it->second->data() + count, it->second->data() + block_size(), 0);
+	}
 }
 
-void BlockCache::parse_block(BlockPtr &b)
+void BlockCache::read(size_t no, uint8_t *data, size_t bytes)
 {
-	size_t const offset = block_no_to_offset(b->block_no());
-	b->parse(fd_.seekg(offset));
-}
+	size_t const blocks = (bytes + block_size() - 1) / block_size();
+	std::vector<uint8_t> last;
 
-size_t BlockCache::block_no_to_offset(size_t no) const
-{ return no * block_size(); }
+	device_->read_blocks(no, data, bytes / block_size());
+	if (bytes % block_size())
+	{
+		last.resize(block_size());
+		device_->read(no + blocks - 1, last.data());
+		std::copy_n(last.data(), bytes % block_size(), data + (blocks - 1) * block_size());
+	}
 
-size_t BlockCache::device_size()
-{
-	fd_.seekg(0, std::ios_base::end);
-	return static_cast<size_t>(fd_.tellg());
+	/* cached blocks may be newer than what the device has */
+	std::map<size_t, BlockPtr>::const_iterator it = blocks_.lower_bound(no);
+	for (; it != blocks_.end() && it->first < no + blocks; ++it)
+	{
+		size_t const offset = (it->first - no) * block_size();
+		std::copy_n(it->second->data(), std::min(bytes - offset, block_size()), data + offset);
+	}
 }
+
+void BlockCache::drop()
+{ blocks_.clear(); }
+
+size_t BlockCache::block_size() const
+{ return device_->block_size(); }
+
+size_t BlockCache::blocks_count() const
+{ return device_->blocks_count(); }
+
+void BlockCache::drop_block(BlockPtr const &b)
+{ device_->write(b->block_no(), b->data()); }
+
+void BlockCache::parse_block(BlockPtr &b)
+{ device_->read(b->block_no(), b->data()); }
@@ -1,11 +1,11 @@
 #ifndef __BLOCK_CACHE_HPP__
 #define __BLOCK_CACHE_HPP__
 
-#include <fstream>
 #include <memory>
 #include <map>
 
 #include "block.hpp"
+#include "device.hpp"
 
 class BlockCache
 {
@@ -13,6 +13,7 @@ public:
 	typedef std::shared_ptr<Block> BlockPtr;
 
 	BlockCache(std::string const &img, std::size_t block_size);
+	explicit BlockCache(Device &device);
 	~BlockCache();
 
 	BlockCache(BlockCache const &) = delete;
@@ -23,19 +24,27 @@ public:
 
 	BlockPtr block(size_t no);
 	void flush();
+	/* forgets cached blocks without writing them back, for readers */
+	void drop();
+
+	/*
+	 * Bulk data goes straight to the device and is not kept. Blocks that
+	 * happen to be cached are kept in sync, a partial last block is padded
+	 * with zeros.
+	 */
+	void write(size_t no, uint8_t const *data, size_t bytes);
+	void read(size_t no, uint8_t *data, size_t bytes);
+
 	size_t block_size() const;
 	size_t blocks_count() const;
 
 private:
-	std::fstream fd_;
-	size_t block_size_;
-	size_t blocks_count_;
+	std::unique_ptr<Device> owned_;
+	Device *device_;
 	std::map<size_t, BlockPtr> blocks_;
 
 	void drop_block(BlockPtr const &b);
 	void parse_block(BlockPtr &b);
-	size_t block_no_to_offset(size_t no) const;
-	size_t device_size();
 };
 
 #endif /*__BLOCK_CACHE_HPP__*/
@@ -0,0 +1,121 @@
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include "compress.hpp"
+#include "inode.hpp"
+
+Compressor::Compressor(Algorithm algo, size_t cluster_size, size_t threads)
+	: algo_(algo)
+	, cluster_size_(cluster_size)
+	, threads_(std::max(threads, static_cast<size_t>(1)))
+{
+	if (!cluster_size_ || (cluster_size_ & (cluster_size_ - 1)))
+		throw std::invalid_argument("cluster size must be a power of two");
+}
+
+Compressor::Algorithm Compressor::algorithm() const
+{ return algo_; }
+
+size_t Compressor::cluster_size() const
+{ return cluster_size_; }
+
+uint32_t Compressor::flags() const
+{
+	switch (algo_)
+	{
+	case LZ4:
+		return AUFS_INODE_LZ4;
+	case ZSTD:
+		return AUFS_INODE_ZSTD;
+	default:
+		return 0;
+	}
+}
+
+Compressor::Algorithm Compressor::parse(std::string const &name)
+{
+	if (name == "none")
+		return NONE;
+	if (name == "lz4")
+		return LZ4;
+	if (name == "zstd")
+		return ZSTD;
+	throw std::invalid_argument("unknown compression " + name);
+}
+
+std::vector<uint8_t> Compressor::compress_cluster(uint8_t const *data, size_t size) const
+{
+	std::vector<uint8_t> out;
+	size_t packed = 0;
+
+	switch (algo_)
+	{
+	case LZ4:
+		out.resize(LZ4_compressBound(size));
+		packed = LZ4_compress_default(reinterpret_cast<char const *>(data),
+				reinterpret_cast<char *>(out.data()), size, out.size());
+		break;
+	case ZSTD:
+		out.resize(ZSTD_compressBound(size));
+		packed = ZSTD_compress(out.data(), out.size(), data, size, ZSTD_CLEVEL_DEFAULT);
+		if (ZSTD_isError(packed))
+			packed = 0;
+		break;
+	default:
+		break;
+	}
+
+	if (!packed || packed >= size)
+		return std::vector<uint8_t>(data, data + size);
+
+	out.resize(packed);
+	return out;
+}
+
+std::vector<uint8_t> Compressor::compress(uint8_t const *data, size_t size) const
+{
+	size_t const clusters = (size + cluster_size_ - 1) / cluster_size_;
+	std::vector<std::vector<uint8_t>> packed(clusters);
+
+	auto worker = [&](size_t first)
+	{
+		for (size_t it = first; it < clusters; it += threads_)
+		{
+			size_t const offset = it * cluster_size_;
+			packed[it] = compress_cluster(data + offset,
+					std::min(cluster_size_, size - offset));
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t it = 1; it < std::min(threads_, clusters); ++it)
+		workers.emplace_back(worker, it);
+	worker(0);
+	std::for_each(std::begin(workers), std::end(workers),
+			[](std::thread &t) { t.join(); });
+
+	std::vector<be32> table(clusters + 1);
+	uint64_t offset = table.size() * sizeof(be32);
+	for (size_t it = 0; it != clusters; ++it)
+	{
+		table[it] = offset;
+		offset += packed[it].size();
+	}
+	table[clusters] = offset;
+
+	/* the table holds 32 bit offsets, larger extents are stored raw */
+	if (offset > UINT32_MAX)
+		return std::vector<uint8_t>();
+
+	uint8_t const *const begin = reinterpret_cast<uint8_t const *>(table.data());
+	std::vector<uint8_t> extent(begin, begin + table.size() * sizeof(be32));
+	extent.reserve(offset);
+	for (std::vector<uint8_t> const &cluster : packed)
+		extent.insert(std::end(extent), std::begin(cluster), std::end(cluster));
+
+	return extent;
+}
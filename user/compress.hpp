@@ -0,0 +1,43 @@
+#ifndef __COMPRESS_HPP__
+#define __COMPRESS_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Compressed file extent starts with a table of (clusters + 1) big endian
+ * byte offsets relative to the extent start, followed by the clusters.
+ * A cluster stored with its uncompressed size is kept raw.
+ */
+class Compressor
+{
+public:
+	enum Algorithm
+	{
+		NONE,
+		LZ4,
+		ZSTD
+	};
+
+	Compressor(Algorithm algo, size_t cluster_size, size_t threads);
+
+	Algorithm algorithm() const;
+	size_t cluster_size() const;
+	uint32_t flags() const;
+
+	/* empty when the extent would not fit 32 bit offsets, 4 GiB and more */
+	std::vector<uint8_t> compress(uint8_t const *data, size_t size) const;
+
+	static Algorithm parse(std::string const &name);
+
+private:
+	std::vector<uint8_t> compress_cluster(uint8_t const *data, size_t size) const;
+
+	Algorithm algo_;
+	size_t cluster_size_;
+	size_t threads_;
+};
+
+#endif /*__COMPRESS_HPP__*/
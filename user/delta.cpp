@@ -0,0 +1,522 @@
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zstd.h>
+
+#include "hash.hpp"
+#include "io.hpp"
+#include "reader.hpp"
+
+namespace {
+
+	char const DELTA_MAGIC[8] = { 'A', 'U', 'F', 'S', 'D', 'I', 'F', '1' };
+	size_t const CHUNK_SIZE = 1 << 20;
+
+	/*
+	 * A delta is the header and a list of ops that produce the new image
+	 * in block order. Free blocks of the new image come out as zeros, the
+	 * end op carries the hash of the whole result.
+	 */
+	struct DeltaHeader
+	{
+		char magic[8];
+		be32 block_size;
+		be32 reserved;
+		be64 old_blocks;
+		be64 new_blocks;
+	};
+
+	enum OpType
+	{
+		END,
+		COPY,	/* blocks from the old image, the op is followed by the first one */
+		ZERO,
+		ZSTD,	/* literal blocks, compressed size and data follow */
+		RAW	/* literal blocks that did not compress */
+	};
+
+	struct DeltaOp
+	{
+		be32 type;
+		be32 count;
+	};
+
+	struct Stats
+	{
+		uint64_t copied;
+		uint64_t zeros;
+		uint64_t literal;
+		uint64_t bytes;
+	};
+
+	bool same_file(int fd, std::string const &path)
+	{
+		struct stat a;
+		struct stat b;
+		return !fstat(fd, &a) && !stat(path.c_str(), &b) && a.st_dev == b.st_dev && a.st_ino == b.st_ino;
+	}
+
+	/* the blocks an inode keeps in its extents, in file order, holes left out */
+	std::vector<uint32_t> stored_blocks(Reader &reader, Inode const &inode)
+	{
+		std::vector<uint32_t> blocks;
+		for (Extent const &extent : reader.extents(inode))
+		{
+			for (uint32_t it = 0; extent.block && it != extent.blocks; ++it)
+				blocks.push_back(extent.block + it);
+		}
+		return blocks;
+	}
+
+	/*
+	 * Where the data of a new block likely was in the old image: the same
+	 * block of the file or directory at the same path, wherever it moved.
+	 */
+	std::unordered_map<uint32_t, uint32_t> match_paths(Reader &from, Reader &to)
+	{
+		std::unordered_map<uint32_t, uint32_t> hints;
+		std::deque<std::pair<uint32_t, uint32_t>> queue;
+		std::set<uint32_t> seen;
+
+		queue.emplace_back(from.root_inode(), to.root_inode());
+		seen.insert(to.root_inode());
+
+		while (!queue.empty())
+		{
+			Inode const old_dir = from.inode(queue.front().first);
+			Inode const new_dir = to.inode(queue.front().second);
+			queue.pop_front();
+
+			std::vector<uint32_t> const old_blocks = stored_blocks(from, old_dir);
+			std::vector<uint32_t> const new_blocks = stored_blocks(to, new_dir);
+			for (size_t it = 0; it != std::min(old_blocks.size(), new_blocks.size()); ++it)
+				hints.emplace(new_blocks[it], old_blocks[it]);
+
+			for (std::pair<std::string, uint32_t> const &child : to.children(new_dir))
+			{
+				uint32_t const old_ino = from.lookup(old_dir, child.first);
+				if (!old_ino || !seen.insert(child.second).second)
+					continue;
+
+				Inode const old_node = from.inode(old_ino);
+				Inode const new_node = to.inode(child.second);
+				if (S_ISDIR(new_node.mode()) && S_ISDIR(old_node.mode()))
+				{
+					queue.emplace_back(old_ino, child.second);
+					continue;
+				}
+
+				/* compressed extents only line up with the same compression */
+				if ((old_node.flags() & AUFS_INODE_COMPRESSED) != (new_node.flags() & AUFS_INODE_COMPRESSED))
+					continue;
+				std::vector<uint32_t> const old_data = stored_blocks(from, old_node);
+				std::vector<uint32_t> const new_data = stored_blocks(to, new_node);
+				for (size_t it = 0; it != std::min(old_data.size(), new_data.size()); ++it)
+					hints.emplace(new_data[it], old_data[it]);
+			}
+		}
+
+		return hints;
+	}
+
+	/* busy blocks of the old image by content, for data found nowhere else */
+	std::unordered_map<uint64_t, uint32_t> index_blocks(Reader &reader, BlockCache &cache)
+	{
+		std::unordered_map<uint64_t, uint32_t> index;
+		Bitmap const busy = reader.blocks_map();
+		size_t const bs = reader.block_size();
+		size_t const count = std::min(static_cast<size_t>(reader.blocks_count()), cache.blocks_count());
+		std::vector<uint8_t> chunk(CHUNK_SIZE / bs * bs);
+
+		for (size_t no = 0; no < count; no += chunk.size() / bs)
+		{
+			size_t const blocks = std::min(chunk.size() / bs, count - no);
+			cache.read(no, chunk.data(), blocks * bs);
+			for (size_t it = 0; it != blocks; ++it)
+			{
+				if (busy.test(no + it))
+					index.emplace(xxh64(chunk.data() + it * bs, bs), no + it);
+			}
+		}
+
+		return index;
+	}
+
+	class DeltaWriter
+	{
+	public:
+		DeltaWriter(int fd, size_t block_size)
+			: fd_(fd)
+			, block_size_(block_size)
+			, type_(END)
+			, count_(0)
+			, from_(0)
+			, stats_()
+		{ }
+
+		void copy(uint32_t from)
+		{
+			if (type_ != COPY || from_ + count_ != from)
+				flush();
+			if (!count_)
+				from_ = from;
+			type_ = COPY;
+			++count_;
+		}
+
+		void zero()
+		{
+			if (type_ != ZERO)
+				flush();
+			type_ = ZERO;
+			++count_;
+		}
+
+		void literal(uint8_t const *data)
+		{
+			if (type_ != RAW || literal_.size() >= CHUNK_SIZE)
+				flush();
+			type_ = RAW;
+			literal_.insert(literal_.end(), data, data + block_size_);
+			++count_;
+		}
+
+		void finish(uint64_t hash)
+		{
+			flush();
+			DeltaOp const op = { END, 0 };
+			be64 const sum = hash;
+			put(&op, sizeof(op));
+			put(&sum, sizeof(sum));
+		}
+
+		void put(void const *data, size_t len)
+		{
+			write_all(fd_, data, len);
+			stats_.bytes += len;
+		}
+
+		Stats const &stats() const
+		{ return stats_; }
+
+	private:
+		void flush()
+		{
+			if (!count_)
+				return;
+
+			DeltaOp op = { type_, count_ };
+			if (type_ == COPY)
+			{
+				be64 const from = from_;
+				put(&op, sizeof(op));
+				put(&from, sizeof(from));
+				stats_.copied += count_;
+			}
+			else if (type_ == ZERO)
+			{
+				put(&op, sizeof(op));
+				stats_.zeros += count_;
+			}
+			else
+			{
+				std::vector<uint8_t> packed(ZSTD_compressBound(literal_.size()));
+				size_t const size = ZSTD_compress(packed.data(), packed.size(),
+						literal_.data(), literal_.size(), ZSTD_CLEVEL_DEFAULT);
+				bool const raw = ZSTD_isError(size) || size >= literal_.size();
+				be32 const len = raw ? literal_.size() : size;
+
+				op.type = raw ? RAW : ZSTD;
+				put(&op, sizeof(op));
+				put(&len, sizeof(len));
+				put(raw ? literal_.data() : packed.data(), len);
+				stats_.literal += count_;
+				literal_.clear();
+			}
+
+			type_ = END;
+			count_ = 0;
+		}
+
+		int fd_;
+		size_t block_size_;
+		OpType type_;
+		uint32_t count_;
+		uint32_t from_;
+		std::vector<uint8_t> literal_;
+		Stats stats_;
+	};
+
+	Stats diff(std::string const &old_img, std::string const &new_img, int out)
+	{
+		uint32_t const block_size = Reader::probe_block_size(new_img);
+		if (Reader::probe_block_size(old_img) != block_size)
+			throw std::runtime_error("images have different block sizes");
+
+		FileDevice old_device(old_img, block_size, false);
+		FileDevice new_device(new_img, block_size, false);
+		BlockCache old_cache(old_device);
+		BlockCache new_cache(new_device);
+		Reader from(old_cache);
+		Reader to(new_cache);
+
+		std::unordered_map<uint32_t, uint32_t> const hints = match_paths(from, to);
+		std::unordered_map<uint64_t, uint32_t> const index = index_blocks(from, old_cache);
+		Bitmap const busy = to.blocks_map();
+		size_t const old_count = std::min(static_cast<size_t>(from.blocks_count()), old_device.blocks_count());
+		size_t const used = std::min(static_cast<size_t>(to.blocks_count()), new_device.blocks_count());
+
+		DeltaHeader header;
+		std::copy_n(DELTA_MAGIC, sizeof(DELTA_MAGIC), header.magic);
+		header.block_size = block_size;
+		header.reserved = 0;
+		header.old_blocks = old_device.blocks_count();
+		header.new_blocks = new_device.blocks_count();
+
+		DeltaWriter writer(out, block_size);
+		writer.put(&header, sizeof(header));
+
+		std::vector<uint8_t> chunk(CHUNK_SIZE / block_size * block_size);
+		std::vector<uint8_t> const zeros(block_size, 0);
+		std::vector<uint8_t> old(block_size);
+		uint64_t hash = 0;
+
+		/* does the old block hold this data, without trusting any hash */
+		auto const matches = [&](uint32_t block, uint8_t const *data)
+		{
+			if (block >= old_count)
+				return false;
+			old_cache.read(block, old.data(), block_size);
+			return std::equal(old.begin(), old.end(), data);
+		};
+
+		for (size_t no = 0; no < new_device.blocks_count(); no += chunk.size() / block_size)
+		{
+			size_t const blocks = std::min(chunk.size() / block_size, new_device.blocks_count() - no);
+			new_cache.read(no, chunk.data(), blocks * block_size);
+
+			for (size_t it = 0; it != blocks; ++it)
+			{
+				uint8_t *const data = chunk.data() + it * block_size;
+
+				/* nothing reads free blocks, they need not travel */
+				if (no + it >= used || !busy.test(no + it))
+				{
+					std::fill_n(data, block_size, 0);
+					writer.zero();
+					hash = xxh64(data, block_size, hash);
+					continue;
+				}
+				hash = xxh64(data, block_size, hash);
+
+				if (std::equal(zeros.begin(), zeros.end(), data))
+				{
+					writer.zero();
+					continue;
+				}
+
+				std::unordered_map<uint32_t, uint32_t>::const_iterator const hint = hints.find(no + it);
+				if (hint != hints.end() && matches(hint->second, data))
+				{
+					writer.copy(hint->second);
+					continue;
+				}
+				if (matches(no + it, data))
+				{
+					writer.copy(no + it);
+					continue;
+				}
+				std::unordered_map<uint64_t, uint32_t>::const_iterator const same =
+						index.find(xxh64(data, block_size));
+				if (same != index.end() && matches(same->second, data))
+				{
+					writer.copy(same->second);
+					continue;
+				}
+				writer.literal(data);
+			}
+		}
+
+		old_cache.drop();
+		new_cache.drop();
+		writer.finish(hash);
+		return writer.stats();
+	}
+
+	void apply(std::string const &old_img, int in, std::string const &new_img)
+	{
+		DeltaHeader header;
+		read_all(in, &header, sizeof(header));
+		if (memcmp(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)))
+			throw std::runtime_error("not an image delta");
+
+		size_t const bs = header.block_size;
+		FileDevice source(old_img, bs, false);
+		if (source.blocks_count() != header.old_blocks)
+			throw std::runtime_error("delta was made against another image");
+
+		int const out = open(new_img.c_str(), O_WRONLY | O_CREAT, 0644);
+		if (out < 0)
+			throw std::runtime_error("image open error");
+
+		if (same_file(out, old_img))
+		{
+			close(out);
+			throw std::invalid_argument("cannot apply over the old image");
+		}
+
+		/* a half written or wrong image is not left behind */
+		try
+		{
+			if (ftruncate(out, 0))
+				throw std::runtime_error("image write error");
+
+			std::vector<uint8_t> chunk(CHUNK_SIZE / bs * bs);
+			std::vector<uint8_t> packed;
+			uint64_t hash = 0;
+			uint64_t done = 0;
+
+			for (;;)
+			{
+				DeltaOp op;
+				read_all(in, &op, sizeof(op));
+				if (op.type == END)
+					break;
+				if (done + op.count > header.new_blocks)
+					throw std::runtime_error("delta writes past the image end");
+
+				if (op.type == COPY)
+				{
+					be64 start;
+					read_all(in, &start, sizeof(start));
+					if (start + op.count > source.blocks_count())
+						throw std::runtime_error("delta copies past the old image end");
+
+					for (uint64_t it = 0; it < op.count; it += chunk.size() / bs)
+					{
+						size_t const blocks = std::min<uint64_t>(chunk.size() / bs, op.count - it);
+						source.read_blocks(start + it, chunk.data(), blocks);
+						for (size_t block = 0; block != blocks; ++block)
+							hash = xxh64(chunk.data() + block * bs, bs, hash);
+						write_all(out, chunk.data(), blocks * bs);
+					}
+				}
+				else if (op.type == ZERO)
+				{
+					std::vector<uint8_t> const zeros(bs, 0);
+					for (uint32_t it = 0; it != op.count; ++it)
+						hash = xxh64(zeros.data(), bs, hash);
+					/* the file is new, skipping leaves a hole */
+					if (lseek(out, static_cast<off_t>(op.count) * bs, SEEK_CUR) < 0)
+						throw std::runtime_error("image write error");
+				}
+				else if (op.type == ZSTD || op.type == RAW)
+				{
+					be32 len;
+					read_all(in, &len, sizeof(len));
+					if (static_cast<uint64_t>(op.count) * bs > CHUNK_SIZE ||
+							len > ZSTD_compressBound(CHUNK_SIZE))
+						throw std::runtime_error("delta literal is too big");
+
+					size_t const size = op.count * bs;
+					packed.resize(len);
+					read_all(in, packed.data(), len);
+					if (op.type == RAW ? len != size :
+							ZSTD_decompress(chunk.data(), size, packed.data(), len) != size)
+						throw std::runtime_error("delta literal is corrupted");
+
+					uint8_t const *const data = op.type == RAW ? packed.data() : chunk.data();
+					for (uint32_t it = 0; it != op.count; ++it)
+						hash = xxh64(data + it * bs, bs, hash);
+					write_all(out, data, size);
+				}
+				else
+					throw std::runtime_error("unknown delta op");
+
+				done += op.count;
+			}
+
+			be64 sum;
+			read_all(in, &sum, sizeof(sum));
+			if (done != header.new_blocks || sum != hash)
+				throw std::runtime_error("result does not match the new image");
+			if (ftruncate(out, static_cast<off_t>(done) * bs))
+				throw std::runtime_error("image write error");
+		}
+		catch (...)
+		{
+			close(out);
+			unlink(new_img.c_str());
+			throw;
+		}
+
+		if (close(out))
+		{
+			unlink(new_img.c_str());
+			throw std::runtime_error("image write error");
+		}
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+	std::string const mode = argc > 1 ? argv[1] : "";
+
+	if (argc != 5 || (mode != "diff" && mode != "apply"))
+	{
+		std::cout << "usage: " << argv[0] << " diff old-image new-image delta|-" << std::endl
+			<< "       " << argv[0] << " apply old-image delta|- new-image" << std::endl;
+		return 1;
+	}
+
+	/* the report stays off a delta written to stdout */
+	std::ostream &report = mode == "diff" && std::string(argv[4]) == "-" ? std::cerr : std::cout;
+
+	try
+	{
+		if (mode == "diff")
+		{
+			int const out = std::string(argv[4]) == "-" ? 1 :
+					open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (out < 0)
+				throw std::runtime_error("cannot create delta");
+
+			Stats const stats = diff(argv[2], argv[3], out);
+			if (out != 1 && close(out))
+				throw std::runtime_error("delta write error");
+
+			report << "blocks: " << stats.copied << " copied, " << stats.zeros << " zero, "
+				<< stats.literal << " literal" << std::endl
+				<< "delta: " << stats.bytes << " bytes" << std::endl;
+		}
+		else
+		{
+			int const in = std::string(argv[3]) == "-" ? 0 : open(argv[3], O_RDONLY);
+			if (in < 0)
+				throw std::runtime_error("cannot open delta");
+
+			apply(argv[2], in, argv[4]);
+			if (in)
+				close(in);
+		}
+	}
+	catch (std::exception const &ex)
+	{
+		report << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,211 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cmath>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device.hpp"
+
+void Device::read_blocks(size_t no, uint8_t *data, size_t count)
+{
+	for (size_t it = 0; it != count; ++it)
+		read(no + it, data + it * block_size());
+}
+
+void Device::write_blocks(size_t no, uint8_t const *data, size_t count)
+{
+	for (size_t it = 0; it != count; ++it)
+		write(no + it, data + it * block_size());
+}
+
+FileDevice::FileDevice(std::string const &img, size_t block_size, bool writable)
+	: fd_(img.c_str(), writable ? std::ios::in | std::ios::out : std::ios::in)
+	, block_size_(block_size)
+	, blocks_count_(0)
+	, writable_(writable)
+{
+	if (!fd_)
+		throw std::runtime_error("image open error");
+	blocks_count_ = device_size() / block_size_;
+}
+
+size_t FileDevice::block_size() const
+{ return block_size_; }
+
+size_t FileDevice::blocks_count() const
+{ return blocks_count_; }
+
+void FileDevice::read(size_t no, uint8_t *data)
+{ read_blocks(no, data, 1); }
+
+void FileDevice::write(size_t no, uint8_t const *data)
+{ write_blocks(no, data, 1); }
+
+void FileDevice::read_blocks(size_t no, uint8_t *data, size_t count)
+{
+	fd_.seekg(no * block_size_);
+	/* a short image reads as zeros, do not let it fail later writes */
+	if (!fd_.read(reinterpret_cast<char *>(data), count * block_size_))
+	{
+		std::fill_n(data + fd_.gcount(), count * block_size_ - fd_.gcount(), 0);
+		fd_.clear();
+	}
+}
+
+void FileDevice::write_blocks(size_t no, uint8_t const *data, size_t count)
+{
+	if (!writable_)
+		throw std::logic_error("image is opened read only");
+	fd_.seekp(no * block_size_);
+	if (!fd_.write(reinterpret_cast<char const *>(data), count * block_size_))
+		throw std::runtime_error("image write error");
+}
+
+size_t FileDevice::device_size()
+{
+	fd_.seekg(0, std::ios_base::end);
+	return static_cast<size_t>(fd_.tellg());
+}
+
+void size_image(std::string const &path, uint64_t bytes)
+{
+	int const fd = open(path.c_str(), O_WRONLY | O_CREAT, 0644);
+	struct stat buffer;
+
+	if (fd < 0)
+		throw std::runtime_error("image open error");
+
+	int const err = fstat(fd, &buffer) ? -1 : S_ISREG(buffer.st_mode) ?
+			ftruncate(fd, bytes) :
+			static_cast<uint64_t>(lseek(fd, 0, SEEK_END)) < bytes ? -1 : 0;
+	close(fd);
+
+	if (err)
+		throw std::runtime_error("cannot make image of the planned size");
+}
+
+CountingDevice::CountingDevice(Device &device)
+	: device_(&device)
+	, reads_(0)
+{ }
+
+size_t CountingDevice::block_size() const
+{ return device_->block_size(); }
+
+size_t CountingDevice::blocks_count() const
+{ return device_->blocks_count(); }
+
+void CountingDevice::read(size_t no, uint8_t *data)
+{
+	device_->read(no, data);
+	++reads_;
+}
+
+void CountingDevice::write(size_t no, uint8_t const *data)
+{ device_->write(no, data); }
+
+void CountingDevice::read_blocks(size_t no, uint8_t *data, size_t count)
+{
+	device_->read_blocks(no, data, count);
+	reads_ += count;
+}
+
+void CountingDevice::write_blocks(size_t no, uint8_t const *data, size_t count)
+{ device_->write_blocks(no, data, count); }
+
+size_t CountingDevice::reads() const
+{ return reads_; }
+
+namespace {
+
+	/* 7200 rpm disk, SATA flash and a block device a gigabit link away */
+	DeviceModel const models[] = {
+		{ "hdd", 50.0, 4700.0, 8000.0, 150.0 },
+		{ "ssd", 90.0, 0.0, 0.0, 520.0 },
+		{ "nbd", 250.0, 0.0, 0.0, 110.0 },
+	};
+
+}
+
+DeviceModel const &device_model(std::string const &name)
+{
+	for (DeviceModel const &model : models)
+	{
+		if (name == model.name)
+			return model;
+	}
+	throw std::invalid_argument("unknown device model " + name);
+}
+
+ModelDevice::ModelDevice(Device &device, DeviceModel const &model)
+	: device_(&device)
+	, model_(model)
+	, head_(0)
+	, elapsed_(0)
+{ }
+
+size_t ModelDevice::block_size() const
+{ return device_->block_size(); }
+
+size_t ModelDevice::blocks_count() const
+{ return device_->blocks_count(); }
+
+void ModelDevice::read(size_t no, uint8_t *data)
+{
+	device_->read(no, data);
+	charge(false, no, 1);
+}
+
+void ModelDevice::write(size_t no, uint8_t const *data)
+{
+	device_->write(no, data);
+	charge(true, no, 1);
+}
+
+void ModelDevice::read_blocks(size_t no, uint8_t *data, size_t count)
+{
+	device_->read_blocks(no, data, count);
+	charge(false, no, count);
+}
+
+void ModelDevice::write_blocks(size_t no, uint8_t const *data, size_t count)
+{
+	device_->write_blocks(no, data, count);
+	charge(true, no, count);
+}
+
+DeviceModel const &ModelDevice::model() const
+{ return model_; }
+
+double ModelDevice::elapsed() const
+{ return elapsed_; }
+
+std::vector<Access> const &ModelDevice::trace() const
+{ return trace_; }
+
+void ModelDevice::clear()
+{
+	elapsed_ = 0;
+	trace_.clear();
+}
+
+void ModelDevice::charge(bool write, size_t no, size_t count)
+{
+	Access access = { write, no, count, no != head_, model_.request };
+
+	/* the seek grows with the square root of the distance, as arms do */
+	if (access.seek)
+	{
+		size_t const distance = no > head_ ? no - head_ : head_ - no;
+		access.cost += model_.seek + model_.stroke *
+			std::sqrt(static_cast<double>(distance) / std::max<size_t>(blocks_count(), 1));
+	}
+	access.cost += count * block_size() / model_.bandwidth;
+
+	head_ = no + count;
+	elapsed_ += access.cost;
+	trace_.push_back(access);
+}
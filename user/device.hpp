@@ -0,0 +1,131 @@
+#ifndef __DEVICE_HPP__
+#define __DEVICE_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+/* what BlockCache reads blocks from and writes them back to */
+class Device
+{
+public:
+	virtual ~Device() {}
+
+	virtual size_t block_size() const = 0;
+	virtual size_t blocks_count() const = 0;
+	virtual void read(size_t no, uint8_t *data) = 0;
+	virtual void write(size_t no, uint8_t const *data) = 0;
+
+	/* runs of blocks, one block at a time unless the device does better */
+	virtual void read_blocks(size_t no, uint8_t *data, size_t count);
+	virtual void write_blocks(size_t no, uint8_t const *data, size_t count);
+};
+
+/* image file or block device, writes to a read only one throw */
+class FileDevice : public Device
+{
+public:
+	FileDevice(std::string const &img, size_t block_size, bool writable = true);
+
+	FileDevice(FileDevice const &) = delete;
+	FileDevice &operator=(FileDevice const &) = delete;
+
+	size_t block_size() const override;
+	size_t blocks_count() const override;
+	void read(size_t no, uint8_t *data) override;
+	void write(size_t no, uint8_t const *data) override;
+	void read_blocks(size_t no, uint8_t *data, size_t count) override;
+	void write_blocks(size_t no, uint8_t const *data, size_t count) override;
+
+private:
+	size_t device_size();
+
+	std::fstream fd_;
+	size_t block_size_;
+	size_t blocks_count_;
+	bool writable_;
+};
+
+/* regular files are created or truncated to the size, devices checked */
+void size_image(std::string const &path, uint64_t bytes);
+
+/* passes everything through to another device counting blocks read */
+class CountingDevice : public Device
+{
+public:
+	explicit CountingDevice(Device &device);
+
+	size_t block_size() const override;
+	size_t blocks_count() const override;
+	void read(size_t no, uint8_t *data) override;
+	void write(size_t no, uint8_t const *data) override;
+	void read_blocks(size_t no, uint8_t *data, size_t count) override;
+	void write_blocks(size_t no, uint8_t const *data, size_t count) override;
+
+	size_t reads() const;
+
+private:
+	Device *device_;
+	size_t reads_;
+};
+
+/* what a request costs on some kind of device, times in microseconds */
+struct DeviceModel
+{
+	char const *name;
+	double request;		/* per request overhead */
+	double seek;		/* any request that does not follow the last one */
+	double stroke;		/* more for a seek over the whole device */
+	double bandwidth;	/* bytes per microsecond */
+};
+
+/* hdd, ssd or nbd, throws on other names */
+DeviceModel const &device_model(std::string const &name);
+
+/* a request as the model saw it */
+struct Access
+{
+	bool write;
+	size_t block;
+	size_t count;
+	bool seek;
+	double cost;
+};
+
+/*
+ * Passes everything through to another device charging each request
+ * the time the model gives it, so layouts and read patterns compare the
+ * same on any machine.
+ */
+class ModelDevice : public Device
+{
+public:
+	ModelDevice(Device &device, DeviceModel const &model);
+
+	size_t block_size() const override;
+	size_t blocks_count() const override;
+	void read(size_t no, uint8_t *data) override;
+	void write(size_t no, uint8_t const *data) override;
+	void read_blocks(size_t no, uint8_t *data, size_t count) override;
+	void write_blocks(size_t no, uint8_t const *data, size_t count) override;
+
+	DeviceModel const &model() const;
+	/* modeled time of all requests so far */
+	double elapsed() const;
+	std::vector<Access> const &trace() const;
+	/* forgets the requests so far, the head stays where it is */
+	void clear();
+
+private:
+	void charge(bool write, size_t no, size_t count);
+
+	Device *device_;
+	DeviceModel model_;
+	size_t head_;
+	double elapsed_;
+	std::vector<Access> trace_;
+};
+
+#endif /*__DEVICE_HPP__*/
@@ -0,0 +1,42 @@
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "disk.hpp"
+
+uint64_t dir_record_offset(uint64_t tail, size_t name_len, size_t block_size)
+{
+	if (tail % block_size + AUFS_DIR_RECORD_SIZE(name_len) > block_size)
+		return (tail / block_size + 1) * block_size;
+	return tail;
+}
+
+void decode_dir_block(uint8_t const *data, size_t block_size, bool records, size_t count,
+		DirEntries &entries)
+{
+	if (!records)
+	{
+		size_t const in_block = std::min(count, block_size / sizeof(struct aufs_dir_entry));
+		struct aufs_dir_entry const *const dp = reinterpret_cast<struct aufs_dir_entry const *>(data);
+
+		for (size_t it = 0; it != in_block; ++it)
+			entries.emplace_back(std::string(dp[it].name,
+					strnlen(dp[it].name, AUFS_FILENAME_MAXLEN)), dp[it].inode_no);
+		return;
+	}
+
+	size_t offset = 0;
+	while (count-- && offset + sizeof(struct aufs_dir_record) <= block_size)
+	{
+		struct aufs_dir_record const *const rec =
+			reinterpret_cast<struct aufs_dir_record const *>(data + offset);
+		if (!rec->name_len)
+			break;
+		if (offset + AUFS_DIR_RECORD_SIZE(rec->name_len) > block_size)
+			throw std::runtime_error("directory record crosses the block end");
+
+		entries.emplace_back(std::string(reinterpret_cast<char const *>(rec + 1),
+				rec->name_len), rec->inode_no);
+		offset += AUFS_DIR_RECORD_SIZE(rec->name_len);
+	}
+}
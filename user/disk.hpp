@@ -0,0 +1,28 @@
+#ifndef __DISK_HPP__
+#define __DISK_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "endian.hpp"
+
+#define AUFS_BE32 be32
+#define AUFS_BE64 be64
+#include <aufs_format.h>
+
+typedef std::vector<std::pair<std::string, uint32_t>> DirEntries;
+
+/*
+ * Appends up to count entries of one directory block, which holds either
+ * variable length records or fixed entries (no AUFS_FEATURE_DIRENTS).
+ */
+void decode_dir_block(uint8_t const *data, size_t block_size, bool records, size_t count,
+		DirEntries &entries);
+
+/* where a record for the name goes when the directory is filled up to tail */
+uint64_t dir_record_offset(uint64_t tail, size_t name_len, size_t block_size);
+
+#endif /*__DISK_HPP__*/
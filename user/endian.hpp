@@ -0,0 +1,37 @@
+#ifndef __ENDIAN_HPP__
+#define __ENDIAN_HPP__
+
+#include <cstdint>
+
+constexpr bool host_is_big_endian()
+{ return __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__; }
+
+/* conversions compile away on big endian hosts */
+constexpr uint32_t big_endian(uint32_t value)
+{ return host_is_big_endian() ? value : __builtin_bswap32(value); }
+
+constexpr uint64_t big_endian(uint64_t value)
+{ return host_is_big_endian() ? value : __builtin_bswap64(value); }
+
+/* big endian on-disk field that converts on access */
+template <typename T>
+class BigEndian
+{
+public:
+	BigEndian() = default;
+
+	constexpr BigEndian(T value)
+		: raw_(big_endian(value))
+	{ }
+
+	constexpr operator T() const
+	{ return big_endian(raw_); }
+
+private:
+	T raw_;
+};
+
+typedef BigEndian<uint32_t> be32;
+typedef BigEndian<uint64_t> be64;
+
+#endif /*__ENDIAN_HPP__*/
@@ -0,0 +1,408 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.hpp"
+#include "options.hpp"
+#include "reader.hpp"
+
+namespace {
+
+	struct Job
+	{
+		std::string path;
+		uint32_t ino;
+	};
+
+	/* applied once everything below is in place, or the writes would undo it */
+	struct DirAttributes
+	{
+		std::string path;
+		uint32_t mode;
+		uint32_t uid;
+		uint32_t gid;
+		uint64_t ctime;
+	};
+
+	std::runtime_error failure(std::string const &what, std::string const &path)
+	{ return std::runtime_error(what + " " + path + ": " + strerror(errno)); }
+
+	/* names come from the image, none may lead out of the directory */
+	bool safe_name(std::string const &name)
+	{
+		return !name.empty() && name != "." && name != ".." &&
+				name.find_first_of(std::string("/\0", 2)) == std::string::npos;
+	}
+
+	/*
+	 * Every directory and file is a job on one queue, threads take them as
+	 * they come, each with its own reader. Files are copied straight from
+	 * the image file, a whole extent per call.
+	 */
+	class Extractor
+	{
+	public:
+		Extractor(std::string const &img, std::string const &root)
+			: img_(img)
+			, block_size_(Reader::probe_block_size(img))
+			, fd_(open(img.c_str(), O_RDONLY))
+			, busy_(0)
+			, failed_(false)
+			, files_(0)
+			, dirs_(0)
+			, bytes_(0)
+			, unowned_(0)
+		{
+			if (fd_ < 0)
+				throw std::runtime_error("image open error");
+			queue_.push_back(Job{ root, 0 });
+		}
+
+		~Extractor()
+		{ close(fd_); }
+
+		void run(size_t threads)
+		{
+			std::vector<std::thread> pool;
+			for (size_t it = 0; it != threads; ++it)
+				pool.emplace_back([this]() { work(); });
+			for (std::thread &thread : pool)
+				thread.join();
+			if (error_)
+				std::rethrow_exception(error_);
+
+			for (std::pair<std::string, std::string> const &link : links_)
+			{
+				if (::link(link.first.c_str(), link.second.c_str()))
+					throw failure("cannot link", link.second);
+			}
+
+			/* deepest first, a parent may lose the write bit */
+			std::sort(attributes_.begin(), attributes_.end(),
+					[](DirAttributes const &a, DirAttributes const &b) { return a.path > b.path; });
+			for (DirAttributes const &dir : attributes_)
+			{
+				int const fd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY);
+				if (fd < 0)
+					throw failure("cannot open", dir.path);
+				set_attributes(fd, dir.path, dir.mode, dir.uid, dir.gid, dir.ctime);
+				close(fd);
+			}
+		}
+
+		size_t files() const
+		{ return files_; }
+
+		size_t dirs() const
+		{ return dirs_; }
+
+		size_t links() const
+		{ return links_.size(); }
+
+		uint64_t bytes() const
+		{ return bytes_; }
+
+		size_t unowned() const
+		{ return unowned_; }
+
+	private:
+		void work()
+		{
+			FileDevice device(img_, block_size_, false);
+			BlockCache cache(device);
+			Reader reader(cache);
+			std::vector<uint8_t> buffer;
+
+			for (;;)
+			{
+				Job job;
+				{
+					std::unique_lock<std::mutex> lock(mutex_);
+					ready_.wait(lock, [this]() { return !queue_.empty() || !busy_ || failed_; });
+					if (failed_ || queue_.empty())
+						break;
+					job = queue_.front();
+					queue_.pop_front();
+					++busy_;
+				}
+
+				try
+				{
+					extract(reader, job, buffer);
+				}
+				catch (...)
+				{
+					std::lock_guard<std::mutex> lock(mutex_);
+					if (!failed_)
+						error_ = std::current_exception();
+					failed_ = true;
+				}
+				/* blocks of finished directories are not needed again */
+				cache.drop();
+
+				std::lock_guard<std::mutex> lock(mutex_);
+				--busy_;
+				ready_.notify_all();
+			}
+
+			ready_.notify_all();
+		}
+
+		void extract(Reader &reader, Job const &job, std::vector<uint8_t> &buffer)
+		{
+			Inode const node = reader.inode(job.ino ? job.ino : reader.root_inode());
+
+			if (S_ISDIR(node.mode()))
+			{
+				/* only the owner may write until the attributes are set */
+				if (mkdir(job.path.c_str(), 0700) && (job.ino || errno != EEXIST))
+					throw failure("cannot create", job.path);
+
+				DirEntries const children = reader.children(node);
+				for (std::pair<std::string, uint32_t> const &child : children)
+				{
+					if (!safe_name(child.first))
+						throw std::runtime_error("bad name in " + job.path + ": " + child.first);
+				}
+
+				std::lock_guard<std::mutex> lock(mutex_);
+				attributes_.push_back(DirAttributes{ job.path, node.mode(), node.uid(), node.gid(), node.ctime() });
+				for (std::pair<std::string, uint32_t> const &child : children)
+					queue_.push_back(Job{ job.path + "/" + child.first, child.second });
+				ready_.notify_all();
+				++dirs_;
+				return;
+			}
+
+			if (!S_ISREG(node.mode()))
+				return;
+
+			/* the first name found gets the data, the others are linked to it at the end */
+			if (node.links() > 1)
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				std::pair<std::map<uint32_t, std::string>::iterator, bool> const first =
+						linked_.emplace(job.ino, job.path);
+				if (!first.second)
+				{
+					links_.emplace_back(first.first->second, job.path);
+					return;
+				}
+			}
+
+			int const fd = open(job.path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+			if (fd < 0)
+				throw failure("cannot create", job.path);
+
+			try
+			{
+				if (node.flags() & (AUFS_INODE_INLINE | AUFS_INODE_COMPRESSED))
+					copy_read(reader, node, fd, buffer);
+				else
+					copy_extents(reader.extents(node), node.length(), fd, buffer);
+
+				/* holes and the tail past the last extent */
+				if (ftruncate(fd, node.length()))
+					throw failure("cannot write", job.path);
+				set_attributes(fd, job.path, node.mode(), node.uid(), node.gid(), node.ctime());
+			}
+			catch (...)
+			{
+				close(fd);
+				throw;
+			}
+
+			if (close(fd))
+				throw failure("cannot write", job.path);
+			++files_;
+			bytes_ += node.length();
+		}
+
+		/* data the reader has to unpack first */
+		void copy_read(Reader &reader, Inode const &node, int fd, std::vector<uint8_t> &buffer)
+		{
+			buffer.resize(COPY_SIZE);
+			for (uint64_t offset = 0; offset < node.length();)
+			{
+				size_t const len = reader.read(node, offset, buffer.data(), buffer.size());
+				if (!len)
+					throw std::runtime_error("file is short in the image");
+				pwrite_all(fd, buffer.data(), len, offset);
+				offset += len;
+			}
+		}
+
+		void copy_extents(std::vector<Extent> const &extents, uint64_t length, int fd,
+				std::vector<uint8_t> &buffer)
+		{
+			uint64_t offset = 0;
+
+			for (Extent const &extent : extents)
+			{
+				if (offset >= length)
+					break;
+
+				uint64_t const len = std::min(length - offset,
+						static_cast<uint64_t>(extent.blocks) * block_size_);
+				if (extent.block)
+					copy_range(static_cast<uint64_t>(extent.block) * block_size_, fd, offset, len, buffer);
+				offset += len;
+			}
+		}
+
+		/* in kernel when the file systems allow it, through a buffer when not */
+		void copy_range(uint64_t from, int fd, uint64_t to, uint64_t len, std::vector<uint8_t> &buffer)
+		{
+			loff_t in = from;
+			loff_t out = to;
+
+			while (len)
+			{
+				ssize_t const ret = copy_file_range(fd_, &in, fd, &out, len, 0);
+				if (ret > 0)
+				{
+					len -= ret;
+					continue;
+				}
+				if (ret < 0 && errno == EINTR)
+					continue;
+				if (ret < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+					throw std::runtime_error(std::string("copy error: ") + strerror(errno));
+				break;
+			}
+
+			buffer.resize(COPY_SIZE);
+			while (len)
+			{
+				size_t const count = std::min<uint64_t>(len, buffer.size());
+				pread_all(fd_, buffer.data(), count, in);
+				pwrite_all(fd, buffer.data(), count, out);
+				in += count;
+				out += count;
+				len -= count;
+			}
+		}
+
+		/* the owner goes first, changing it drops the set id bits */
+		void set_attributes(int fd, std::string const &path, uint32_t mode, uint32_t uid, uint32_t gid,
+				uint64_t ctime)
+		{
+			if (fchown(fd, uid, gid))
+			{
+				if (errno != EPERM)
+					throw failure("cannot change owner of", path);
+				++unowned_;
+			}
+			if (fchmod(fd, mode & 07777))
+				throw failure("cannot change mode of", path);
+
+			/* the image only keeps the change time, it reads back as all three */
+			struct timespec const times[2] = {
+				{ static_cast<time_t>(ctime), 0 },
+				{ static_cast<time_t>(ctime), 0 }
+			};
+			if (futimens(fd, times))
+				throw failure("cannot set times of", path);
+		}
+
+		std::string img_;
+		uint32_t block_size_;
+		int fd_;
+
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		std::deque<Job> queue_;
+		size_t busy_;
+		bool failed_;
+		std::exception_ptr error_;
+		std::map<uint32_t, std::string> linked_;
+		std::vector<std::pair<std::string, std::string>> links_;
+		std::vector<DirAttributes> attributes_;
+
+		std::atomic<size_t> files_;
+		std::atomic<size_t> dirs_;
+		std::atomic<uint64_t> bytes_;
+		std::atomic<size_t> unowned_;
+	};
+
+}
+
+int main(int argc, char **argv)
+{
+	static struct option const options[] = {
+		{ "threads", required_argument, nullptr, 't' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+	int opt;
+	try
+	{
+		while ((opt = getopt_long(argc, argv, "t:", options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 't':
+				threads = parse_threads(optarg);
+				break;
+			default:
+				std::cout << "usage: " << argv[0] << " [--threads=N] image dir" << std::endl;
+				return 1;
+			}
+		}
+	}
+	catch (std::exception const &ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return 1;
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 3)
+	{
+		std::cout << "image and target dir expected" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		std::chrono::steady_clock::time_point const start = std::chrono::steady_clock::now();
+		Extractor extractor(argv[1], argv[2]);
+		extractor.run(threads);
+		double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "extracted " << extractor.files() << " files, " << extractor.dirs() << " dirs, "
+			<< extractor.links() << " links, " << extractor.bytes() << " bytes in "
+			<< seconds << " s" << std::endl;
+		if (extractor.unowned())
+			std::cout << "owner not kept on " << extractor.unowned()
+				<< " entries, that takes root" << std::endl;
+	}
+	catch (std::exception const &ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -1,108 +1,37 @@
 #include <stdexcept>
 #include <algorithm>
 #include <cstring>
+#include <functional>
 
-#include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include "format.hpp"
+#include "io.hpp"
 
 namespace {
 
-	void set_bits(size_t from, size_t to, uint8_t *bits)
-	{
-		size_t const begin = (from + 7) >> 3;
-		size_t const end = to >> 3;
-
-		uint8_t const start = ~static_cast<uint8_t>(0xFF >> ((begin << 3) - from));
-		uint8_t const finish = ~static_cast<uint8_t>(0xFF << (to - (end << 3)));
-
-		for (size_t it = begin; it < end; ++it)
-			*(bits + it) |= static_cast<uint8_t>(0xFF);
-
-		if (begin - 1 == end)
-		{
-			*(bits + end) |= (start & finish);
-			return;
-		}
-
-		if ((begin << 3) != from)
-			*(bits + begin - 1) |= start;
-
-		if ((end << 3) != to)
-			*(bits + end) |= finish;
-	}
-
-	void clear_bits(size_t from, size_t to, uint8_t *bits)
-	{
-		size_t const begin = (from + 7) >> 3;
-		size_t const end = to >> 3;
-
-		uint8_t const start = static_cast<uint8_t>(0xFF >> ((begin << 3) - from));
-		uint8_t const finish = static_cast<uint8_t>(0xFF << (to - (end << 3)));
-
-		for (size_t it = begin; it < end; ++it)
-			*(bits + it) &= static_cast<uint8_t>(0x00);
-
-		if (begin - 1 == end)
-		{
-			*(bits + end) &= (start | finish);
-			return;
-		}
-
-		if ((end << 3) != from)
-			*(bits + begin - 1) &= start;
-
-		if ((end << 3) != to)
-			*(bits + end) &= finish;
-	}
-
-	size_t find_clear(uint8_t *bits, size_t bytes, size_t len)
+	size_t max_inodes_count(size_t blocks_count, size_t block_size)
 	{
-		size_t const size = ((len + 7) >> 3);
-		if (size > bytes)
-			return static_cast<size_t>(-1);
-		for (size_t it = 0; it <= bytes - size; ++it)
-		{
-			if ( !std::any_of(bits + it,
-							bits + it + size,
-							[] (uint8_t num)
-							{ return num != 0x00; }) )
-				return it << 3;
-		}
-		return static_cast<size_t>(-1);
-	}
+		size_t const meta = 2 + Bitmap::blocks_for(blocks_count, block_size);
+		size_t const blocks = blocks_count > meta ? blocks_count - meta : 0;
+		size_t const in_block = block_size / sizeof(struct aufs_dinode);
+		size_t const iblocks = std::max(blocks / (in_block + 1), static_cast<size_t>(1));
 
-	size_t find_clear_bit(uint8_t *bits, size_t bytes)
-	{
-		uint8_t *it = std::find_if(bits, bits + bytes,
-				[](uint8_t byte)
-				{ return byte != static_cast<uint8_t>(0xFF); });
-		if (static_cast<size_t>(it - bits) == bytes)
-			return static_cast<size_t>(-1);
-		for (size_t bit = 0; bit != 8; ++bit)
-		{
-			if ((*it >> bit) % 2 == 0)
-				return ((bits - it) << 3) | bit;
-		}
-		return static_cast<size_t>(-1);
+		return iblocks * in_block;
 	}
 
-	size_t max_inodes_count(size_t blocks_count, size_t block_size)
+	size_t max_table_inodes(size_t blocks_count, size_t block_size)
 	{
-		size_t const blocks = blocks_count - 3;
-		size_t const in_block = block_size / sizeof(struct inode);
-		size_t const iblocks = blocks / (in_block - 1) - 1;
+		size_t const meta = 2 + Bitmap::blocks_for(blocks_count, block_size);
+		size_t const in_block = block_size / sizeof(struct aufs_dinode);
 
-		return iblocks * in_block;
+		return blocks_count > meta ? (blocks_count - meta) * in_block : 0;
 	}
 
 }
 
-uint32_t const Formatter::FS_MAGIC = 0x13131313u;
-
 Formatter::Formatter(BlockCache &cache)
 	: Formatter(cache, cache.blocks_count())
 { }
@@ -115,12 +44,59 @@ Formatter::Formatter(BlockCache &cache, size_t blocks_count)
 Formatter::Formatter(BlockCache &cache, size_t blocks_count, size_t inodes_count)
 	: cache_(&cache)
 	, super_page_(cache_->block(0))
-	, block_page_(cache_->block(1))
-	, inode_page_(cache_->block(2))
-	, magic_(FS_MAGIC)
+	, magic_(AUFS_MAGIC_NUMBER)
 	, blocks_count_(blocks_count)
-	, inodes_count_(std::min(inodes_count, max_inodes_count(blocks_count, cache.block_size())))
-{ format(); }
+	, inodes_count_(std::min(inodes_count, max_table_inodes(blocks_count, cache.block_size())))
+	, inode_bitmap_(1 + Bitmap::blocks_for(blocks_count_, cache.block_size()))
+	, inode_table_(inode_bitmap_ + Bitmap::blocks_for(inodes_count_, cache.block_size()))
+	, inline_max_(0)
+	, dir_next_(0)
+	, dir_end_(0)
+{
+	blocks_map_ = Bitmap(cache, 1, inode_bitmap_ - 1);
+	inodes_map_ = Bitmap(cache, inode_bitmap_, inode_table_ - inode_bitmap_);
+	format();
+}
+
+Formatter::Formatter(BlockCache &cache, Open)
+	: cache_(&cache)
+	, super_page_(cache_->block(0))
+	, magic_(AUFS_MAGIC_NUMBER)
+	, blocks_count_(0)
+	, inodes_count_(0)
+	, inode_bitmap_(AUFS_LEGACY_INODE_BITMAP)
+	, inode_table_(AUFS_LEGACY_INODE_TABLE)
+	, inline_max_(0)
+	, dir_next_(0)
+	, dir_end_(0)
+{
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+
+	if (sbp->magic != magic())
+		throw std::runtime_error("wrong magic number");
+	if (sbp->block_size != block_size())
+		throw std::runtime_error("wrong block size");
+
+	blocks_count_ = sbp->blocks_count;
+	inodes_count_ = sbp->inodes_count;
+	if (!blocks_count_ || !inodes_count_)
+		throw std::runtime_error("image does not record its layout");
+
+	if (sbp->features & AUFS_FEATURE_LARGE)
+	{
+		inode_bitmap_ = sbp->inode_bitmap;
+		inode_table_ = sbp->inode_table;
+	}
+	else
+	{
+		sbp->inode_bitmap = inode_bitmap_;
+		sbp->inode_table = inode_table_;
+		set_features(sbp->features | AUFS_FEATURE_LARGE);
+	}
+
+	blocks_map_ = Bitmap(cache, 1, inode_bitmap_ - 1);
+	inodes_map_ = Bitmap(cache, inode_bitmap_, inode_table_ - inode_bitmap_);
+}
 
 uint32_t Formatter::magic() const
 { return magic_; }
@@ -134,79 +110,618 @@ uint32_t Formatter::blocks_count() const
 uint32_t Formatter::inodes_count() const
 { return inodes_count_; }
 
-struct super_block
-{
-	uint32_t magic;
-	uint32_t block_size;
-	uint32_t root_inode;
-};
+uint32_t Formatter::inode_table() const
+{ return inode_table_; }
 
 uint32_t Formatter::root_inode() const
 {
-	struct super_block const * const sbp = reinterpret_cast<struct super_block *>(super_page_->data());
-	return ntohl(sbp->root_inode);
+	struct aufs_dsuper_block const * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	return sbp->root_ino;
 }
 
 void Formatter::set_root_inode(uint32_t inode)
 {
-	struct super_block * const sbp = reinterpret_cast<struct super_block *>(super_page_->data());
-	sbp->root_inode = htonl(inode);
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	sbp->root_ino = inode;
 }
 
-Inode Formatter::alloc_inode()
+uint32_t Formatter::inline_max() const
+{ return inline_max_; }
+
+void Formatter::set_inline_max(uint32_t bytes)
 {
-	size_t const start = find_clear_bit(inode_page_->data(), inode_page_->block_size());
-	if (start == static_cast<size_t>(-1))
-		return Inode(*cache_, 0);
-	set_bits(start, start + 1, inode_page_->data());
-	return Inode(*cache_, start);
+	uint32_t const in_block = block_size() / sizeof(struct aufs_dinode);
+	struct aufs_dsuper_block const * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	uint32_t const features = sbp->features;
+
+	inline_max_ = std::min(bytes, static_cast<uint32_t>((in_block - 1) * sizeof(struct aufs_dinode)));
+	if (inline_max_)
+		set_features(features | AUFS_FEATURE_INLINE);
+}
+
+uint32_t Formatter::cluster_size() const
+{
+	struct aufs_dsuper_block const * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	return sbp->features & AUFS_FEATURE_COMPRESS ? 1u << sbp->cluster_bits : 0;
+}
+
+void Formatter::set_cluster_size(uint32_t bytes)
+{
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	uint32_t bits = 0;
+
+	while ((1u << bits) < bytes)
+		++bits;
+	if ((1u << bits) != bytes)
+		throw std::invalid_argument("cluster size must be a power of two");
+	if (cluster_size() && cluster_size() != bytes)
+		throw std::invalid_argument("image uses another cluster size");
+
+	sbp->cluster_bits = bits;
+	set_features(sbp->features | AUFS_FEATURE_COMPRESS);
+}
+
+void Formatter::set_features(uint32_t features)
+{
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	sbp->features = features;
+}
+
+bool Formatter::dir_records() const
+{
+	struct aufs_dsuper_block const * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	return sbp->features & AUFS_FEATURE_DIRENTS;
+}
+
+/* directories made earlier are walked once to find where they end */
+uint64_t Formatter::dir_tail(Inode const &inode)
+{
+	std::map<uint32_t, uint64_t>::const_iterator const it = dir_tails_.find(inode.inode());
+	if (it != dir_tails_.end())
+		return it->second;
+
+	uint64_t tail = 0;
+	for (uint32_t block = 0; block != inode.blocks(); ++block)
+	{
+		BlockCache::BlockPtr bp = cache_->block(inode.block() + block);
+		size_t offset = 0;
+
+		while (offset + sizeof(struct aufs_dir_record) <= block_size())
+		{
+			struct aufs_dir_record const *const rec =
+				reinterpret_cast<struct aufs_dir_record const *>(bp->data() + offset);
+			if (!rec->name_len)
+				break;
+			offset += AUFS_DIR_RECORD_SIZE(rec->name_len);
+		}
+		if (offset)
+			tail = static_cast<uint64_t>(block) * block_size() + offset;
+	}
+
+	dir_tails_[inode.inode()] = tail;
+	return tail;
+}
+
+Inode Formatter::alloc_inode(size_t slots)
+{
+	size_t const in_block = block_size() / sizeof(struct aufs_dinode);
+	size_t const start = inodes_map_.find_clear(slots, in_block);
+	if (start == Bitmap::npos || start + slots > inodes_count())
+		return Inode(*cache_, inode_table_, 0);
+	inodes_map_.set(start, start + slots);
+	return Inode(*cache_, inode_table_, start);
+}
+
+Inode Formatter::alloc_file(uint64_t length, std::vector<Extent> const &extents, uint32_t flags)
+{
+	bool const extended = (flags & AUFS_INODE_EXTENDED) || extents.size() > 1 || (length >> 32);
+
+	Inode inode = alloc_inode(extended ? 2 : 1);
+	if (!inode)
+		throw std::runtime_error("there is no free inode");
+
+	inode.set_mode(inode.mode() | S_IFREG);
+	inode.set_flags(flags | (extended ? AUFS_INODE_EXTENDED : 0));
+	if (extended)
+		std::memset(inode.ext(), 0, sizeof(struct aufs_dinode_ext));
+	set_extents(inode, extents);
+
+	return inode;
 }
 
 uint32_t Formatter::alloc_blocks(size_t count)
 {
-	size_t const start = find_clear(block_page_->data(),
-			block_page_->block_size(), count);
-	if (start == static_cast<size_t>(-1))
+	size_t const start = blocks_map_.find_clear(count);
+	if (start == Bitmap::npos)
 		return 0;
-	set_bits(start, start + count, block_page_->data());
+	blocks_map_.set(start, start + count);
 	return start;
 }
 
-Inode Formatter::mkfile(uint32_t length)
+/*
+ * Takes one contiguous run if there is one, otherwise stitches together
+ * the largest free runs.
+ */
+std::vector<Extent> Formatter::alloc_extents(size_t count)
 {
-	uint32_t const blocks = (length + block_size() - 1) / block_size();
-	uint32_t const block = alloc_blocks(blocks);
-	Inode inode = alloc_inode();
+	std::vector<Extent> extents;
+	if (!count)
+		return extents;
 
-	inode.set_block(block);
+	size_t const start = blocks_map_.find_clear(count);
+	if (start != Bitmap::npos)
+	{
+		blocks_map_.set(start, start + count);
+		extents.push_back(Extent{ static_cast<uint32_t>(start), static_cast<uint32_t>(count) });
+		return extents;
+	}
+
+	std::vector<std::pair<size_t, size_t>> runs = blocks_map_.clear_runs();
+	std::sort(std::begin(runs), std::end(runs),
+			[](std::pair<size_t, size_t> const &l, std::pair<size_t, size_t> const &r)
+			{ return l.second > r.second; });
+
+	size_t const max_extents = block_size() / sizeof(struct aufs_dextent);
+	size_t left = count;
+	for (std::pair<size_t, size_t> const &run : runs)
+	{
+		if (!left || extents.size() == max_extents)
+			break;
+		size_t const taken = std::min(left, run.second);
+		extents.push_back(Extent{ static_cast<uint32_t>(run.first), static_cast<uint32_t>(taken) });
+		left -= taken;
+	}
+
+	if (left)
+		throw std::runtime_error("there is no enough space");
+
+	for (Extent const &extent : extents)
+		blocks_map_.set(extent.block, extent.block + extent.blocks);
+	std::sort(std::begin(extents), std::end(extents),
+			[](Extent const &l, Extent const &r) { return l.block < r.block; });
+
+	return extents;
+}
+
+void Formatter::set_extents(Inode &inode, std::vector<Extent> const &extents)
+{
+	uint32_t blocks = 0;
+	for (Extent const &extent : extents)
+		blocks += extent.blocks;
+
+	inode.set_block(extents.empty() ? 0 : extents.front().block);
 	inode.set_blocks(blocks);
-	inode.set_mode(inode.mode() | S_IFREG);
+
+	if (!(inode.flags() & AUFS_INODE_EXTENDED))
+	{
+		if (extents.size() > 1)
+			throw std::logic_error("inode can not hold several extents");
+		return;
+	}
+
+	struct aufs_dinode_ext *const ext = inode.ext();
+	struct aufs_dextent *list = ext->extent;
+
+	ext->extents = extents.size();
+	if (extents.size() > AUFS_INLINE_EXTENTS)
+	{
+		uint32_t const overflow = alloc_blocks(1);
+		if (!overflow)
+			throw std::runtime_error("there is no enough space");
+		ext->overflow = overflow;
+		list = reinterpret_cast<struct aufs_dextent *>(cache_->block(overflow)->data());
+	}
+
+	for (size_t it = 0; it != extents.size(); ++it)
+	{
+		list[it].block = extents[it].block;
+		list[it].blocks = extents[it].blocks;
+	}
+}
+
+std::vector<Extent> Formatter::extents(Inode const &inode)
+{
+	std::vector<Extent> extents;
+
+	if (!(inode.flags() & AUFS_INODE_EXTENDED))
+	{
+		if (inode.blocks())
+			extents.push_back(Extent{ inode.block(), inode.blocks() });
+		return extents;
+	}
+
+	struct aufs_dinode_ext const *const ext = inode.ext();
+	uint32_t const count = ext->extents;
+	BlockCache::BlockPtr overflow;
+	struct aufs_dextent const *list = ext->extent;
+
+	if (count > AUFS_INLINE_EXTENTS)
+	{
+		overflow = cache_->block(ext->overflow);
+		list = reinterpret_cast<struct aufs_dextent const *>(overflow->data());
+	}
+
+	for (uint32_t it = 0; it != count; ++it)
+		extents.push_back(Extent{ list[it].block, list[it].blocks });
+
+	return extents;
+}
+
+uint32_t Formatter::map(Inode const &inode, uint32_t block)
+{
+	for (Extent const &extent : extents(inode))
+	{
+		if (block < extent.blocks)
+			return extent.block ? extent.block + block : 0;
+		block -= extent.blocks;
+	}
+	throw std::out_of_range("block is out of file");
+}
+
+Inode Formatter::mkfile(uint64_t length, bool extended)
+{
+	if (length && length <= inline_max())
+	{
+		uint32_t const slots = (length + sizeof(struct aufs_dinode) - 1) / sizeof(struct aufs_dinode);
+		Inode inode = alloc_inode(slots + 1 + extended);
+		if (inode)
+		{
+			inode.set_block(slots);
+			inode.set_mode(inode.mode() | S_IFREG);
+			inode.set_flags(AUFS_INODE_INLINE | (extended ? AUFS_INODE_EXTENDED : 0));
+			if (extended)
+				std::memset(inode.ext(), 0, sizeof(struct aufs_dinode_ext));
+			return inode;
+		}
+	}
+
+	uint64_t const blocks = (length + block_size() - 1) / block_size();
+	return alloc_file(length, alloc_extents(blocks), extended ? AUFS_INODE_EXTENDED : 0);
+}
+
+Inode Formatter::mkcompressed(uint64_t length, std::vector<uint8_t> const &extent, uint32_t flags,
+		bool extended)
+{
+	if (!cluster_size())
+		throw std::logic_error("compression is not enabled");
+
+	uint32_t const blocks = (extent.size() + block_size() - 1) / block_size();
+	Inode inode = alloc_file(length, alloc_extents(blocks),
+			flags | (extended ? AUFS_INODE_EXTENDED : 0));
+
+	write_blocks(inode, 0, extent.data(), extent.size());
+	inode.set_length(length);
 
 	return inode;
 }
 
-Inode Formatter::mkdir(uint32_t entries)
+Inode Formatter::mkshared(Inode const &origin, bool extended)
 {
-	uint32_t const blocks = (entries * sizeof(struct dir_entry) + block_size() - 1) / block_size();
+	Inode inode = alloc_file(origin.length(), extents(origin),
+			(origin.flags() & ~AUFS_INODE_EXTENDED) | (extended ? AUFS_INODE_EXTENDED : 0));
+
+	inode.set_length(origin.length());
+	inode.set_mode(origin.mode());
+
+	return inode;
+}
+
+Inode Formatter::mksparse(uint64_t length, std::vector<Extent> const &ranges, bool extended)
+{
+	uint64_t const blocks = (length + block_size() - 1) / block_size();
+	size_t const max_extents = block_size() / sizeof(struct aufs_dextent);
+	std::vector<Extent> data;
+	std::vector<Extent> filled;
+
+	/* a hole and a data extent per range at most, small holes get blocks */
+	std::vector<uint32_t> gaps;
+	for (size_t it = 1; it < ranges.size(); ++it)
+		gaps.push_back(ranges[it].block - (ranges[it - 1].block + ranges[it - 1].blocks));
+	std::sort(gaps.begin(), gaps.end(), std::greater<uint32_t>());
+
+	/* the leading and the trailing hole take an extent each as well */
+	size_t const edges = ranges.empty() ? 1 : (ranges.front().block != 0) +
+			(ranges.back().block + ranges.back().blocks < blocks);
+	size_t keep = std::min(gaps.size(), (max_extents - edges - 1) / 2);
+	bool whole = false;
+	std::vector<Extent> runs;
+	std::vector<Extent> extents;
+
+	for (;;)
+	{
+		uint32_t const least = keep ? gaps[keep - 1] : UINT32_MAX;
+		/* as many holes as long as the shortest one kept as fit */
+		size_t ties = keep ? keep - (std::lower_bound(gaps.begin(), gaps.end(), least,
+					std::greater<uint32_t>()) - gaps.begin()) : 0;
+
+		data.clear();
+		filled.clear();
+		for (Extent const &range : ranges)
+		{
+			uint32_t const gap = data.empty() ? 0 : range.block - (data.back().block + data.back().blocks);
+			bool const hole = gap > least || (gap == least && ties);
+
+			if (!data.empty() && !hole)
+			{
+				if (gap)
+					filled.push_back(Extent{ range.block - gap, gap });
+				data.back().blocks = range.block + range.blocks - data.back().block;
+			}
+			else
+			{
+				ties -= !data.empty() && gap == least;
+				data.push_back(range);
+			}
+		}
+
+		/* last resort, zeros everywhere as in a plain file */
+		if (whole)
+		{
+			uint32_t const end = data.front().block + data.front().blocks;
+			if (data.front().block)
+				filled.push_back(Extent{ 0, data.front().block });
+			if (end < blocks)
+				filled.push_back(Extent{ end, static_cast<uint32_t>(blocks - end) });
+			data.front() = Extent{ 0, static_cast<uint32_t>(blocks) };
+		}
+
+		uint32_t total = 0;
+		for (Extent const &range : data)
+			total += range.blocks;
+
+		runs = alloc_extents(total);
+		extents.clear();
+		uint64_t next = 0;
+		size_t run = 0;
+		uint32_t used = 0;
+
+		for (Extent const &range : data)
+		{
+			if (range.block > next)
+				extents.push_back(Extent{ 0, static_cast<uint32_t>(range.block - next) });
+
+			for (uint32_t left = range.blocks; left;)
+			{
+				uint32_t const count = std::min(left, runs[run].blocks - used);
+				extents.push_back(Extent{ runs[run].block + used, count });
+				used += count;
+				left -= count;
+				if (used == runs[run].blocks)
+				{
+					++run;
+					used = 0;
+				}
+			}
+			next = range.block + range.blocks;
+		}
+		if (next < blocks)
+			extents.push_back(Extent{ 0, static_cast<uint32_t>(blocks - next) });
+
+		if (extents.size() <= max_extents)
+			break;
+
+		/* fragmented free space, zero more of the holes and try again */
+		for (Extent const &extent : runs)
+			free_blocks(extent.block, extent.blocks);
+		if (!keep)
+			whole = true;
+		keep -= std::min(keep, (extents.size() - max_extents + 1) / 2);
+	}
+
+	Inode inode = alloc_file(length, extents, extended ? AUFS_INODE_EXTENDED : 0);
+	inode.set_length(length);
+
+	std::vector<uint8_t> const zeros(block_size(), 0);
+	for (Extent const &gap : filled)
+	{
+		for (uint32_t it = 0; it != gap.blocks; ++it)
+			write_blocks(inode, gap.block + it, zeros.data(), zeros.size());
+	}
+
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	set_features(sbp->features | AUFS_FEATURE_SPARSE);
+
+	return inode;
+}
+
+Inode Formatter::extend(Inode const &inode)
+{
+	if (inode.flags() & AUFS_INODE_EXTENDED)
+		return inode;
+
+	uint32_t const slots = inode.flags() & AUFS_INODE_INLINE ? inode.block() : 0;
+	Inode moved = alloc_inode(slots + 2);
+	if (!moved)
+		throw std::runtime_error("there is no free inode");
+
+	*moved.data() = *inode.data();
+	moved.set_flags(inode.flags() | AUFS_INODE_EXTENDED);
+	std::memset(moved.ext(), 0, sizeof(struct aufs_dinode_ext));
+	if (slots)
+		std::copy_n(inode.inline_data(), slots * sizeof(struct aufs_dinode), moved.inline_data());
+	else
+		set_extents(moved, extents(inode));
+
+	free(inode);
+	return moved;
+}
+
+void Formatter::set_links(Inode &inode, uint32_t links)
+{
+	if (!(inode.flags() & AUFS_INODE_EXTENDED))
+		throw std::logic_error("only extended inodes keep a link count");
+	inode.set_links(links);
+}
+
+void Formatter::copy_attributes(Inode &inode, Inode const &origin)
+{
+	inode.set_mode((inode.mode() & S_IFMT) | (origin.mode() & ~S_IFMT));
+	inode.set_uid(origin.uid());
+	inode.set_gid(origin.gid());
+	inode.set_ctime(origin.ctime());
+}
+
+void Formatter::reserve_dir_blocks(uint32_t blocks)
+{
+	release_dir_blocks();
+
 	uint32_t const block = alloc_blocks(blocks);
+	if (!block)
+		return;
+	dir_next_ = block;
+	dir_end_ = block + blocks;
+}
+
+void Formatter::release_dir_blocks()
+{
+	free_blocks(dir_next_, dir_end_ - dir_next_);
+	dir_next_ = dir_end_ = 0;
+}
+
+Inode Formatter::mkdir(std::vector<std::string> const &names)
+{
+	uint64_t bytes = names.size() * sizeof(struct aufs_dir_entry);
+	uint32_t block = 0;
+
+	if (dir_records())
+	{
+		bytes = 0;
+		for (std::string const &name : names)
+			bytes = dir_record_offset(bytes, name.size(), block_size()) +
+				AUFS_DIR_RECORD_SIZE(name.size());
+	}
+
+	uint32_t const blocks = (bytes + block_size() - 1) / block_size();
+
+	if (blocks && blocks <= dir_end_ - dir_next_)
+	{
+		block = dir_next_;
+		dir_next_ += blocks;
+	}
+	else
+		block = alloc_blocks(blocks);
+
+	if (blocks && !block)
+		throw std::runtime_error("there is no enough space");
+
 	Inode inode = alloc_inode();
+	if (!inode)
+		throw std::runtime_error("there is no free inode");
 
 	inode.set_block(block);
 	inode.set_blocks(blocks);
 	inode.set_mode(inode.mode() | S_IFDIR);
 
+	/* records end at the first zero name length */
+	for (uint32_t it = 0; it != blocks; ++it)
+	{
+		BlockCache::BlockPtr bp = cache_->block(block + it);
+		std::fill_n(bp->data(), block_size(), 0);
+	}
+	dir_tails_[inode.inode()] = 0;
+
 	return inode;
 }
 
 void Formatter::free(Inode const &inode)
-{ clear_bits(inode.inode(), inode.inode() + 1, inode_page_->data()); }
+{
+	uint32_t slots = 1;
+
+	if (inode.flags() & AUFS_INODE_EXTENDED)
+	{
+		if (inode.ext()->extents > AUFS_INLINE_EXTENTS)
+			free_blocks(inode.ext()->overflow, 1);
+		++slots;
+	}
+	if (inode.flags() & AUFS_INODE_INLINE)
+		slots += inode.block();
+
+	dir_tails_.erase(inode.inode());
+	inodes_map_.clear(inode.inode(), inode.inode() + slots);
+}
 
-uint32_t Formatter::write(Inode &inode, uint8_t const *data, uint32_t len)
+void Formatter::free_blocks(uint32_t block, uint32_t count)
+{ blocks_map_.clear(block, block + count); }
+
+uint32_t Formatter::shrink()
+{
+	uint32_t used = blocks_count();
+	while (used > inode_table_ && !blocks_map_.test(used - 1))
+		--used;
+
+	blocks_map_.set(used, blocks_map_.size());
+	blocks_count_ = used;
+	dir_end_ = std::min(dir_end_, used);
+	dir_next_ = std::min(dir_next_, dir_end_);
+
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	sbp->blocks_count = used;
+	return used;
+}
+
+Inode Formatter::inode(uint32_t ino)
 {
-	uint32_t const least = inode.blocks() * block_size() - inode.length();
-	uint32_t const block = inode.block() + inode.length() / block_size();
+	if (!ino || ino >= inodes_count() || !inodes_map_.test(ino))
+		throw std::out_of_range("inode is not allocated");
+	return Inode(*cache_, inode_table_, ino, false);
+}
+
+std::vector<std::pair<std::string, uint32_t>> Formatter::children(Inode const &inode)
+{
+	bool const records = dir_records();
+	DirEntries entries;
+
+	if (!(inode.mode() & S_IFDIR))
+		throw std::logic_error("it is not directory");
+
+	for (uint32_t block = 0; block != inode.blocks() && entries.size() < inode.length(); ++block)
+	{
+		BlockCache::BlockPtr bp = cache_->block(inode.block() + block);
+		decode_dir_block(bp->data(), block_size(), records, inode.length() - entries.size(), entries);
+	}
+
+	return entries;
+}
+
+std::vector<uint8_t> Formatter::read(Inode const &inode)
+{
+	if (inode.flags() & AUFS_INODE_INLINE)
+		return std::vector<uint8_t>(inode.inline_data(), inode.inline_data() + inode.length());
+
+	uint64_t const size = inode.flags() & (AUFS_INODE_LZ4 | AUFS_INODE_ZSTD) ?
+		static_cast<uint64_t>(inode.blocks()) * block_size() : inode.length();
+	std::vector<uint8_t> data;
+
+	data.resize(size);
+	uint64_t offset = 0;
+	for (Extent const &extent : extents(inode))
+	{
+		size_t const count = std::min(size - offset,
+				static_cast<uint64_t>(extent.blocks) * block_size());
+		if (extent.block)
+			cache_->read(extent.block, data.data() + offset, count);
+		offset += count;
+	}
+
+	return data;
+}
+
+size_t Formatter::write(Inode &inode, uint8_t const *data, size_t len)
+{
+	if (inode.flags() & AUFS_INODE_INLINE)
+	{
+		uint64_t const least = inode.block() * sizeof(struct aufs_dinode) - inode.length();
+		if (len > least)
+			throw std::out_of_range("there is no enough space");
+
+		std::copy_n(data, len, inode.inline_data() + inode.length());
+		inode.set_length(inode.length() + len);
+		return len;
+	}
+
+	uint64_t const least = static_cast<uint64_t>(inode.blocks()) * block_size() - inode.length();
 	uint32_t const offset = inode.length() % block_size();
-	uint32_t const written = std::min(len, static_cast<uint32_t>(block_size() - offset));
+	size_t const written = std::min(len, static_cast<size_t>(block_size() - offset));
 
 	if (!(inode.mode() & S_IFREG))
 		throw std::logic_error("it is not file");
@@ -214,50 +729,168 @@ uint32_t Formatter::write(Inode &inode, uint8_t const *data, uint32_t len)
 	if (len > least)
 		throw std::out_of_range("there is no enough space");
 
-	BlockCache::BlockPtr bp = cache_->block(block);
+	BlockCache::BlockPtr bp = cache_->block(map(inode, inode.length() / block_size()));
 	std::copy_n(data, written, bp->data() + offset);
 	inode.set_length(inode.length() + written);
 
 	return written;
 }
 
+void Formatter::write_extents(Inode &inode, uint8_t const *data, size_t len)
+{
+	if (!(inode.mode() & S_IFREG) || (inode.flags() & AUFS_INODE_INLINE))
+		throw std::logic_error("it is not file with extents");
+	if (inode.length() % block_size())
+		throw std::logic_error("file does not end on a block boundary");
+	if (len > static_cast<uint64_t>(inode.blocks()) * block_size() - inode.length())
+		throw std::out_of_range("there is no enough space");
+
+	write_blocks(inode, inode.length() / block_size(), data, len);
+	inode.set_length(inode.length() + len);
+}
+
+void Formatter::write_extents(Inode &inode, int fd, uint64_t len)
+{
+	std::vector<uint8_t> buffer(std::min(len, static_cast<uint64_t>(COPY_SIZE)));
+
+	while (len)
+	{
+		size_t const count = std::min(len, static_cast<uint64_t>(COPY_SIZE));
+		read_all(fd, buffer.data(), count);
+		write_extents(inode, buffer.data(), count);
+		len -= count;
+	}
+}
+
+/* one device write per extent the data covers, starting at file block */
+void Formatter::write_blocks(Inode const &inode, uint64_t block, uint8_t const *data, size_t len)
+{
+	size_t done = 0;
+
+	for (Extent const &extent : extents(inode))
+	{
+		if (done == len)
+			break;
+		if (block >= extent.blocks)
+		{
+			block -= extent.blocks;
+			continue;
+		}
+
+		size_t const count = std::min(len - done,
+				static_cast<size_t>(extent.blocks - block) * block_size());
+		if (!extent.block)
+			throw std::logic_error("cannot write into a hole");
+		cache_->write(extent.block + block, data + done, count);
+		done += count;
+		block = 0;
+	}
+}
+
+void Formatter::write_range(Inode &inode, uint64_t block, uint8_t const *data, size_t len)
+{
+	if (!(inode.mode() & S_IFREG) || (inode.flags() & AUFS_INODE_INLINE))
+		throw std::logic_error("it is not file with extents");
+	if (block * block_size() + len > static_cast<uint64_t>(inode.blocks()) * block_size())
+		throw std::out_of_range("there is no enough space");
+
+	write_blocks(inode, block, data, len);
+}
+
+void Formatter::write_range(Inode &inode, uint64_t block, int fd, uint64_t len)
+{
+	std::vector<uint8_t> buffer(std::min(len, static_cast<uint64_t>(COPY_SIZE)));
+	uint64_t const offset = block * block_size();
+
+	for (uint64_t done = 0; done != len;)
+	{
+		size_t const count = std::min(len - done, static_cast<uint64_t>(COPY_SIZE));
+		pread_all(fd, buffer.data(), count, offset + done);
+		write_range(inode, (offset + done) / block_size(), buffer.data(), count);
+		done += count;
+	}
+}
+
+void Formatter::set_length(Inode &inode, uint64_t length)
+{
+	if (!(inode.mode() & S_IFREG) || (inode.flags() & AUFS_INODE_INLINE))
+		throw std::logic_error("it is not file with extents");
+	if (length > static_cast<uint64_t>(inode.blocks()) * block_size())
+		throw std::out_of_range("there is no enough space");
+	inode.set_length(length);
+}
+
 void Formatter::add_child(Inode &inode, char const *name, Inode const &child)
 {
-	uint32_t const in_block = block_size() / sizeof(struct dir_entry);
+	if (!(inode.mode() & S_IFDIR))
+		throw std::logic_error("it is not directory");
+
+	if (dir_records())
+	{
+		size_t const len = strlen(name);
+		if (!len || len > AUFS_NAME_MAXLEN)
+			throw std::invalid_argument(std::string("bad file name: ") + name);
+
+		uint64_t const at = dir_record_offset(dir_tail(inode), len, block_size());
+		uint64_t const end = at + AUFS_DIR_RECORD_SIZE(len);
+		if (end > static_cast<uint64_t>(inode.blocks()) * block_size())
+			throw std::out_of_range("there is no enough space");
+
+		BlockCache::BlockPtr bp = cache_->block(inode.block() + at / block_size());
+		struct aufs_dir_record *const rec =
+			reinterpret_cast<struct aufs_dir_record *>(bp->data() + at % block_size());
+		std::memset(rec, 0, AUFS_DIR_RECORD_SIZE(len));
+		rec->name_len = len;
+		rec->type = (child.mode() & S_IFMT) >> 12;
+		rec->inode_no = child.inode();
+		std::memcpy(rec + 1, name, len);
+
+		dir_tails_[inode.inode()] = end;
+		inode.set_length(inode.length() + 1);
+		return;
+	}
+
+	uint32_t const in_block = block_size() / sizeof(struct aufs_dir_entry);
 	uint32_t const entries = inode.blocks() * in_block;
 	uint32_t const least = entries - inode.length();
 	uint32_t const block = inode.block() + inode.length() / in_block;
 	uint32_t const offset = (inode.length() % in_block);
 
-	if (!(inode.mode() & S_IFDIR))
-		throw std::logic_error("it is not directory");
-
 	if (!least)
 		throw std::out_of_range("there is no enough space");
 
 	BlockCache::BlockPtr bp = cache_->block(block);
-	struct dir_entry *const dp = reinterpret_cast<struct dir_entry *>(bp->data()) + offset;
-	strncpy(dp->name, name, FS_FILENAME_MAXLEN - 1);
-	dp->name[FS_FILENAME_MAXLEN - 1] = '\0';
-	dp->inode = htonl(child.inode());
+	struct aufs_dir_entry *const dp = reinterpret_cast<struct aufs_dir_entry *>(bp->data()) + offset;
+	strncpy(dp->name, name, AUFS_FILENAME_MAXLEN - 1);
+	dp->name[AUFS_FILENAME_MAXLEN - 1] = '\0';
+	dp->inode_no = child.inode();
 	inode.set_length(inode.length() + 1);
 }
 
 void Formatter::format()
 {
-	uint32_t const in_block = block_size() / sizeof(struct inode);
-	uint32_t const busy_blocks = 3 + inodes_count() / in_block;
-
-	set_bits(0, busy_blocks, block_page_->data());
-	clear_bits(busy_blocks, blocks_count(), block_page_->data());
-	set_bits(blocks_count(), block_size() << 3, block_page_->data());
-
-	set_bits(0, 1, inode_page_->data());
-	clear_bits(1, inodes_count(), inode_page_->data());
-	set_bits(inodes_count(), block_size() << 3, inode_page_->data());
-
-	struct super_block * const sbp = reinterpret_cast<struct super_block *>(super_page_->data());
-	sbp->magic = htonl(magic());
-	sbp->block_size = htonl(block_size());
-	sbp->root_inode = htonl(root_inode());
+	uint32_t const in_block = block_size() / sizeof(struct aufs_dinode);
+	uint32_t const busy_blocks = inode_table_ + (inodes_count() + in_block - 1) / in_block;
+
+	if (busy_blocks > blocks_count())
+		throw std::runtime_error("inode table does not fit the image");
+
+	blocks_map_.set(0, busy_blocks);
+	blocks_map_.clear(busy_blocks, blocks_count());
+	blocks_map_.set(blocks_count(), blocks_map_.size());
+
+	inodes_map_.set(0, 1);
+	inodes_map_.clear(1, inodes_count());
+	inodes_map_.set(inodes_count(), inodes_map_.size());
+
+	struct aufs_dsuper_block * const sbp = reinterpret_cast<struct aufs_dsuper_block *>(super_page_->data());
+	sbp->magic = magic();
+	sbp->block_size = block_size();
+	sbp->root_ino = root_inode();
+	sbp->features = AUFS_FEATURE_LARGE | AUFS_FEATURE_DIRENTS;
+	sbp->cluster_bits = 0;
+	sbp->blocks_count = blocks_count();
+	sbp->inodes_count = inodes_count();
+	sbp->inode_bitmap = inode_bitmap_;
+	sbp->inode_table = inode_table_;
 }
@@ -2,14 +2,22 @@
 #define __FORMAT_HPP__
 
 #include <cstdint>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "bitmap.hpp"
 #include "cache.hpp"
 #include "inode.hpp"
 
 class Formatter
 {
 public:
+	struct Open { };
+
 	Formatter(BlockCache &cache);
+	Formatter(BlockCache &cache, Open);
 	Formatter(BlockCache &cache, size_t blocks_count);
 	Formatter(BlockCache &cache, size_t blocks_count, size_t inodes_count);
 
@@ -17,34 +25,96 @@ public:
 	uint32_t block_size() const;
 	uint32_t blocks_count() const;
 	uint32_t inodes_count() const;
+	uint32_t inode_table() const;
 
 	uint32_t root_inode() const;
 	void set_root_inode(uint32_t inode);
 
-	Inode mkdir(uint32_t entries);
-	Inode mkfile(uint32_t length);
+	uint32_t inline_max() const;
+	void set_inline_max(uint32_t bytes);
+
+	uint32_t cluster_size() const;
+	void set_cluster_size(uint32_t bytes);
+
+	/* directories get blocks from the reserved run while it lasts */
+	void reserve_dir_blocks(uint32_t blocks);
+	void release_dir_blocks();
+
+	/* the directory is sized for exactly these names added in this order */
+	Inode mkdir(std::vector<std::string> const &names);
+	/* extended files have room for a link count from the start */
+	Inode mkfile(uint64_t length, bool extended = false);
+	Inode mkcompressed(uint64_t length, std::vector<uint8_t> const &extent, uint32_t flags,
+			bool extended = false);
+	Inode mkshared(Inode const &origin, bool extended = false);
+	/*
+	 * File of the length with blocks only for the data ranges (first
+	 * file block and count, in order), the rest is left as holes. When
+	 * the extent list can not hold them all the shortest holes are
+	 * zeroed blocks instead.
+	 */
+	Inode mksparse(uint64_t length, std::vector<Extent> const &ranges, bool extended = false);
+	/* moves the inode to slots with room for the extension if needed */
+	Inode extend(Inode const &inode);
+	void set_links(Inode &inode, uint32_t links);
+	/* permission bits, owner and ctime, the file type stays */
+	void copy_attributes(Inode &inode, Inode const &origin);
 	void free(Inode const &inode);
+	void free_blocks(uint32_t block, uint32_t count);
+	/* cuts the image right after the last busy block, returns the new size */
+	uint32_t shrink();
+
+	Inode inode(uint32_t ino);
+	std::vector<Extent> extents(Inode const &inode);
+	uint32_t map(Inode const &inode, uint32_t block);
+	std::vector<std::pair<std::string, uint32_t>> children(Inode const &inode);
+	/* file contents as stored, compressed files give the whole extent */
+	std::vector<uint8_t> read(Inode const &inode);
 
-	uint32_t write(Inode &inode, uint8_t const *data, uint32_t len);
+	size_t write(Inode &inode, uint8_t const *data, size_t len);
+	/*
+	 * Appends file data straight to the device, the cache keeps metadata
+	 * only. All but the last append have to be whole blocks.
+	 */
+	void write_extents(Inode &inode, uint8_t const *data, size_t len);
+	void write_extents(Inode &inode, int fd, uint64_t len);
+	/* fills blocks from the file block on, they must not be holes */
+	void write_range(Inode &inode, uint64_t block, uint8_t const *data, size_t len);
+	/* the same from the file at the offset of the file block */
+	void write_range(Inode &inode, uint64_t block, int fd, uint64_t len);
+	/* for file data that does not go through the cache */
+	void set_length(Inode &inode, uint64_t length);
 	void add_child(Inode &inode, char const *name, Inode const &child);
 
 private:
-	static uint32_t const FS_MAGIC;
 
 	void format();
-	Inode alloc_inode();
+	void set_features(uint32_t features);
+	bool dir_records() const;
+	uint64_t dir_tail(Inode const &inode);
+	Inode alloc_inode(size_t slots = 1);
+	Inode alloc_file(uint64_t length, std::vector<Extent> const &extents, uint32_t flags);
 	uint32_t alloc_blocks(size_t count);
+	std::vector<Extent> alloc_extents(size_t count);
+	void set_extents(Inode &inode, std::vector<Extent> const &extents);
+	void write_blocks(Inode const &inode, uint64_t block, uint8_t const *data, size_t len);
 
 	BlockCache *cache_;
 
 	BlockCache::BlockPtr super_page_;
-	BlockCache::BlockPtr block_page_;
-	BlockCache::BlockPtr inode_page_;
+	Bitmap blocks_map_;
+	Bitmap inodes_map_;
 
 	uint32_t magic_;
 	uint32_t blocks_count_;
 	uint32_t inodes_count_;
-	uint32_t root_inode_;
+	uint32_t inode_bitmap_;
+	uint32_t inode_table_;
+	uint32_t inline_max_;
+	uint32_t dir_next_;
+	uint32_t dir_end_;
+	/* byte offset of the next record in directories being filled */
+	std::map<uint32_t, uint64_t> dir_tails_;
 };
 
 #endif /*__FORMAT_HPP__*/
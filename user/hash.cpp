@@ -0,0 +1,122 @@
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "hash.hpp"
+
+namespace {
+
+	uint64_t const PRIME1 = 11400714785074694791ull;
+	uint64_t const PRIME2 = 14029467366897019727ull;
+	uint64_t const PRIME3 = 1609587929392839161ull;
+	uint64_t const PRIME4 = 9650029242287828579ull;
+	uint64_t const PRIME5 = 2870177450012600261ull;
+
+	size_t const CHUNK_SIZE = 1u << 20;
+
+	uint64_t rotl(uint64_t x, int r)
+	{ return (x << r) | (x >> (64 - r)); }
+
+	uint64_t read64(uint8_t const *p)
+	{
+		uint64_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	uint32_t read32(uint8_t const *p)
+	{
+		uint32_t v;
+		std::memcpy(&v, p, sizeof(v));
+		return v;
+	}
+
+	uint64_t round(uint64_t acc, uint64_t input)
+	{ return rotl(acc + input * PRIME2, 31) * PRIME1; }
+
+	uint64_t merge(uint64_t acc, uint64_t val)
+	{ return (acc ^ round(0, val)) * PRIME1 + PRIME4; }
+
+}
+
+uint64_t xxh64(void const *data, size_t len, uint64_t seed)
+{
+	uint8_t const *p = static_cast<uint8_t const *>(data);
+	uint8_t const *const end = p + len;
+	uint64_t h;
+
+	if (len >= 32)
+	{
+		uint64_t v1 = seed + PRIME1 + PRIME2;
+		uint64_t v2 = seed + PRIME2;
+		uint64_t v3 = seed;
+		uint64_t v4 = seed - PRIME1;
+
+		for (; p + 32 <= end; p += 32)
+		{
+			v1 = round(v1, read64(p));
+			v2 = round(v2, read64(p + 8));
+			v3 = round(v3, read64(p + 16));
+			v4 = round(v4, read64(p + 24));
+		}
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(h, v1);
+		h = merge(h, v2);
+		h = merge(h, v3);
+		h = merge(h, v4);
+	}
+	else
+		h = seed + PRIME5;
+
+	h += len;
+
+	for (; p + 8 <= end; p += 8)
+		h = rotl(h ^ round(0, read64(p)), 27) * PRIME1 + PRIME4;
+
+	if (p + 4 <= end)
+	{
+		h = rotl(h ^ (read32(p) * PRIME1), 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+
+	for (; p < end; ++p)
+		h = rotl(h ^ (*p * PRIME5), 11) * PRIME1;
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t content_hash(uint8_t const *data, size_t len, size_t threads)
+{
+	if (len <= CHUNK_SIZE)
+		return xxh64(data, len);
+
+	size_t const chunks = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	size_t const workers_count = std::min(std::max(threads, static_cast<size_t>(1)), chunks);
+	std::vector<uint64_t> hashes(chunks);
+
+	auto worker = [&](size_t first)
+	{
+		for (size_t it = first; it < chunks; it += workers_count)
+		{
+			size_t const offset = it * CHUNK_SIZE;
+			hashes[it] = xxh64(data + offset, std::min(CHUNK_SIZE, len - offset));
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t it = 1; it < workers_count; ++it)
+		workers.emplace_back(worker, it);
+	worker(0);
+	std::for_each(std::begin(workers), std::end(workers),
+			[](std::thread &t) { t.join(); });
+
+	return xxh64(hashes.data(), hashes.size() * sizeof(uint64_t), len);
+}
@@ -0,0 +1,15 @@
+#ifndef __HASH_HPP__
+#define __HASH_HPP__
+
+#include <cstdint>
+#include <cstddef>
+
+uint64_t xxh64(void const *data, size_t len, uint64_t seed = 0);
+
+/*
+ * Hashes big buffers as a list of chunk hashes, so that chunks can be
+ * hashed on several threads.
+ */
+uint64_t content_hash(uint8_t const *data, size_t len, size_t threads);
+
+#endif /*__HASH_HPP__*/
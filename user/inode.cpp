@@ -1,79 +1,87 @@
+#include <stdexcept>
 #include <ctime>
 
-#include <arpa/inet.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "inode.hpp"
 
-namespace {
-
-	uint64_t htonll(uint64_t n)
-	{
-		uint64_t test = 1ull;
-		if (*(char *)&test == 1ull)
-			return (static_cast<uint64_t>(htonl(n & 0xffffffff)) << 32u) |
-				static_cast<uint64_t>(htonl(n >> 32u));
-		else
-			return n;
-	}
-
-	uint64_t ntohll(uint64_t n)
-	{ return htonll(n); }
-
-}
-
 uint32_t Inode::inode() const
 { return inode_; }
 
 uint32_t Inode::block() const
-{ return ntohl(data()->block); }
+{ return data()->block; }
 
 void Inode::set_block(uint32_t block)
-{ data()->block = htonl(block); }
+{ data()->block = block; }
 
 uint32_t Inode::blocks() const
-{ return ntohl(data()->blocks); }
+{ return data()->blocks; }
 
 void Inode::set_blocks(uint32_t blocks)
-{ data()->blocks = htonl(blocks); }
+{ data()->blocks = blocks; }
 
-uint32_t Inode::length() const
-{ return ntohl(data()->length); }
+uint64_t Inode::length() const
+{
+	uint64_t const hi = flags() & AUFS_INODE_EXTENDED ? static_cast<uint32_t>(ext()->length_hi) : 0;
+	return (hi << 32) | data()->length;
+}
 
-void Inode::set_length(uint32_t length)
-{ data()->length = htonl(length); }
+void Inode::set_length(uint64_t length)
+{
+	if (flags() & AUFS_INODE_EXTENDED)
+		ext()->length_hi = length >> 32;
+	else if (length >> 32)
+		throw std::logic_error("length does not fit the inode");
+	data()->length = length & 0xFFFFFFFFu;
+}
 
 uint64_t Inode::ctime() const
-{ return htonll(data()->ctime); }
+{ return data()->ctime; }
 
 void Inode::set_ctime(uint64_t t)
-{ data()->ctime = htonll(t); }
+{ data()->ctime = t; }
 
 uint32_t Inode::uid() const
-{ return ntohl(data()->uid); }
+{ return data()->uid; }
 
 void Inode::set_uid(uint32_t id)
-{ data()->uid = htonl(id); }
+{ data()->uid = id; }
 
 uint32_t Inode::gid() const
-{ return ntohl(data()->gid); }
+{ return data()->gid; }
 
 void Inode::set_gid(uint32_t id)
-{ data()->gid = htonl(id); }
+{ data()->gid = id; }
 
 uint32_t Inode::mode() const
-{ return ntohl(data()->mode); }
+{ return data()->mode & ~AUFS_INODE_FLAGS_MASK; }
 
 void Inode::set_mode(uint32_t mode)
-{ data()->mode = htonl(mode); }
+{ data()->mode = flags() | (mode & ~AUFS_INODE_FLAGS_MASK); }
 
-Inode::Inode(BlockCache &cache, uint32_t ino)
+uint32_t Inode::flags() const
+{ return data()->mode & AUFS_INODE_FLAGS_MASK; }
+
+void Inode::set_flags(uint32_t flags)
+{ data()->mode = mode() | (flags & AUFS_INODE_FLAGS_MASK); }
+
+uint32_t Inode::links() const
+{
+	if (!(flags() & AUFS_INODE_EXTENDED) || !ext()->nlink)
+		return 1;
+	return ext()->nlink;
+}
+
+void Inode::set_links(uint32_t links)
+{ ext()->nlink = links; }
+
+Inode::Inode(BlockCache &cache, uint32_t table, uint32_t ino, bool reset)
 	: inode_(ino)
-	, block_(ino ? cache.block(3 + ino / (cache.block_size() / sizeof(struct inode))) : nullptr)
-	, index_(ino % (cache.block_size() / sizeof(struct inode)))
+	, block_(ino ? cache.block(table + ino / (cache.block_size() / sizeof(struct aufs_dinode))) : nullptr)
+	, index_(ino % (cache.block_size() / sizeof(struct aufs_dinode)))
 {
-	if (*this)
+	if (*this && reset)
 	{
 		set_block(0);
 		set_blocks(0);
@@ -81,7 +89,7 @@ Inode::Inode(BlockCache &cache, uint32_t ino)
 		set_ctime(time(NULL));
 		set_uid(getuid());
 		set_gid(getgid());
-		set_mode(493);
+		data()->mode = 493;
 	}
 }
 
@@ -91,11 +99,23 @@ Inode::Inode()
 	, index_(0)
 { }
 
-struct inode *Inode::data()
-{ return reinterpret_cast<struct inode *>(block_->data()) + index_; }
+struct aufs_dinode *Inode::data()
+{ return reinterpret_cast<struct aufs_dinode *>(block_->data()) + index_; }
+
+struct aufs_dinode const *Inode::data() const
+{ return reinterpret_cast<struct aufs_dinode *>(block_->data()) + index_; }
+
+struct aufs_dinode_ext *Inode::ext()
+{ return reinterpret_cast<struct aufs_dinode_ext *>(data() + 1); }
+
+struct aufs_dinode_ext const *Inode::ext() const
+{ return reinterpret_cast<struct aufs_dinode_ext const *>(data() + 1); }
+
+uint8_t *Inode::inline_data()
+{ return reinterpret_cast<uint8_t *>(data() + (flags() & AUFS_INODE_EXTENDED ? 2 : 1)); }
 
-struct inode const *Inode::data() const
-{ return reinterpret_cast<struct inode *>(block_->data()) + index_; }
+uint8_t const *Inode::inline_data() const
+{ return reinterpret_cast<uint8_t const *>(data() + (flags() & AUFS_INODE_EXTENDED ? 2 : 1)); }
 
 Inode::operator bool() const
 { return inode_; }
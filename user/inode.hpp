@@ -4,24 +4,12 @@
 #include <cstdint>
 
 #include "cache.hpp"
+#include "disk.hpp"
 
-static uint32_t const FS_FILENAME_MAXLEN = 28;
-
-struct inode
+struct Extent
 {
 	uint32_t block;
 	uint32_t blocks;
-	uint32_t length;
-	uint32_t uid;
-	uint32_t gid;
-	uint32_t mode;
-	uint64_t ctime;
-};
-
-struct dir_entry
-{
-	char name[FS_FILENAME_MAXLEN];
-	uint32_t inode;
 };
 
 class Inode
@@ -32,28 +20,37 @@ public:
 	uint32_t inode() const;
 	uint32_t block() const;
 	uint32_t blocks() const;
-	uint32_t length() const;
+	uint64_t length() const;
 	uint64_t ctime() const;
 	uint32_t uid() const;
 	uint32_t gid() const;
 	uint32_t mode() const;
+	uint32_t flags() const;
+	uint32_t links() const;
 	explicit operator bool() const;
 
 	friend class Formatter;
+	friend class Reader;
 
 private:
-	Inode(BlockCache &cache, uint32_t ino);
+	Inode(BlockCache &cache, uint32_t table, uint32_t ino, bool reset = true);
 
-	void set_length(uint32_t);
+	void set_length(uint64_t);
 	void set_block(uint32_t);
 	void set_blocks(uint32_t);
 	void set_ctime(uint64_t);
 	void set_uid(uint32_t);
 	void set_gid(uint32_t);
 	void set_mode(uint32_t);
-
-	struct inode *data();
-	struct inode const *data() const;
+	void set_flags(uint32_t);
+	void set_links(uint32_t);
+
+	struct aufs_dinode *data();
+	struct aufs_dinode const *data() const;
+	struct aufs_dinode_ext *ext();
+	struct aufs_dinode_ext const *ext() const;
+	uint8_t *inline_data();
+	uint8_t const *inline_data() const;
 
 	uint32_t inode_;
 	BlockCache::BlockPtr block_;
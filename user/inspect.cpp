@@ -0,0 +1,452 @@
+#include <algorithm>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "reader.hpp"
+
+namespace {
+
+	/* how close a directory keeps its children, distances are in blocks */
+	struct DirLocality
+	{
+		std::string path;
+		uint32_t inode;
+		uint32_t entries;
+		uint32_t blocks;
+		double inode_distance;	/* mean, to the child inode table blocks */
+		double data_distance;	/* mean, to the first data block of children */
+		double score;		/* mean over both, lower is better */
+		uint64_t span;		/* from the lowest to the highest of them */
+	};
+
+	struct FreeBucket
+	{
+		uint64_t runs;
+		uint64_t blocks;
+	};
+
+	struct ImageReport
+	{
+		uint32_t block_size;
+		uint32_t blocks_count;
+		uint32_t features;
+		uint64_t used_blocks;
+
+		uint64_t free_runs;
+		uint64_t largest_free_run;
+		std::vector<FreeBucket> free_histogram;	/* by run length, [2^n, 2^(n+1)) */
+
+		uint32_t inode_slots;
+		uint32_t table_blocks;
+		uint32_t busy_table_blocks;
+		uint64_t busy_slots;
+		uint64_t inodes;
+		uint64_t extension_slots;
+		uint64_t inline_slots;
+
+		uint64_t files;
+		uint64_t inline_files;
+		uint64_t compressed_files;
+		uint64_t fragmented_files;
+		uint64_t sparse_files;
+		uint64_t file_waste;
+		uint64_t dir_waste;
+
+		std::vector<DirLocality> dirs;
+	};
+
+	char const *const feature_names[] = { "inline", "compress", "large", "dirents", "sparse" };
+	size_t const features_known = sizeof(feature_names) / sizeof(feature_names[0]);
+
+	/* data extents only, holes take no blocks */
+	std::vector<Extent> data_extents(std::vector<Extent> const &extents)
+	{
+		std::vector<Extent> data;
+		std::copy_if(extents.begin(), extents.end(), std::back_inserter(data),
+				[](Extent const &extent) { return extent.block != 0; });
+		return data;
+	}
+
+	void scan_free(Reader &reader, ImageReport &report)
+	{
+		Bitmap const blocks = reader.blocks_map();
+		uint32_t const count = std::min(static_cast<size_t>(reader.blocks_count()), blocks.size());
+
+		report.used_blocks = 0;
+		for (uint32_t block = 0; block != count; ++block)
+			report.used_blocks += blocks.test(block);
+
+		for (std::pair<size_t, size_t> const &run : blocks.clear_runs())
+		{
+			size_t const len = std::min(run.first + run.second, static_cast<size_t>(count)) - std::min(run.first, static_cast<size_t>(count));
+			if (!len)
+				continue;
+
+			size_t bucket = 0;
+			while ((static_cast<uint64_t>(2) << bucket) <= len)
+				++bucket;
+			if (report.free_histogram.size() <= bucket)
+				report.free_histogram.resize(bucket + 1);
+			++report.free_histogram[bucket].runs;
+			report.free_histogram[bucket].blocks += len;
+
+			++report.free_runs;
+			report.largest_free_run = std::max(report.largest_free_run, static_cast<uint64_t>(len));
+		}
+	}
+
+	void scan_table(Reader &reader, ImageReport &report)
+	{
+		Bitmap const slots = reader.inodes_map();
+		uint32_t const in_block = reader.block_size() / sizeof(struct aufs_dinode);
+
+		report.inode_slots = reader.inodes_count();
+		report.table_blocks = (reader.inodes_count() + in_block - 1) / in_block;
+
+		/* slot 0 is never handed out */
+		for (uint32_t block = 0; block != report.table_blocks; ++block)
+		{
+			uint32_t busy = 0;
+			for (uint32_t ino = std::max(block * in_block, 1u);
+					ino != std::min((block + 1) * in_block, reader.inodes_count()); ++ino)
+				busy += slots.test(ino);
+			report.busy_slots += busy;
+			report.busy_table_blocks += busy != 0;
+		}
+	}
+
+	uint64_t distance(uint64_t from, uint64_t to)
+	{ return from > to ? from - to : to - from; }
+
+	/* breadth first, so the report lists directories as a reader would find them */
+	void scan_tree(Reader &reader, ImageReport &report)
+	{
+		bool const records = reader.features() & AUFS_FEATURE_DIRENTS;
+		std::deque<std::pair<std::string, uint32_t>> queue;
+		std::set<uint32_t> seen;
+		std::set<uint32_t> extents_seen;
+
+		queue.emplace_back(std::string(), reader.root_inode());
+		seen.insert(reader.root_inode());
+
+		while (!queue.empty())
+		{
+			std::string const path = queue.front().first;
+			Inode const dir = reader.inode(queue.front().second);
+			queue.pop_front();
+
+			DirEntries const children = reader.children(dir);
+			DirLocality locality = DirLocality();
+			uint64_t inode_sum = 0, data_sum = 0, data_count = 0;
+			uint64_t low = dir.block(), high = dir.block() + (dir.blocks() ? dir.blocks() - 1 : 0);
+			uint64_t used = 0;
+
+			++report.inodes;
+			report.extension_slots += (dir.flags() & AUFS_INODE_EXTENDED) != 0;
+
+			for (std::pair<std::string, uint32_t> const &child : children)
+			{
+				Inode const node = reader.inode(child.second);
+				uint32_t const table = reader.inode_block(child.second);
+				std::vector<Extent> const all = reader.extents(node);
+				std::vector<Extent> const extents = data_extents(all);
+
+				used += records ? AUFS_DIR_RECORD_SIZE(child.first.size()) : sizeof(struct aufs_dir_entry);
+				inode_sum += distance(dir.block(), table);
+				low = std::min<uint64_t>(low, table);
+				high = std::max<uint64_t>(high, table);
+				if (!extents.empty())
+				{
+					data_sum += distance(dir.block(), extents.front().block);
+					++data_count;
+					low = std::min<uint64_t>(low, extents.front().block);
+					high = std::max<uint64_t>(high, extents.back().block + extents.back().blocks - 1);
+				}
+
+				if (!seen.insert(child.second).second)
+					continue;
+
+				if (S_ISDIR(node.mode()))
+				{
+					queue.emplace_back(path.empty() ? child.first : path + "/" + child.first, child.second);
+					continue;
+				}
+
+				++report.inodes;
+				report.extension_slots += (node.flags() & AUFS_INODE_EXTENDED) != 0;
+				if (!S_ISREG(node.mode()))
+					continue;
+
+				++report.files;
+				if (node.flags() & AUFS_INODE_INLINE)
+				{
+					++report.inline_files;
+					report.inline_slots += node.block();
+					continue;
+				}
+				report.compressed_files += (node.flags() & AUFS_INODE_COMPRESSED) != 0;
+				report.fragmented_files += extents.size() > 1;
+				report.sparse_files += all.size() != extents.size();
+
+				/* deduplicated files share their extents, count them once */
+				if (extents.empty() || !extents_seen.insert(extents.front().block).second)
+					continue;
+				/* a hole at the end takes the partial block with it */
+				if (all.back().block)
+					report.file_waste += static_cast<uint64_t>(node.blocks()) * reader.block_size() -
+							reader.stored_length(node);
+			}
+
+			if (dir.blocks())
+				report.dir_waste += static_cast<uint64_t>(dir.blocks()) * reader.block_size() - used;
+
+			locality.path = path.empty() ? "/" : path;
+			locality.inode = dir.inode();
+			locality.entries = children.size();
+			locality.blocks = dir.blocks();
+			if (!children.empty() && dir.blocks())
+			{
+				locality.inode_distance = static_cast<double>(inode_sum) / children.size();
+				locality.data_distance = data_count ? static_cast<double>(data_sum) / data_count : 0.0;
+				locality.score = static_cast<double>(inode_sum + data_sum) / (children.size() + data_count);
+				locality.span = high - low + 1;
+			}
+			report.dirs.push_back(locality);
+		}
+	}
+
+	ImageReport inspect(Reader &reader)
+	{
+		ImageReport report = ImageReport();
+
+		report.block_size = reader.block_size();
+		report.blocks_count = reader.blocks_count();
+		report.features = reader.features();
+
+		scan_free(reader, report);
+		scan_table(reader, report);
+		scan_tree(reader, report);
+
+		return report;
+	}
+
+	std::string json_string(std::string const &value)
+	{
+		std::string out("\"");
+
+		for (char const c : value)
+		{
+			if (c == '"' || c == '\\')
+				out += std::string("\\") + c;
+			else if (static_cast<unsigned char>(c) < 0x20)
+			{
+				char escape[8];
+				snprintf(escape, sizeof(escape), "\\u%04x", c);
+				out += escape;
+			}
+			else
+				out += c;
+		}
+
+		return out + "\"";
+	}
+
+	void print_summary(std::ostream &out, ImageReport const &report)
+	{
+		out << "block size: " << report.block_size << std::endl;
+		out << "blocks: " << report.used_blocks << " used, "
+			<< report.blocks_count - report.used_blocks << " free of " << report.blocks_count << std::endl;
+		out << "features:";
+		for (size_t bit = 0; bit != features_known; ++bit)
+		{
+			if (report.features & (1u << bit))
+				out << " " << feature_names[bit];
+		}
+		out << std::endl;
+
+		out << "free space: " << report.free_runs << " runs, largest " << report.largest_free_run
+			<< " blocks" << std::endl;
+		for (size_t bucket = 0; bucket != report.free_histogram.size(); ++bucket)
+		{
+			if (report.free_histogram[bucket].runs)
+				out << "  " << (1ull << bucket) << "-" << (2ull << bucket) - 1 << " blocks: "
+					<< report.free_histogram[bucket].runs << " runs, "
+					<< report.free_histogram[bucket].blocks << " blocks" << std::endl;
+		}
+
+		uint64_t const live = report.inodes + report.extension_slots + report.inline_slots;
+		out << "inode table: " << report.busy_slots << " of " << report.inode_slots << " slots busy in "
+			<< report.busy_table_blocks << " of " << report.table_blocks << " blocks" << std::endl;
+		out << "  " << report.inodes << " inodes, " << report.extension_slots << " extension slots, "
+			<< report.inline_slots << " inline data slots, "
+			<< (report.busy_slots > live ? report.busy_slots - live : 0) << " unreachable" << std::endl;
+
+		out << "files: " << report.files << ", " << report.inline_files << " inline, "
+			<< report.compressed_files << " compressed, " << report.fragmented_files << " fragmented, "
+			<< report.sparse_files << " sparse" << std::endl;
+		out << "wasted in partial blocks: " << report.file_waste << " bytes in files, "
+			<< report.dir_waste << " bytes in directories" << std::endl;
+
+		std::vector<DirLocality> worst(report.dirs);
+		std::sort(worst.begin(), worst.end(), [](DirLocality const &a, DirLocality const &b)
+				{ return a.score > b.score; });
+		worst.resize(std::min(worst.size(), static_cast<size_t>(10)));
+
+		out << "directory locality, mean distance in blocks, worst first:" << std::endl;
+		for (DirLocality const &dir : worst)
+		{
+			char line[96];
+			snprintf(line, sizeof(line), "  %10.1f %10.1f %10.1f %10llu %8u  ",
+					dir.score, dir.inode_distance, dir.data_distance,
+					static_cast<unsigned long long>(dir.span), dir.entries);
+			out << line << dir.path << std::endl;
+		}
+		out << "  (score, to inodes, to data, span, entries, path)" << std::endl;
+	}
+
+	void print_json(std::ostream &out, ImageReport const &report)
+	{
+		out << "{" << std::endl;
+		out << "  \"block_size\": " << report.block_size << "," << std::endl;
+		out << "  \"blocks_count\": " << report.blocks_count << "," << std::endl;
+		out << "  \"used_blocks\": " << report.used_blocks << "," << std::endl;
+		out << "  \"features\": [";
+		char const *sep = "";
+		for (size_t bit = 0; bit != features_known; ++bit)
+		{
+			if (report.features & (1u << bit))
+			{
+				out << sep << "\"" << feature_names[bit] << "\"";
+				sep = ", ";
+			}
+		}
+		out << "]," << std::endl;
+
+		out << "  \"free_space\": {" << std::endl;
+		out << "    \"runs\": " << report.free_runs << "," << std::endl;
+		out << "    \"largest_run\": " << report.largest_free_run << "," << std::endl;
+		out << "    \"histogram\": [";
+		sep = "";
+		for (size_t bucket = 0; bucket != report.free_histogram.size(); ++bucket)
+		{
+			if (!report.free_histogram[bucket].runs)
+				continue;
+			out << sep << std::endl << "      { \"min\": " << (1ull << bucket)
+				<< ", \"max\": " << (2ull << bucket) - 1
+				<< ", \"runs\": " << report.free_histogram[bucket].runs
+				<< ", \"blocks\": " << report.free_histogram[bucket].blocks << " }";
+			sep = ",";
+		}
+		out << std::endl << "    ]" << std::endl << "  }," << std::endl;
+
+		out << "  \"inode_table\": {" << std::endl;
+		out << "    \"slots\": " << report.inode_slots << "," << std::endl;
+		out << "    \"busy_slots\": " << report.busy_slots << "," << std::endl;
+		out << "    \"blocks\": " << report.table_blocks << "," << std::endl;
+		out << "    \"busy_blocks\": " << report.busy_table_blocks << "," << std::endl;
+		out << "    \"inodes\": " << report.inodes << "," << std::endl;
+		out << "    \"extension_slots\": " << report.extension_slots << "," << std::endl;
+		out << "    \"inline_slots\": " << report.inline_slots << std::endl;
+		out << "  }," << std::endl;
+
+		out << "  \"files\": {" << std::endl;
+		out << "    \"count\": " << report.files << "," << std::endl;
+		out << "    \"inline\": " << report.inline_files << "," << std::endl;
+		out << "    \"compressed\": " << report.compressed_files << "," << std::endl;
+		out << "    \"fragmented\": " << report.fragmented_files << "," << std::endl;
+		out << "    \"sparse\": " << report.sparse_files << std::endl;
+		out << "  }," << std::endl;
+
+		out << "  \"wasted_bytes\": { \"files\": " << report.file_waste
+			<< ", \"directories\": " << report.dir_waste << " }," << std::endl;
+
+		out << "  \"directories\": [";
+		sep = "";
+		for (DirLocality const &dir : report.dirs)
+		{
+			out << sep << std::endl << "    { \"path\": " << json_string(dir.path)
+				<< ", \"inode\": " << dir.inode
+				<< ", \"entries\": " << dir.entries
+				<< ", \"blocks\": " << dir.blocks
+				<< ", \"score\": " << dir.score
+				<< ", \"inode_distance\": " << dir.inode_distance
+				<< ", \"data_distance\": " << dir.data_distance
+				<< ", \"span\": " << dir.span << " }";
+			sep = ",";
+		}
+		out << std::endl << "  ]" << std::endl << "}" << std::endl;
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+	static struct option const options[] = {
+		{ "json", required_argument, nullptr, 'j' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	std::string json_file;
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "j:", options, nullptr)) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			json_file = optarg;
+			break;
+		default:
+			std::cout << "usage: " << argv[0] << " [--json=FILE|-] image" << std::endl;
+			return 1;
+		}
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 2)
+	{
+		std::cout << "image file name expected" << std::endl;
+		return 1;
+	}
+
+	/* with the JSON on stdout the summary goes aside */
+	std::ostream &summary = json_file == "-" ? std::cerr : std::cout;
+
+	try
+	{
+		FileDevice device(argv[1], Reader::probe_block_size(argv[1]), false);
+		BlockCache cache(device);
+		Reader reader(cache);
+		ImageReport const report = inspect(reader);
+		cache.drop();
+
+		print_summary(summary, report);
+		if (json_file == "-")
+			print_json(std::cout, report);
+		else if (!json_file.empty())
+		{
+			std::ofstream json(json_file);
+			print_json(json, report);
+			if (!json)
+				throw std::runtime_error("cannot write " + json_file);
+		}
+	}
+	catch (std::exception const &ex)
+	{
+		summary << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "io.hpp"
+
+namespace {
+
+	std::runtime_error failure(char const *what, ssize_t ret)
+	{
+		return ret ? std::runtime_error(std::string(what) + ": " + strerror(errno)) :
+				std::runtime_error(std::string(what) + ": unexpected end of file");
+	}
+
+}
+
+void read_all(int fd, void *data, size_t len)
+{
+	uint8_t *to = static_cast<uint8_t *>(data);
+	while (len)
+	{
+		ssize_t const ret = ::read(fd, to, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw failure("read error", ret);
+		to += ret;
+		len -= ret;
+	}
+}
+
+void write_all(int fd, void const *data, size_t len)
+{
+	uint8_t const *from = static_cast<uint8_t const *>(data);
+	while (len)
+	{
+		ssize_t const ret = ::write(fd, from, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw failure("write error", ret);
+		from += ret;
+		len -= ret;
+	}
+}
+
+void pread_all(int fd, void *data, size_t len, uint64_t offset)
+{
+	uint8_t *to = static_cast<uint8_t *>(data);
+	while (len)
+	{
+		ssize_t const ret = pread(fd, to, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw failure("read error", ret);
+		to += ret;
+		len -= ret;
+		offset += ret;
+	}
+}
+
+void pwrite_all(int fd, void const *data, size_t len, uint64_t offset)
+{
+	uint8_t const *from = static_cast<uint8_t const *>(data);
+	while (len)
+	{
+		ssize_t const ret = pwrite(fd, from, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			throw failure("write error", ret);
+		from += ret;
+		len -= ret;
+		offset += ret;
+	}
+}
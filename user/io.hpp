@@ -0,0 +1,19 @@
+#ifndef __IO_HPP__
+#define __IO_HPP__
+
+#include <cstdint>
+#include <cstddef>
+
+/* large copies go this much at a time, a multiple of any block size so every chunk but the last is whole */
+size_t const COPY_SIZE = 1 << 20;
+
+/*
+ * Whole buffer reads and writes on file descriptors, retried on EINTR
+ * and short counts. Errors and a read past the end of the file throw.
+ */
+void read_all(int fd, void *data, size_t len);
+void write_all(int fd, void const *data, size_t len);
+void pread_all(int fd, void *data, size_t len, uint64_t offset);
+void pwrite_all(int fd, void const *data, size_t len, uint64_t offset);
+
+#endif /*__IO_HPP__*/
@@ -0,0 +1,208 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "inode.hpp"
+#include "layout.hpp"
+
+namespace {
+
+	uint64_t div_up(uint64_t value, uint64_t by)
+	{ return (value + by - 1) / by; }
+
+	uint32_t const FS_MIN_BLOCK_SIZE = 1024;
+
+}
+
+void TreeStats::scan(std::string const &path)
+{
+	std::unique_ptr<DIR, int(*)(DIR *)> dirp(opendir(path.c_str()), &closedir);
+	struct dirent *entryp = nullptr;
+	std::vector<uint8_t> names;
+
+	if (!dirp.get())
+		throw std::runtime_error("cannot open dir");
+
+	while ((entryp = readdir(dirp.get())))
+	{
+		struct stat buffer;
+		std::string const name = path + "/" + entryp->d_name;
+
+		if (!strcmp(entryp->d_name, ".") || !strcmp(entryp->d_name, ".."))
+			continue;
+
+		names.push_back(strlen(entryp->d_name));
+		if (stat(name.c_str(), &buffer))
+			continue;
+
+		if (S_ISDIR(buffer.st_mode))
+			scan(name);
+		else if (buffer.st_nlink < 2 ||
+				linked.insert(std::make_pair(buffer.st_dev, buffer.st_ino)).second)
+			files.push_back(buffer.st_size);
+	}
+
+	dirs.push_back(names);
+}
+
+uint64_t TreeStats::bytes() const
+{
+	uint64_t bytes = 0;
+	for (uint64_t const size : files)
+		bytes += size;
+	return bytes;
+}
+
+uint64_t Layout::image_bytes() const
+{ return static_cast<uint64_t>(blocks_count) * block_size; }
+
+double Layout::efficiency() const
+{ return image_bytes() ? static_cast<double>(data_bytes) / image_bytes() : 0.0; }
+
+double Layout::amplification() const
+{ return data_bytes ? static_cast<double>(read_bytes) / data_bytes : 0.0; }
+
+Layout plan_layout(TreeStats const &tree, uint32_t block_size, uint32_t inline_max)
+{
+	uint32_t const in_block = block_size / sizeof(struct aufs_dinode);
+	uint32_t const inline_limit = std::min(inline_max,
+			static_cast<uint32_t>((in_block - 1) * sizeof(struct aufs_dinode)));
+	uint64_t const bits = static_cast<uint64_t>(block_size) << 3;
+
+	Layout layout;
+	/* linked files keep the count in an extension slot */
+	uint64_t slots = 1 + tree.dirs.size() + tree.linked.size();
+	uint64_t data_blocks = 0;
+	uint64_t dir_blocks = 0;
+	uint64_t read_blocks = 0;
+
+	layout.block_size = block_size;
+	layout.data_bytes = 0;
+
+	for (uint64_t const size : tree.files)
+	{
+		uint64_t const blocks = div_up(size, block_size);
+
+		layout.data_bytes += size;
+		/* every file costs an inode table block read on top of its data */
+		if (size && size <= inline_limit)
+		{
+			slots += 1 + div_up(size, sizeof(struct aufs_dinode));
+			read_blocks += 1;
+			continue;
+		}
+
+		slots += 1 + (size >> 32 ? 1 : 0);
+		data_blocks += blocks;
+		read_blocks += 1 + blocks;
+	}
+
+	for (std::vector<uint8_t> const &names : tree.dirs)
+	{
+		uint64_t bytes = 0;
+		for (uint8_t const len : names)
+		{
+			bytes = dir_record_offset(bytes, len, block_size) + AUFS_DIR_RECORD_SIZE(len);
+			layout.data_bytes += AUFS_DIR_RECORD_SIZE(len);
+		}
+
+		uint64_t const blocks = div_up(bytes, block_size);
+		dir_blocks += blocks;
+		read_blocks += 1 + blocks;
+	}
+
+	/* inline files need their slots in one table block, leave some room */
+	uint64_t const table_blocks = div_up(slots + slots / 16, in_block);
+	uint64_t const inode_bitmap = div_up(table_blocks * in_block, bits);
+	uint64_t const used = 1 + inode_bitmap + table_blocks + dir_blocks + data_blocks;
+	uint64_t block_bitmap = 1;
+
+	while (div_up(used + block_bitmap, bits) > block_bitmap)
+		++block_bitmap;
+
+	if (used + block_bitmap > UINT32_MAX || table_blocks * in_block > UINT32_MAX)
+		throw std::out_of_range("tree does not fit block size");
+
+	layout.blocks_count = used + block_bitmap;
+	layout.inodes_count = table_blocks * in_block;
+	layout.dir_blocks = dir_blocks;
+	layout.read_bytes = read_blocks * block_size;
+
+	return layout;
+}
+
+Layout tune_layout(TreeStats const &tree, uint32_t inline_max)
+{
+	uint32_t const page_size = sysconf(_SC_PAGESIZE);
+	Layout best;
+	bool found = false;
+
+	for (uint32_t block_size = FS_MIN_BLOCK_SIZE; block_size <= page_size; block_size <<= 1)
+	{
+		Layout layout;
+		try
+		{
+			layout = plan_layout(tree, block_size, inline_max);
+		}
+		catch (std::out_of_range const &)
+		{
+			continue;
+		}
+
+		/* on a tie bigger blocks win as they take less requests to read */
+		if (!found || layout.image_bytes() + layout.read_bytes <=
+				best.image_bytes() + best.read_bytes)
+			best = layout;
+		found = true;
+	}
+
+	if (!found)
+		throw std::out_of_range("tree does not fit any block size");
+	return best;
+}
+
+std::ostream &operator<<(std::ostream &out, TreeStats const &tree)
+{
+	std::vector<uint64_t> histogram;
+	uint32_t entries = 0;
+
+	for (uint64_t const size : tree.files)
+	{
+		size_t bucket = 0;
+		while ((static_cast<uint64_t>(1) << bucket) < size)
+			++bucket;
+		if (histogram.size() <= bucket)
+			histogram.resize(bucket + 1);
+		++histogram[bucket];
+	}
+
+	for (std::vector<uint8_t> const &names : tree.dirs)
+		entries = std::max(entries, static_cast<uint32_t>(names.size()));
+
+	out << "files: " << tree.files.size() << ", " << tree.bytes() << " bytes" << std::endl;
+	out << "dirs: " << tree.dirs.size() << ", largest has " << entries << " entries" << std::endl;
+	for (size_t bucket = 0; bucket != histogram.size(); ++bucket)
+	{
+		if (histogram[bucket])
+			out << "  <= " << (static_cast<uint64_t>(1) << bucket) << " bytes: "
+				<< histogram[bucket] << std::endl;
+	}
+	return out;
+}
+
+std::ostream &operator<<(std::ostream &out, Layout const &layout)
+{
+	out << "block size: " << layout.block_size << std::endl;
+	out << "blocks: " << layout.blocks_count << " (" << layout.image_bytes() << " bytes)" << std::endl;
+	out << "inodes: " << layout.inodes_count << std::endl;
+	out << "directory blocks: " << layout.dir_blocks << std::endl;
+	out << "space efficiency: " << layout.efficiency() * 100.0 << "%" << std::endl;
+	out << "read amplification: " << layout.amplification() << std::endl;
+	return out;
+}
@@ -0,0 +1,53 @@
+#ifndef __LAYOUT_HPP__
+#define __LAYOUT_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <ostream>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/types.h>
+
+/* what mkfs is going to put into the image */
+struct TreeStats
+{
+	std::vector<uint64_t> files;	/* file sizes */
+	std::vector<std::vector<uint8_t>> dirs;	/* name lengths per directory */
+	/* files with several links are imported once */
+	std::set<std::pair<dev_t, ino_t>> linked;
+
+	void scan(std::string const &path);
+	uint64_t bytes() const;
+};
+
+/* image parameters along with the predicted outcome */
+struct Layout
+{
+	uint32_t block_size;
+	uint32_t blocks_count;
+	uint32_t inodes_count;
+	uint32_t dir_blocks;
+
+	uint64_t data_bytes;	/* file contents and directory entries */
+	uint64_t read_bytes;	/* device bytes read to read every file once */
+
+	uint64_t image_bytes() const;
+	double efficiency() const;
+	double amplification() const;
+};
+
+Layout plan_layout(TreeStats const &tree, uint32_t block_size, uint32_t inline_max);
+
+/*
+ * Tries every block size from 1K up to the page size and picks the one
+ * that needs the least bytes to store the tree and read it back.
+ */
+Layout tune_layout(TreeStats const &tree, uint32_t inline_max);
+
+std::ostream &operator<<(std::ostream &out, TreeStats const &tree);
+std::ostream &operator<<(std::ostream &out, Layout const &layout);
+
+#endif /*__LAYOUT_HPP__*/
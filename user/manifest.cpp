@@ -0,0 +1,64 @@
+#include <stdexcept>
+#include <fstream>
+#include <sstream>
+
+#include "manifest.hpp"
+
+void Manifest::load(std::string const &file)
+{
+	std::ifstream in(file.c_str());
+	if (!in)
+		throw std::runtime_error("cannot open manifest");
+
+	std::string line;
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string path;
+		char kind;
+		Entry entry;
+
+		fields >> kind >> entry.inode >> entry.size >> entry.mtime
+			>> std::hex >> entry.hash;
+		if (!fields || fields.get() != ' ')
+			throw std::runtime_error("malformed manifest line: " + line);
+		std::getline(fields, path);
+
+		entry.dir = (kind == 'd');
+		entries_[path] = entry;
+	}
+}
+
+void Manifest::save(std::string const &file) const
+{
+	std::ofstream out(file.c_str());
+	if (!out)
+		throw std::runtime_error("cannot create manifest");
+
+	for (EntriesMap::value_type const &p : entries_)
+	{
+		Entry const &entry = p.second;
+		out << (entry.dir ? 'd' : 'f') << ' ' << entry.inode << ' '
+			<< entry.size << ' ' << entry.mtime << ' '
+			<< std::hex << entry.hash << std::dec << ' ' << p.first << '\n';
+	}
+
+	if (!out)
+		throw std::runtime_error("cannot write manifest");
+}
+
+Manifest::Entry const *Manifest::find(std::string const &path) const
+{
+	EntriesMap::const_iterator const it = entries_.find(path);
+	return it == entries_.end() ? nullptr : &it->second;
+}
+
+void Manifest::add(std::string const &path, Entry const &entry)
+{
+	if (path.find('\n') != std::string::npos)
+		throw std::invalid_argument("new line in path is not supported");
+	entries_[path] = entry;
+}
+
+Manifest::EntriesMap const &Manifest::entries() const
+{ return entries_; }
@@ -0,0 +1,38 @@
+#ifndef __MANIFEST_HPP__
+#define __MANIFEST_HPP__
+
+#include <cstdint>
+#include <string>
+#include <map>
+
+/*
+ * Manifest maps source paths (relative to the source root, the root itself
+ * is an empty path) to the inodes they were imported as, along with what
+ * is needed to tell whether the source has changed since.
+ */
+class Manifest
+{
+public:
+	struct Entry
+	{
+		bool dir;
+		uint32_t inode;
+		uint64_t size;
+		int64_t mtime;
+		uint64_t hash;
+	};
+
+	typedef std::map<std::string, Entry> EntriesMap;
+
+	void load(std::string const &file);
+	void save(std::string const &file) const;
+
+	Entry const *find(std::string const &path) const;
+	void add(std::string const &path, Entry const &entry);
+	EntriesMap const &entries() const;
+
+private:
+	EntriesMap entries_;
+};
+
+#endif /*__MANIFEST_HPP__*/
@@ -1,106 +1,333 @@
 #include <iostream>
-#include <iterator>
-#include <fstream>
-#include <cstring>
+#include <memory>
 #include <string>
-#include <vector>
+#include <thread>
 
+#include <fcntl.h>
+#include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <unistd.h>
 
-#include "format.hpp"
+#include "builder.hpp"
+#include "layout.hpp"
+#include "options.hpp"
+#include "overlay.hpp"
 
-Inode copy_file(Formatter &format, std::string const &path)
-{
-	std::vector<char> data;
+namespace {
 
+	/* bytes, or with a K, M or G suffix for powers of 1024 */
+	uint64_t parse_size(char const *value)
 	{
-		std::ifstream file(path.c_str(), std::ios::binary);
-		if (!file)
-			throw std::runtime_error("cannot open file");
-		std::istream_iterator<char> begin(file), end;
-		std::copy(begin, end, std::back_inserter(data));
+		std::string const text(value);
+		size_t end = 0;
+		uint64_t const size = std::stoull(text, &end);
+		std::string const suffix = text.substr(end);
+		unsigned const shift = suffix.empty() ? 0 : suffix == "K" ? 10 :
+				suffix == "M" ? 20 : suffix == "G" ? 30 : 64;
+
+		if (shift == 64 || text[0] == '-' || size > (UINT64_MAX >> shift))
+			throw std::invalid_argument("bad size " + text);
+		return size << shift;
 	}
 
-	Inode file_inode = format.mkfile(data.size());
+	uint32_t parse_block_size(char const *value)
+	{
+		unsigned long const size = std::stoul(value);
+		unsigned long const page_size = sysconf(_SC_PAGESIZE);
+
+		if (size < 1024 || size > page_size || (size & (size - 1)))
+			throw std::invalid_argument("block size must be a power of two from 1024 to the page size");
+		return size;
+	}
 
-	size_t written = 0;
-	while (written != data.size())
+	/* the kernel decompresses whole clusters into pages */
+	size_t parse_cluster_size(char const *value)
 	{
-		written += format.write(file_inode,
-				reinterpret_cast<uint8_t const *>(data.data()) + written,
-				data.size() - written);
+		unsigned long const size = std::stoul(value);
+		unsigned long const page_size = sysconf(_SC_PAGESIZE);
+
+		if (size < page_size || size > (1ul << AUFS_MAX_CLUSTER_BITS) || (size & (size - 1)))
+			throw std::invalid_argument("cluster size must be a power of two from the page size to 1 MiB");
+		return size;
 	}
 
-	return file_inode;
 }
 
-Inode copy_dir(Formatter &format, std::string const &path)
+int main(int argc, char **argv)
 {
-	std::vector<std::string> entries;
+	static struct option const options[] = {
+		{ "inline-max", required_argument, nullptr, 'i' },
+		{ "compress", required_argument, nullptr, 'c' },
+		{ "cluster-size", required_argument, nullptr, 'C' },
+		{ "threads", required_argument, nullptr, 't' },
+		{ "dedup", no_argument, nullptr, 'd' },
+		{ "manifest", required_argument, nullptr, 'm' },
+		{ "update", no_argument, nullptr, 'u' },
+		{ "block-size", required_argument, nullptr, 'b' },
+		{ "auto", no_argument, nullptr, 'a' },
+		{ "tar", required_argument, nullptr, 'T' },
+		{ "size", required_argument, nullptr, 's' },
+		{ "base", required_argument, nullptr, 'B' },
+		{ "commit", required_argument, nullptr, 'o' },
+		{ nullptr, 0, nullptr, 0 }
+	};
 
-	{
-		struct dirent entry, *entryp = &entry;
-		std::unique_ptr<DIR, int(*)(DIR *)> dirp(opendir(path.c_str()), &closedir);
-		if (!dirp.get())
-			throw std::runtime_error("cannot open dir");
+	uint32_t inline_max = 0;
+	Compressor::Algorithm algo = Compressor::NONE;
+	size_t cluster_size = 65536;
+	size_t threads = std::thread::hardware_concurrency();
+	bool dedup = false;
+	std::string manifest_file;
+	bool update = false;
+	uint32_t block_size = 0;
+	bool tune = false;
+	std::string tar_file;
+	uint64_t image_size = 0;
+	std::string base_image;
+	std::string commit_image;
 
-		while (entryp)
+	int opt;
+	try
+	{
+		while ((opt = getopt_long(argc, argv, "i:c:C:t:dm:ub:aT:s:B:o:", options, nullptr)) != -1)
 		{
-			readdir_r(dirp.get(), &entry, &entryp);
-			if ( entryp && strcmp(entry.d_name, ".") &&
-					strcmp(entry.d_name, "..") )
-				entries.push_back(std::string(entry.d_name));
+			switch (opt)
+			{
+			case 'i':
+				inline_max = parse_number(optarg, "inline max", 0, UINT32_MAX);
+				break;
+			case 'c':
+				algo = Compressor::parse(optarg);
+				break;
+			case 'C':
+				cluster_size = parse_cluster_size(optarg);
+				break;
+			case 't':
+				threads = parse_threads(optarg);
+				break;
+			case 'd':
+				dedup = true;
+				break;
+			case 'm':
+				manifest_file = optarg;
+				break;
+			case 'u':
+				update = true;
+				break;
+			case 'b':
+				block_size = parse_block_size(optarg);
+				break;
+			case 'a':
+				tune = true;
+				break;
+			case 'T':
+				tar_file = optarg;
+				break;
+			case 's':
+				image_size = parse_size(optarg);
+				break;
+			case 'B':
+				base_image = optarg;
+				break;
+			case 'o':
+				commit_image = optarg;
+				break;
+			default:
+				std::cout << "usage: " << argv[0]
+					<< " [--inline-max=BYTES] [--compress=none|lz4|zstd]"
+					<< " [--cluster-size=BYTES] [--threads=N] [--dedup]"
+					<< " [--manifest=FILE [--update]] [--block-size=BYTES] [--auto]"
+					<< " [--size=BYTES[K|M|G]] image|- [dir]" << std::endl
+					<< "       " << argv[0] << " [options] --tar=FILE|- image|-" << std::endl
+					<< "       " << argv[0] << " --base=IMAGE [--manifest=FILE --update dir]"
+					<< " [--commit=IMAGE] delta" << std::endl;
+				return 1;
+			}
 		}
 	}
-
-	Inode dir_inode = format.mkdir(entries.size());
-
-	for (std::string const &entry : entries)
+	catch (std::exception const &ex)
 	{
-		struct stat buffer;
-		if (!stat((path + "/" + entry).c_str(), &buffer))
-		{
-			if (buffer.st_mode & S_IFDIR)
-				format.add_child(dir_inode, entry.c_str(),
-						copy_dir(format, path + "/" + entry));
-			else
-				format.add_child(dir_inode, entry.c_str(),
-						copy_file(format, path + "/" + entry));
-		}
+		std::cout << ex.what() << std::endl;
+		return 1;
 	}
 
-	return dir_inode;
-}
+	argc -= optind - 1;
+	argv += optind - 1;
 
-int main(int argc, char **argv)
-{
 	if (argc < 2)
 	{
 		std::cout << "image file name expected" << std::endl;
 		return 1;
 	}
 
+	/* with the image on stdout anything else goes to stderr */
+	bool const stream = std::string(argv[1]) == "-";
+	std::ostream &report = stream ? std::cerr : std::cout;
+
 	if (argc > 3)
 	{
-		std::cout << "too many arguments" << std::endl;
+		report << "too many arguments" << std::endl;
+		return 1;
+	}
+
+	if (update && (argc != 3 || manifest_file.empty()))
+	{
+		report << "update needs a source dir and a manifest" << std::endl;
+		return 1;
+	}
+
+	if (stream && (update || (!tune && !image_size)))
+	{
+		report << "streaming a new image needs --auto or --size" << std::endl;
+		return 1;
+	}
+
+	/* sizing an existing image would cut it before it is read */
+	if (image_size && (update || !base_image.empty()))
+	{
+		report << "size is for new images only" << std::endl;
+		return 1;
+	}
+
+	if (!tar_file.empty() && (update || tune || argc != 2))
+	{
+		report << "tar import makes a new image and takes no source dir" << std::endl;
+		return 1;
+	}
+
+	if (tune && (update || argc != 3))
+	{
+		report << "auto layout needs a source dir and a new image" << std::endl;
+		return 1;
+	}
+
+	if (!commit_image.empty() && base_image.empty())
+	{
+		report << "commit needs a base image" << std::endl;
+		return 1;
+	}
+
+	/* an overlay only ever changes the image it sits on */
+	if (!base_image.empty() && (stream || (!update && (argc != 2 || commit_image.empty()))))
+	{
+		report << "a delta takes an update, a commit or both" << std::endl;
 		return 1;
 	}
 
 	try
 	{
-		BlockCache cache(argv[1], 4096);
-		Formatter format(cache);
+		Layout layout;
+		if (tune)
+		{
+			TreeStats tree;
+			tree.scan(argv[2]);
+			layout = block_size ? plan_layout(tree, block_size, inline_max)
+					: tune_layout(tree, inline_max);
+			block_size = layout.block_size;
+
+			report << tree << layout;
+			if (algo != Compressor::NONE || dedup)
+				report << "compression and dedup are not modeled, "
+					<< "the image may end up bigger than needed" << std::endl;
+			image_size = layout.image_bytes();
+		}
+		if (!block_size)
+			block_size = 4096;
+
+		if (!base_image.empty() && !update)
+		{
+			OverlayDevice(base_image, argv[1], block_size).commit(commit_image);
+			return 0;
+		}
+
+		/* a stream is planned in memory and written out at the very end */
+		std::unique_ptr<ImagePlan> plan;
+		std::unique_ptr<OverlayDevice> overlay;
+		std::unique_ptr<BlockCache> cache;
+		if (stream)
+		{
+			plan.reset(new ImagePlan(block_size, image_size / block_size));
+			cache.reset(new BlockCache(*plan));
+		}
+		else if (!base_image.empty())
+		{
+			overlay.reset(new OverlayDevice(base_image, argv[1], block_size));
+			cache.reset(new BlockCache(*overlay));
+		}
+		else
+		{
+			if (image_size)
+				size_image(argv[1], image_size);
+			cache.reset(new BlockCache(argv[1], block_size));
+		}
+
+		std::unique_ptr<Formatter> format(update ?
+				new Formatter(*cache, Formatter::Open()) : tune ?
+				new Formatter(*cache, layout.blocks_count, layout.inodes_count) :
+				new Formatter(*cache));
+
+		Compressor const compressor(algo, cluster_size, threads);
+
+		format->set_inline_max(inline_max);
+		if (algo != Compressor::NONE)
+			format->set_cluster_size(cluster_size);
+
+		if (tune)
+			format->reserve_dir_blocks(layout.dir_blocks);
+
+		Manifest manifest;
+		Builder builder(*format, compressor);
+		builder.set_dedup(dedup, threads);
+		if (!manifest_file.empty())
+			builder.set_manifest(&manifest);
+		builder.set_plan(plan.get());
+
+		if (update)
+		{
+			Manifest old;
+			old.load(manifest_file);
+			format->set_root_inode(builder.update(argv[2], old).inode());
+		}
+		else if (!tar_file.empty())
+		{
+			int const fd = tar_file == "-" ? 0 : open(tar_file.c_str(), O_RDONLY);
+			if (fd < 0)
+				throw std::runtime_error("cannot open archive");
 
-		if (argc == 3)
-			format.set_root_inode(copy_dir(format, argv[2]).inode());
+			InputStream input(fd);
+			TarReader tar(input);
+			format->set_root_inode(builder.copy_tar(tar).inode());
+			if (fd)
+				close(fd);
+		}
+		else if (argc == 3)
+			format->set_root_inode(builder.copy_dir(argv[2]).inode());
 		else
-			format.set_root_inode(format.mkdir(1).inode());
+			format->set_root_inode(format->mkdir(std::vector<std::string>()).inode());
+		format->release_dir_blocks();
+
+		if (!manifest_file.empty())
+			manifest.save(manifest_file);
+
+		if (plan)
+		{
+			cache->flush();
+			plan->emit(1);
+		}
+
+		if (overlay)
+		{
+			cache->flush();
+			overlay->save();
+			report << "delta: " << overlay->changed() << " blocks changed" << std::endl;
+			if (!commit_image.empty())
+				overlay->commit(commit_image);
+		}
 	}
 	catch (std::exception const &ex)
 	{
-		std::cout << ex.what() << std::endl;
+		report << ex.what() << std::endl;
 		return 1;
 	}
 
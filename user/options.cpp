@@ -0,0 +1,31 @@
+#include <stdexcept>
+#include <cctype>
+#include <string>
+
+#include "options.hpp"
+
+uint64_t parse_number(char const *value, char const *what, uint64_t min, uint64_t max)
+{
+	std::string const text(value);
+	size_t end = 0;
+	uint64_t number = 0;
+
+	/* stoull skips blanks and takes a minus sign, wrapping it around */
+	try
+	{
+		if (!text.empty() && isdigit(static_cast<unsigned char>(text[0])))
+			number = std::stoull(text, &end);
+	}
+	catch (std::out_of_range const &)
+	{
+		end = 0;
+	}
+
+	if (!end || end != text.size() || number < min || number > max)
+		throw std::invalid_argument(std::string(what) + " must be a number from " +
+				std::to_string(min) + " to " + std::to_string(max));
+	return number;
+}
+
+size_t parse_threads(char const *value)
+{ return parse_number(value, "threads", 1, MAX_THREADS); }
@@ -0,0 +1,15 @@
+#ifndef __OPTIONS_HPP__
+#define __OPTIONS_HPP__
+
+#include <cstdint>
+#include <cstddef>
+
+/* more than that is a typo rather than a machine */
+size_t const MAX_THREADS = 1024;
+
+/* a plain decimal number from min to max, anything else throws naming what */
+uint64_t parse_number(char const *value, char const *what, uint64_t min, uint64_t max);
+
+size_t parse_threads(char const *value);
+
+#endif /*__OPTIONS_HPP__*/
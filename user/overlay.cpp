@@ -0,0 +1,229 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "endian.hpp"
+#include "io.hpp"
+#include "overlay.hpp"
+
+namespace {
+
+	char const DELTA_MAGIC[8] = { 'A', 'U', 'F', 'S', 'C', 'O', 'W', '1' };
+
+	struct DeltaHeader
+	{
+		char magic[8];
+		be32 block_size;
+		be32 reserved;
+		be64 base_blocks;
+		be64 blocks;	/* delta blocks past the header, the index has an entry for each */
+		be64 index;	/* first block of the index, 0 for right after the blocks */
+	};
+
+	/* index entry of delta blocks that held an older index */
+	uint64_t const NO_BLOCK = UINT64_MAX;
+
+}
+
+OverlayDevice::OverlayDevice(std::string const &base, std::string const &delta, size_t block_size)
+	: base_path_(base)
+	, base_(base, block_size, false)
+	, fd_(open(delta.c_str(), O_RDWR | O_CREAT, 0644))
+	, next_(1)
+	, dirty_(false)
+{
+	if (fd_ < 0)
+		throw std::runtime_error("delta open error");
+
+	struct stat buffer;
+	if (fstat(fd_, &buffer))
+	{
+		close(fd_);
+		throw std::runtime_error("delta open error");
+	}
+
+	/* a new delta changes nothing yet */
+	if (!buffer.st_size)
+	{
+		dirty_ = true;
+		return;
+	}
+
+	try
+	{
+		DeltaHeader header;
+		pread_all(fd_, &header, sizeof(header), 0);
+		if (memcmp(header.magic, DELTA_MAGIC, sizeof(DELTA_MAGIC)))
+			throw std::runtime_error("not an image delta");
+		if (header.block_size != block_size || header.base_blocks != base_.blocks_count())
+			throw std::runtime_error("delta does not match the base image");
+
+		std::vector<be64> index(header.blocks);
+		uint64_t const at = header.index ? static_cast<uint64_t>(header.index) : 1 + index.size();
+		if (at < 1 + index.size())
+			throw std::runtime_error("delta index is corrupted");
+		pread_all(fd_, index.data(), index.size() * sizeof(be64),
+				at * block_size);
+		for (size_t it = 0; it != index.size(); ++it)
+		{
+			if (index[it] == NO_BLOCK)
+				continue;
+			if (index[it] >= base_.blocks_count() || !remap_.emplace(index[it], 1 + it).second)
+				throw std::runtime_error("delta index is corrupted");
+		}
+
+		/* new blocks go past the saved index */
+		next_ = at + (index.size() * sizeof(be64) + block_size - 1) / block_size;
+	}
+	catch (...)
+	{
+		close(fd_);
+		throw;
+	}
+}
+
+OverlayDevice::~OverlayDevice()
+{
+	try { save(); } catch (...) { }
+	close(fd_);
+}
+
+size_t OverlayDevice::block_size() const
+{ return base_.block_size(); }
+
+size_t OverlayDevice::blocks_count() const
+{ return base_.blocks_count(); }
+
+void OverlayDevice::read(size_t no, uint8_t *data)
+{ read_blocks(no, data, 1); }
+
+void OverlayDevice::write(size_t no, uint8_t const *data)
+{ write_blocks(no, data, 1); }
+
+void OverlayDevice::read_blocks(size_t no, uint8_t *data, size_t count)
+{
+	size_t const bs = block_size();
+
+	/* runs of untouched blocks come from the base, runs of changed ones from the delta */
+	for (size_t it = 0; it != count;)
+	{
+		std::map<size_t, size_t>::const_iterator const next = remap_.lower_bound(no + it);
+		if (next == remap_.end() || next->first != no + it)
+		{
+			size_t const run = std::min(count, next == remap_.end() ? count : next->first - no) - it;
+			base_.read_blocks(no + it, data + it * bs, run);
+			it += run;
+			continue;
+		}
+
+		size_t run = 1;
+		for (std::map<size_t, size_t>::const_iterator cur = std::next(next);
+				it + run != count && cur != remap_.end() && cur->first == no + it + run &&
+				cur->second == next->second + run; ++cur)
+			++run;
+		pread_all(fd_, data + it * bs, run * bs, static_cast<uint64_t>(next->second) * bs);
+		it += run;
+	}
+}
+
+void OverlayDevice::write_blocks(size_t no, uint8_t const *data, size_t count)
+{
+	size_t const bs = block_size();
+
+	for (size_t it = 0; it != count;)
+	{
+		size_t const at = locate(no + it);
+		size_t run = 1;
+		while (it + run != count && locate(no + it + run) == at + run)
+			++run;
+		pwrite_all(fd_, data + it * bs, run * bs, static_cast<uint64_t>(at) * bs);
+		it += run;
+	}
+	dirty_ = true;
+}
+
+size_t OverlayDevice::changed() const
+{ return remap_.size(); }
+
+void OverlayDevice::save()
+{
+	if (!dirty_)
+		return;
+
+	size_t const bs = block_size();
+	std::vector<be64> index(next_ - 1, NO_BLOCK);
+	for (std::map<size_t, size_t>::value_type const &entry : remap_)
+		index[entry.second - 1] = entry.first;
+
+	/* the previous index stays intact until the header moves on */
+	uint64_t const at = next_;
+	pwrite_all(fd_, index.data(), index.size() * sizeof(be64), at * bs);
+	if (ftruncate(fd_, at * bs + index.size() * sizeof(be64)))
+		throw std::runtime_error("delta write error");
+	next_ += (index.size() * sizeof(be64) + bs - 1) / bs;
+
+	/* the header goes last, it is what makes the new index count */
+	std::vector<uint8_t> block(bs, 0);
+	DeltaHeader header;
+	std::copy_n(DELTA_MAGIC, sizeof(DELTA_MAGIC), header.magic);
+	header.block_size = bs;
+	header.reserved = 0;
+	header.base_blocks = blocks_count();
+	header.blocks = index.size();
+	header.index = at;
+	std::copy_n(reinterpret_cast<uint8_t const *>(&header), sizeof(header), block.data());
+	if (fdatasync(fd_))
+		throw std::runtime_error("delta write error");
+	pwrite_all(fd_, block.data(), block.size(), 0);
+	if (fdatasync(fd_))
+		throw std::runtime_error("delta write error");
+	dirty_ = false;
+}
+
+void OverlayDevice::commit(std::string const &img)
+{
+	struct stat from;
+	struct stat to;
+	if (!stat(base_path_.c_str(), &from) && !stat(img.c_str(), &to) &&
+			from.st_dev == to.st_dev && from.st_ino == to.st_ino)
+		throw std::invalid_argument("cannot commit over the base image");
+
+	int const fd = open(img.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("image open error");
+
+	try
+	{
+		size_t const chunk = std::max<size_t>(1, COPY_SIZE / block_size());
+		std::vector<uint8_t> buffer(chunk * block_size());
+		for (size_t no = 0; no < blocks_count(); no += chunk)
+		{
+			size_t const count = std::min(chunk, blocks_count() - no);
+			read_blocks(no, buffer.data(), count);
+			pwrite_all(fd, buffer.data(), count * block_size(), static_cast<uint64_t>(no) * block_size());
+		}
+	}
+	catch (...)
+	{
+		close(fd);
+		throw;
+	}
+
+	if (close(fd))
+		throw std::runtime_error("image write error");
+}
+
+size_t OverlayDevice::locate(size_t no)
+{
+	if (no >= blocks_count())
+		throw std::out_of_range("block is past the end of the base image");
+	std::pair<std::map<size_t, size_t>::iterator, bool> const slot = remap_.emplace(no, next_);
+	next_ += slot.second;
+	return slot.first->second;
+}
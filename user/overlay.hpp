@@ -0,0 +1,55 @@
+#ifndef __OVERLAY_HPP__
+#define __OVERLAY_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <map>
+
+#include "device.hpp"
+
+/*
+ * Read only base image plus a delta file that holds only the blocks
+ * written since. The delta starts with a header block, changed blocks
+ * follow in the order they were first written and the index of their
+ * base block numbers comes last. Every save puts the index past all the
+ * blocks, so the one the header points at is never written over.
+ */
+class OverlayDevice : public Device
+{
+public:
+	/* the delta is created when it does not exist */
+	OverlayDevice(std::string const &base, std::string const &delta, size_t block_size);
+	~OverlayDevice();
+
+	OverlayDevice(OverlayDevice const &) = delete;
+	OverlayDevice &operator=(OverlayDevice const &) = delete;
+
+	size_t block_size() const override;
+	size_t blocks_count() const override;
+	void read(size_t no, uint8_t *data) override;
+	void write(size_t no, uint8_t const *data) override;
+	void read_blocks(size_t no, uint8_t *data, size_t count) override;
+	void write_blocks(size_t no, uint8_t const *data, size_t count) override;
+
+	/* blocks that differ from the base */
+	size_t changed() const;
+	/* the delta is usable only once the index is saved */
+	void save();
+	/* writes base and delta out as a standalone image */
+	void commit(std::string const &img);
+
+private:
+	size_t locate(size_t no);
+
+	std::string base_path_;
+	FileDevice base_;
+	int fd_;
+	/* base block to delta block */
+	std::map<size_t, size_t> remap_;
+	/* where the next changed block goes */
+	size_t next_;
+	bool dirty_;
+};
+
+#endif /*__OVERLAY_HPP__*/
@@ -0,0 +1,205 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "io.hpp"
+#include "plan.hpp"
+
+namespace {
+
+	size_t const WRITE_SIZE = 1 << 20;
+
+	/* gathers output into large writes */
+	class Output
+	{
+	public:
+		explicit Output(int fd)
+			: fd_(fd)
+			, seekable_(lseek(fd, 0, SEEK_CUR) >= 0)
+			, buffer_(WRITE_SIZE)
+			, used_(0)
+			, offset_(0)
+		{ }
+
+		uint8_t *reserve(size_t len)
+		{
+			if (buffer_.size() - used_ < len)
+				flush();
+			return buffer_.data() + used_;
+		}
+
+		void commit(size_t len)
+		{ used_ += len; }
+
+		size_t space() const
+		{ return buffer_.size() - used_; }
+
+		/* seekable outputs get a hole, pipes get zeros from one buffer */
+		void zeros(uint64_t len)
+		{
+			flush();
+			if (seekable_)
+			{
+				if (lseek(fd_, len, SEEK_CUR) < 0)
+					throw std::runtime_error("cannot seek image");
+				offset_ += len;
+				return;
+			}
+
+			std::vector<uint8_t> const zero(std::min(len, static_cast<uint64_t>(WRITE_SIZE)));
+			while (len)
+			{
+				size_t const count = std::min(len, static_cast<uint64_t>(zero.size()));
+				write_all(fd_, zero.data(), count);
+				offset_ += count;
+				len -= count;
+			}
+		}
+
+		void flush()
+		{
+			write_all(fd_, buffer_.data(), used_);
+			offset_ += used_;
+			used_ = 0;
+		}
+
+		/* a trailing hole is not part of the file until it is extended */
+		void finish()
+		{
+			flush();
+			if (seekable_)
+			{
+				struct stat st;
+				if (fstat(fd_, &st) == 0 && S_ISREG(st.st_mode) &&
+						static_cast<uint64_t>(st.st_size) < offset_ &&
+						ftruncate(fd_, offset_))
+					throw std::runtime_error("cannot extend image");
+			}
+		}
+
+	private:
+		int fd_;
+		bool seekable_;
+		std::vector<uint8_t> buffer_;
+		size_t used_;
+		uint64_t offset_;
+	};
+
+}
+
+ImagePlan::ImagePlan(size_t block_size, size_t blocks_count)
+	: block_size_(block_size)
+	, blocks_count_(blocks_count)
+{ }
+
+size_t ImagePlan::block_size() const
+{ return block_size_; }
+
+size_t ImagePlan::blocks_count() const
+{ return blocks_count_; }
+
+void ImagePlan::read(size_t no, uint8_t *data)
+{
+	std::map<size_t, std::vector<uint8_t>>::const_iterator const it = blocks_.find(no);
+	if (it == blocks_.end())
+		std::fill_n(data, block_size_, 0);
+	else
+		std::copy(std::begin(it->second), std::end(it->second), data);
+}
+
+void ImagePlan::write(size_t no, uint8_t const *data)
+{
+	std::vector<uint8_t> &block = blocks_[no];
+	block.assign(data, data + block_size_);
+}
+
+void ImagePlan::add_source(std::vector<Extent> const &extents, std::string const &path, uint64_t length)
+{
+	uint64_t offset = 0;
+
+	for (Extent const &extent : extents)
+	{
+		uint64_t const bytes = std::min(length - offset,
+				static_cast<uint64_t>(extent.blocks) * block_size_);
+		sources_[extent.block] = Source{ path, offset, bytes, extent.blocks };
+		offset += bytes;
+	}
+}
+
+void ImagePlan::emit(int fd) const
+{
+	std::map<size_t, std::vector<uint8_t>>::const_iterator block = blocks_.begin();
+	std::map<size_t, Source>::const_iterator source = sources_.begin();
+	Output out(fd);
+	size_t no = 0;
+
+	while (no < blocks_count_)
+	{
+		while (block != blocks_.end() && block->first < no)
+			++block;
+		while (source != sources_.end() && source->first < no)
+			++source;
+
+		if (block != blocks_.end() && block->first == no)
+		{
+			std::copy(std::begin(block->second), std::end(block->second), out.reserve(block_size_));
+			out.commit(block_size_);
+			++no;
+			continue;
+		}
+
+		if (source != sources_.end() && source->first == no)
+		{
+			Source const &src = source->second;
+			int const in = open(src.path.c_str(), O_RDONLY);
+			if (in < 0)
+				throw std::runtime_error("cannot open " + src.path);
+
+			uint64_t left = src.length;
+			uint64_t offset = src.offset;
+			while (left)
+			{
+				size_t const count = std::min(left, static_cast<uint64_t>(
+						std::max(out.space(), block_size_)));
+				try
+				{
+					pread_all(in, out.reserve(count), count, offset);
+				}
+				catch (std::exception const &)
+				{
+					close(in);
+					throw std::runtime_error("source changed or cannot be read: " + src.path);
+				}
+				out.commit(count);
+				offset += count;
+				left -= count;
+			}
+			close(in);
+
+			uint64_t const tail = static_cast<uint64_t>(src.blocks) * block_size_ - src.length;
+			if (tail)
+			{
+				std::fill_n(out.reserve(tail), tail, 0);
+				out.commit(tail);
+			}
+
+			no += src.blocks;
+			++source;
+			continue;
+		}
+
+		size_t next = blocks_count_;
+		if (block != blocks_.end())
+			next = std::min(next, block->first);
+		if (source != sources_.end())
+			next = std::min(next, source->first);
+		out.zeros(static_cast<uint64_t>(next - no) * block_size_);
+		no = next;
+	}
+
+	out.finish();
+}
@@ -0,0 +1,49 @@
+#ifndef __PLAN_HPP__
+#define __PLAN_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "device.hpp"
+#include "inode.hpp"
+
+/*
+ * Image kept in memory until it is emitted: blocks written through the
+ * cache are stored, file data may be left as a reference to the source
+ * file and everything else is zero.
+ */
+class ImagePlan : public Device
+{
+public:
+	ImagePlan(size_t block_size, size_t blocks_count);
+
+	size_t block_size() const override;
+	size_t blocks_count() const override;
+	void read(size_t no, uint8_t *data) override;
+	void write(size_t no, uint8_t const *data) override;
+
+	/* the file data lands in extents, in order, when the image is emitted */
+	void add_source(std::vector<Extent> const &extents, std::string const &path, uint64_t length);
+
+	/* writes the image strictly in block order, fd does not need to seek */
+	void emit(int fd) const;
+
+private:
+	struct Source
+	{
+		std::string path;
+		uint64_t offset;
+		uint64_t length;
+		uint32_t blocks;
+	};
+
+	size_t block_size_;
+	size_t blocks_count_;
+	std::map<size_t, std::vector<uint8_t>> blocks_;
+	std::map<size_t, Source> sources_;
+};
+
+#endif /*__PLAN_HPP__*/
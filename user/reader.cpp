@@ -0,0 +1,321 @@
+#include <algorithm>
+#include <stdexcept>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include <sys/stat.h>
+
+#include "reader.hpp"
+
+Reader::Reader(BlockCache &cache)
+	: cache_(&cache)
+	, blocks_count_(0)
+	, inodes_count_(0)
+	, inode_bitmap_(AUFS_LEGACY_INODE_BITMAP)
+	, inode_table_(AUFS_LEGACY_INODE_TABLE)
+	, features_(0)
+	, root_inode_(0)
+	, cluster_size_(0)
+{
+	uint32_t const known = AUFS_FEATURE_INLINE | AUFS_FEATURE_COMPRESS |
+			AUFS_FEATURE_LARGE | AUFS_FEATURE_DIRENTS | AUFS_FEATURE_SPARSE;
+	BlockCache::BlockPtr const super = cache_->block(0);
+	struct aufs_dsuper_block const *const sbp =
+			reinterpret_cast<struct aufs_dsuper_block const *>(super->data());
+
+	if (sbp->magic != AUFS_MAGIC_NUMBER)
+		throw std::runtime_error("wrong magic number");
+	if (sbp->block_size != block_size())
+		throw std::runtime_error("wrong block size");
+
+	features_ = sbp->features;
+	if (features_ & ~known)
+		throw std::runtime_error("image uses unknown features");
+
+	blocks_count_ = sbp->blocks_count;
+	inodes_count_ = sbp->inodes_count;
+	root_inode_ = sbp->root_ino;
+	if (features_ & AUFS_FEATURE_LARGE)
+	{
+		inode_bitmap_ = sbp->inode_bitmap;
+		inode_table_ = sbp->inode_table;
+	}
+	/* the first images did not record their layout */
+	if (!blocks_count_)
+		blocks_count_ = cache_->blocks_count();
+	if (!inodes_count_)
+		inodes_count_ = block_size() * 8;
+	if (features_ & AUFS_FEATURE_COMPRESS)
+		cluster_size_ = 1u << sbp->cluster_bits;
+}
+
+uint32_t Reader::probe_block_size(std::string const &img)
+{
+	FileDevice device(img, 1024, false);
+	uint8_t data[1024];
+
+	device.read(0, data);
+	uint32_t const size = reinterpret_cast<struct aufs_dsuper_block const *>(data)->block_size;
+	if (size < 1024 || (size & (size - 1)))
+		throw std::runtime_error("image records no sane block size");
+	return size;
+}
+
+uint32_t Reader::block_size() const
+{ return cache_->block_size(); }
+
+uint32_t Reader::blocks_count() const
+{ return blocks_count_; }
+
+uint32_t Reader::inodes_count() const
+{ return inodes_count_; }
+
+uint32_t Reader::inode_bitmap() const
+{ return inode_bitmap_; }
+
+uint32_t Reader::inode_table() const
+{ return inode_table_; }
+
+uint32_t Reader::features() const
+{ return features_; }
+
+uint32_t Reader::root_inode() const
+{ return root_inode_; }
+
+uint32_t Reader::cluster_size() const
+{ return cluster_size_; }
+
+Bitmap Reader::blocks_map()
+{ return Bitmap(*cache_, 1, inode_bitmap_ - 1); }
+
+Bitmap Reader::inodes_map()
+{ return Bitmap(*cache_, inode_bitmap_, inode_table_ - inode_bitmap_); }
+
+Inode Reader::inode(uint32_t ino)
+{
+	if (!ino || ino >= inodes_count())
+		throw std::out_of_range("inode number is out of the table");
+	return Inode(*cache_, inode_table_, ino, false);
+}
+
+uint32_t Reader::inode_block(uint32_t ino) const
+{ return inode_table_ + ino / (block_size() / sizeof(struct aufs_dinode)); }
+
+std::vector<Extent> Reader::extents(Inode const &inode)
+{
+	std::vector<Extent> extents;
+
+	if (inode.flags() & AUFS_INODE_INLINE)
+		return extents;
+
+	if (!(inode.flags() & AUFS_INODE_EXTENDED))
+	{
+		if (inode.blocks())
+			extents.push_back(Extent{ inode.block(), inode.blocks() });
+		return extents;
+	}
+
+	struct aufs_dinode_ext const *const ext = inode.ext();
+	uint32_t const count = ext->extents;
+	BlockCache::BlockPtr overflow;
+	struct aufs_dextent const *list = ext->extent;
+
+	if (count > AUFS_INLINE_EXTENTS)
+	{
+		if (count > block_size() / sizeof(struct aufs_dextent))
+			throw std::runtime_error("extent list does not fit the overflow block");
+		overflow = cache_->block(ext->overflow);
+		list = reinterpret_cast<struct aufs_dextent const *>(overflow->data());
+	}
+
+	for (uint32_t it = 0; it != count; ++it)
+		extents.push_back(Extent{ list[it].block, list[it].blocks });
+
+	return extents;
+}
+
+DirEntries Reader::children(Inode const &dir)
+{
+	bool const records = features_ & AUFS_FEATURE_DIRENTS;
+	DirEntries entries;
+
+	if (!S_ISDIR(dir.mode()))
+		throw std::logic_error("it is not directory");
+
+	for (uint32_t block = 0; block != dir.blocks() && entries.size() < dir.length(); ++block)
+	{
+		BlockCache::BlockPtr bp = cache_->block(dir.block() + block);
+		decode_dir_block(bp->data(), block_size(), records, dir.length() - entries.size(), entries);
+	}
+
+	return entries;
+}
+
+uint32_t Reader::lookup(Inode const &dir, std::string const &name)
+{
+	bool const records = features_ & AUFS_FEATURE_DIRENTS;
+	size_t seen = 0;
+
+	if (!S_ISDIR(dir.mode()))
+		throw std::logic_error("it is not directory");
+
+	for (uint32_t block = 0; block != dir.blocks() && seen < dir.length(); ++block)
+	{
+		BlockCache::BlockPtr bp = cache_->block(dir.block() + block);
+		DirEntries entries;
+
+		decode_dir_block(bp->data(), block_size(), records, dir.length() - seen, entries);
+		for (std::pair<std::string, uint32_t> const &entry : entries)
+		{
+			if (entry.first == name)
+				return entry.second;
+		}
+		seen += entries.size();
+	}
+
+	return 0;
+}
+
+Inode Reader::resolve(std::string const &path)
+{
+	Inode node = inode(root_inode());
+	size_t from = 0;
+
+	while (from < path.size())
+	{
+		size_t const to = std::min(path.find('/', from), path.size());
+		if (to != from && path.compare(from, to - from, ".") != 0)
+		{
+			uint32_t const ino = lookup(node, path.substr(from, to - from));
+			if (!ino)
+				throw std::out_of_range("no such file: " + path);
+			node = inode(ino);
+		}
+		from = to + 1;
+	}
+
+	return node;
+}
+
+uint64_t Reader::stored_length(Inode const &inode)
+{
+	if (inode.flags() & AUFS_INODE_INLINE || !S_ISREG(inode.mode()))
+		return 0;
+	if (!(inode.flags() & AUFS_INODE_COMPRESSED))
+		return inode.length();
+	if (!cluster_size())
+		throw std::runtime_error("compressed file on an image without clusters");
+
+	/* the last table entry is where the last cluster ends */
+	uint64_t const clusters = (inode.length() + cluster_size() - 1) / cluster_size();
+	be32 end;
+	read_stored(extents(inode), clusters * sizeof(be32), reinterpret_cast<uint8_t *>(&end), sizeof(end));
+	return static_cast<uint32_t>(end);
+}
+
+size_t Reader::read(Inode const &inode, uint64_t offset, uint8_t *data, size_t len)
+{
+	if (offset >= inode.length())
+		return 0;
+	len = std::min(static_cast<uint64_t>(len), inode.length() - offset);
+
+	if (inode.flags() & AUFS_INODE_INLINE)
+		std::copy_n(inode.inline_data() + offset, len, data);
+	else if (inode.flags() & AUFS_INODE_COMPRESSED)
+		return read_compressed(inode, offset, data, len);
+	else
+		read_stored(extents(inode), offset, data, len);
+
+	return len;
+}
+
+void Reader::read_stored(std::vector<Extent> const &extents, uint64_t offset, uint8_t *data, size_t len)
+{
+	uint64_t block = offset / block_size();
+	size_t skip = offset % block_size();
+
+	for (Extent const &extent : extents)
+	{
+		if (!len)
+			break;
+		if (block >= extent.blocks)
+		{
+			block -= extent.blocks;
+			continue;
+		}
+
+		for (; block != extent.blocks && len; ++block)
+		{
+			size_t const count = std::min(len, static_cast<size_t>(block_size()) - skip);
+
+			/* holes read as zeros without touching the device */
+			if (!extent.block)
+				std::fill_n(data, count, 0);
+			else
+				std::copy_n(cache_->block(extent.block + block)->data() + skip, count, data);
+			data += count;
+			len -= count;
+			skip = 0;
+		}
+		block = 0;
+	}
+
+	if (len)
+		throw std::runtime_error("file data runs past its extents");
+}
+
+size_t Reader::read_compressed(Inode const &inode, uint64_t offset, uint8_t *data, size_t len)
+{
+	if (!cluster_size())
+		throw std::runtime_error("compressed file on an image without clusters");
+
+	std::vector<Extent> const stored = extents(inode);
+	uint64_t const length = inode.length();
+	size_t const first = offset / cluster_size();
+	size_t const last = (offset + len - 1) / cluster_size();
+	std::vector<be32> table(last - first + 2);
+	std::vector<uint8_t> packed;
+	std::vector<uint8_t> cluster(cluster_size());
+	size_t done = 0;
+
+	read_stored(stored, first * sizeof(be32),
+			reinterpret_cast<uint8_t *>(table.data()), table.size() * sizeof(be32));
+
+	for (size_t it = first; it <= last; ++it)
+	{
+		uint32_t const from = table[it - first];
+		uint32_t const to = table[it - first + 1];
+		uint64_t const start = static_cast<uint64_t>(it) * cluster_size();
+		size_t const size = std::min(length - start, static_cast<uint64_t>(cluster_size()));
+
+		if (to < from || to - from > size)
+			throw std::runtime_error("corrupted cluster table");
+
+		packed.resize(to - from);
+		read_stored(stored, from, packed.data(), packed.size());
+
+		if (packed.size() == size)
+			std::copy(packed.begin(), packed.end(), cluster.begin());
+		else if (inode.flags() & AUFS_INODE_LZ4)
+		{
+			int const got = LZ4_decompress_safe(reinterpret_cast<char const *>(packed.data()),
+					reinterpret_cast<char *>(cluster.data()), packed.size(), size);
+			if (got != static_cast<int>(size))
+				throw std::runtime_error("cannot decompress a cluster");
+		}
+		else
+		{
+			size_t const got = ZSTD_decompress(cluster.data(), size, packed.data(), packed.size());
+			if (ZSTD_isError(got) || got != size)
+				throw std::runtime_error("cannot decompress a cluster");
+		}
+
+		size_t const skip = it == first ? offset - start : 0;
+		size_t const count = std::min(len - done, size - skip);
+		std::copy_n(cluster.data() + skip, count, data + done);
+		done += count;
+	}
+
+	return done;
+}
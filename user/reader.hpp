@@ -0,0 +1,69 @@
+#ifndef __READER_HPP__
+#define __READER_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "bitmap.hpp"
+#include "cache.hpp"
+#include "disk.hpp"
+#include "inode.hpp"
+
+/*
+ * Read only view of an image the way the kernel sees it, every block goes
+ * through the cache so it can be counted and dropped by the caller.
+ */
+class Reader
+{
+public:
+	explicit Reader(BlockCache &cache);
+
+	/* the block size recorded in the super block of an image file */
+	static uint32_t probe_block_size(std::string const &img);
+
+	uint32_t block_size() const;
+	uint32_t blocks_count() const;
+	uint32_t inodes_count() const;
+	uint32_t inode_bitmap() const;
+	uint32_t inode_table() const;
+	uint32_t features() const;
+	uint32_t root_inode() const;
+	uint32_t cluster_size() const;
+
+	/* allocation maps, a set bit is a busy block or inode table slot */
+	Bitmap blocks_map();
+	Bitmap inodes_map();
+
+	Inode inode(uint32_t ino);
+	/* the inode table block that holds the inode */
+	uint32_t inode_block(uint32_t ino) const;
+	std::vector<Extent> extents(Inode const &inode);
+	DirEntries children(Inode const &dir);
+	/* zero when there is no such name, stops at the first match */
+	uint32_t lookup(Inode const &dir, std::string const &name);
+	/* path from the root, "." parts are skipped, throws when a part is missing */
+	Inode resolve(std::string const &path);
+
+	/* bytes the file takes in its extents, the cluster table included */
+	uint64_t stored_length(Inode const &inode);
+	/* file contents from the offset, decompressed, short at the end */
+	size_t read(Inode const &inode, uint64_t offset, uint8_t *data, size_t len);
+
+private:
+	void read_stored(std::vector<Extent> const &extents, uint64_t offset, uint8_t *data, size_t len);
+	size_t read_compressed(Inode const &inode, uint64_t offset, uint8_t *data, size_t len);
+
+	BlockCache *cache_;
+
+	uint32_t blocks_count_;
+	uint32_t inodes_count_;
+	uint32_t inode_bitmap_;
+	uint32_t inode_table_;
+	uint32_t features_;
+	uint32_t root_inode_;
+	uint32_t cluster_size_;
+};
+
+#endif /*__READER_HPP__*/
@@ -0,0 +1,399 @@
+#include <algorithm>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "format.hpp"
+#include "io.hpp"
+#include "reader.hpp"
+
+namespace {
+
+	/* what the compacted image needs, worked out before it is made */
+	struct Need
+	{
+		uint64_t slots;		/* inode table slots as allocated in order */
+		uint64_t dir_blocks;
+		uint64_t data_blocks;
+		uint32_t inline_max;
+	};
+
+	class Repacker
+	{
+	public:
+		Repacker(BlockCache &from, Reader &reader)
+			: from_(&from)
+			, reader_(&reader)
+			, format_(nullptr)
+		{ }
+
+		Need measure()
+		{
+			size_t const in_block = reader_->block_size() / sizeof(struct aufs_dinode);
+			std::map<uint32_t, bool> seen;
+			std::map<uint32_t, bool> extents_seen;
+			std::deque<uint32_t> queue(1, reader_->root_inode());
+			Need need = Need();
+
+			/* slot 0 is never handed out, inodes do not cross table blocks */
+			need.slots = 1;
+			auto take = [&](uint64_t slots)
+			{
+				if (need.slots % in_block + slots > in_block)
+					need.slots += in_block - need.slots % in_block;
+				need.slots += slots;
+			};
+
+			/* the largest inline file sets the bar for the new image */
+			walk([&](Inode const &node)
+			{
+				if (node.flags() & AUFS_INODE_INLINE)
+					need.inline_max = std::max(need.inline_max, static_cast<uint32_t>(node.length()));
+			});
+
+			take(1);
+			while (!queue.empty())
+			{
+				Inode const dir = reader_->inode(queue.front());
+				DirEntries const children = reader_->children(dir);
+				uint64_t bytes = 0;
+				queue.pop_front();
+
+				for (std::pair<std::string, uint32_t> const &child : children)
+					bytes = dir_record_offset(bytes, child.first.size(), reader_->block_size()) +
+							AUFS_DIR_RECORD_SIZE(child.first.size());
+				need.dir_blocks += (bytes + reader_->block_size() - 1) / reader_->block_size();
+
+				for (std::pair<std::string, uint32_t> const &child : children)
+				{
+					Inode const node = reader_->inode(child.second);
+					if (!seen.emplace(child.second, true).second)
+						continue;
+
+					if (S_ISDIR(node.mode()))
+					{
+						take(1);
+						queue.push_back(child.second);
+						continue;
+					}
+
+					/* linked files get a slot for the count from the start */
+					uint64_t const length = node.length();
+					bool const linked = node.links() > 1;
+					if (length && length <= need.inline_max)
+					{
+						uint64_t const slots = (length + sizeof(struct aufs_dinode) - 1) / sizeof(struct aufs_dinode);
+						take(1 + linked + slots);
+						continue;
+					}
+
+					std::vector<Extent> const extents = reader_->extents(node);
+					take((length >> 32) || holes(extents) || linked ? 2 : 1);
+					uint32_t const first = first_data(extents);
+					if (!first || !extents_seen.emplace(first, true).second)
+						continue;
+					if (holes(extents))
+					{
+						for (Extent const &extent : extents)
+							need.data_blocks += extent.block ? extent.blocks : 0;
+						need.data_blocks += extents.size() > AUFS_INLINE_EXTENTS;
+						continue;
+					}
+					uint64_t const stored = node.flags() & AUFS_INODE_COMPRESSED ?
+							reader_->stored_length(node) : length;
+					need.data_blocks += (stored + reader_->block_size() - 1) / reader_->block_size();
+				}
+			}
+
+			return need;
+		}
+
+		/*
+		 * Directories are made breadth first, each one followed by the
+		 * inodes and the data of its children, so a directory and what it
+		 * holds end up next to each other on the device.
+		 */
+		Inode copy(Formatter &format)
+		{
+			std::deque<std::pair<uint32_t, Inode>> queue;
+
+			format_ = &format;
+			Inode const root = reader_->inode(reader_->root_inode());
+			Inode made = make_dir(root);
+			queue.emplace_back(root.inode(), made);
+
+			while (!queue.empty())
+			{
+				Inode const dir = reader_->inode(queue.front().first);
+				Inode target = queue.front().second;
+				queue.pop_front();
+
+				for (std::pair<std::string, uint32_t> const &child : reader_->children(dir))
+				{
+					Inode const node = reader_->inode(child.second);
+					Inode copied;
+
+					if (S_ISDIR(node.mode()))
+					{
+						copied = make_dir(node);
+						queue.emplace_back(node.inode(), copied);
+					}
+					else
+						copied = copy_file(node);
+
+					format.add_child(target, child.first.c_str(), copied);
+				}
+			}
+
+			return made;
+		}
+
+	private:
+		template <typename Visit>
+		void walk(Visit visit)
+		{
+			std::deque<uint32_t> queue(1, reader_->root_inode());
+			std::map<uint32_t, bool> seen;
+
+			while (!queue.empty())
+			{
+				Inode const dir = reader_->inode(queue.front());
+				queue.pop_front();
+				for (std::pair<std::string, uint32_t> const &child : reader_->children(dir))
+				{
+					if (!seen.emplace(child.second, true).second)
+						continue;
+					Inode const node = reader_->inode(child.second);
+					if (S_ISDIR(node.mode()))
+						queue.push_back(child.second);
+					else
+						visit(node);
+				}
+			}
+		}
+
+		Inode make_dir(Inode const &dir)
+		{
+			std::vector<std::string> names;
+			for (std::pair<std::string, uint32_t> const &child : reader_->children(dir))
+				names.push_back(child.first);
+
+			Inode made = format_->mkdir(names);
+			format_->copy_attributes(made, dir);
+			return made;
+		}
+
+		Inode copy_file(Inode const &node)
+		{
+			std::map<uint32_t, Inode>::iterator const link = links_.find(node.inode());
+			if (link != links_.end())
+			{
+				format_->set_links(link->second, link->second.links() + 1);
+				return link->second;
+			}
+
+			std::vector<Extent> const extents = reader_->extents(node);
+			uint32_t const first = first_data(extents);
+			/* the other links follow, make room for the count now */
+			bool const linked = node.links() > 1;
+			Inode copied;
+
+			std::map<uint32_t, Inode>::const_iterator const shared =
+					first ? shared_.find(first) : shared_.end();
+			if (shared != shared_.end())
+				copied = format_->mkshared(shared->second, linked);
+			else if (node.flags() & AUFS_INODE_COMPRESSED)
+			{
+				std::vector<uint8_t> stored(reader_->stored_length(node));
+				size_t offset = 0;
+				read_extents(extents, stored.size(), [&](uint8_t const *data, size_t len)
+						{ std::copy_n(data, len, stored.data() + offset); offset += len; });
+				copied = format_->mkcompressed(node.length(), stored, node.flags() & AUFS_INODE_COMPRESSED,
+						linked);
+			}
+			else
+				copied = copy_data(node, extents, linked);
+
+			format_->copy_attributes(copied, node);
+			if (linked)
+				links_.emplace(node.inode(), copied);
+
+			if (first && shared == shared_.end())
+				shared_.emplace(first, copied);
+
+			return copied;
+		}
+
+		static bool holes(std::vector<Extent> const &extents)
+		{
+			return std::any_of(extents.begin(), extents.end(),
+					[](Extent const &extent) { return !extent.block; });
+		}
+
+		/* shared extents are told apart by it, all holes start at block 0 */
+		static uint32_t first_data(std::vector<Extent> const &extents)
+		{
+			for (Extent const &extent : extents)
+			{
+				if (extent.block)
+					return extent.block;
+			}
+			return 0;
+		}
+
+		/* holes stay holes, the data extents are copied one by one */
+		Inode copy_sparse(Inode const &node, std::vector<Extent> const &extents, bool extended)
+		{
+			std::vector<Extent> ranges;
+			uint32_t block = 0;
+
+			for (Extent const &extent : extents)
+			{
+				if (extent.block)
+					ranges.push_back(Extent{ block, extent.blocks });
+				block += extent.blocks;
+			}
+
+			Inode copied = format_->mksparse(node.length(), ranges, extended);
+			block = 0;
+			for (Extent const &extent : extents)
+			{
+				uint64_t const from = static_cast<uint64_t>(block) * reader_->block_size();
+				uint64_t written = 0;
+
+				if (extent.block && from < node.length())
+					read_extents(std::vector<Extent>(1, extent),
+							std::min(node.length() - from,
+								static_cast<uint64_t>(extent.blocks) * reader_->block_size()),
+							[&](uint8_t const *data, size_t len)
+							{
+								format_->write_range(copied, block + written / reader_->block_size(),
+										data, len);
+								written += len;
+							});
+				block += extent.blocks;
+			}
+
+			return copied;
+		}
+
+		Inode copy_data(Inode const &node, std::vector<Extent> const &extents, bool extended)
+		{
+			if (holes(extents))
+				return copy_sparse(node, extents, extended);
+
+			Inode copied = format_->mkfile(node.length(), extended);
+
+			if (!(copied.flags() & AUFS_INODE_INLINE) && !(node.flags() & AUFS_INODE_INLINE))
+			{
+				read_extents(extents, node.length(), [&](uint8_t const *data, size_t len)
+						{ format_->write_extents(copied, data, len); });
+				return copied;
+			}
+
+			/* small enough to go through memory */
+			std::vector<uint8_t> data(node.length());
+			reader_->read(node, 0, data.data(), data.size());
+			if (copied.flags() & AUFS_INODE_INLINE)
+				format_->write(copied, data.data(), data.size());
+			else
+				format_->write_extents(copied, data.data(), data.size());
+			return copied;
+		}
+
+		/* large reads straight from the device, whole blocks but the last */
+		template <typename Sink>
+		void read_extents(std::vector<Extent> const &extents, uint64_t len, Sink sink)
+		{
+			std::vector<uint8_t> buffer(std::min(len, static_cast<uint64_t>(COPY_SIZE)));
+			size_t const block_size = reader_->block_size();
+
+			for (Extent const &extent : extents)
+			{
+				for (uint64_t block = 0; block != extent.blocks && len;)
+				{
+					uint64_t const count = std::min(len, std::min(static_cast<uint64_t>(COPY_SIZE),
+							static_cast<uint64_t>(extent.blocks - block) * block_size));
+					from_->read(extent.block + block, buffer.data(), count);
+					sink(buffer.data(), count);
+					block += count / block_size;
+					len -= count;
+				}
+			}
+
+			if (len)
+				throw std::runtime_error("file data runs past its extents");
+		}
+
+		BlockCache *from_;
+		Reader *reader_;
+		Formatter *format_;
+		/* source inode of files with several links to the copy */
+		std::map<uint32_t, Inode> links_;
+		/* first source block of shared extents to the copy that owns them */
+		std::map<uint32_t, Inode> shared_;
+	};
+
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+	{
+		std::cout << "usage: " << argv[0] << " image new-image" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		uint32_t const block_size = Reader::probe_block_size(argv[1]);
+		FileDevice source(argv[1], block_size, false);
+		BlockCache from(source);
+		Reader reader(from);
+		Repacker repacker(from, reader);
+
+		Need const need = repacker.measure();
+		size_t const in_block = block_size / sizeof(struct aufs_dinode);
+		uint64_t const table = (need.slots + in_block - 1) / in_block;
+		uint64_t blocks = 1 + table + need.dir_blocks + need.data_blocks;
+		blocks += Bitmap::blocks_for(blocks, block_size) + Bitmap::blocks_for(table * in_block, block_size);
+		blocks += Bitmap::blocks_for(blocks, block_size);
+		if (blocks >> 32)
+			throw std::runtime_error("the tree does not fit an image");
+
+		size_image(argv[2], blocks * block_size);
+		uint32_t used = 0;
+		{
+			BlockCache to(argv[2], block_size);
+			Formatter format(to, blocks, table * in_block);
+
+			format.set_inline_max(need.inline_max);
+			if (reader.cluster_size())
+				format.set_cluster_size(reader.cluster_size());
+
+			format.set_root_inode(repacker.copy(format).inode());
+			used = format.shrink();
+		}
+		from.drop();
+
+		struct stat buffer;
+		if (!stat(argv[2], &buffer) && S_ISREG(buffer.st_mode) &&
+				truncate(argv[2], static_cast<uint64_t>(used) * block_size))
+			throw std::runtime_error("cannot shrink the image");
+
+		std::cout << "blocks: " << used << " (was " << reader.blocks_count() << ")" << std::endl;
+	}
+	catch (std::exception const &ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
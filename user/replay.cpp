@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "options.hpp"
+#include "reader.hpp"
+
+namespace {
+
+	typedef std::chrono::steady_clock Clock;
+
+	enum OpType
+	{
+		OPEN,
+		LOOKUP,
+		READDIR,
+		READ,
+		OP_TYPES
+	};
+
+	char const *const op_names[OP_TYPES] = { "open", "lookup", "readdir", "read" };
+
+	/* one trace line: <time_us> <op> <path> [<offset> <length>] */
+	struct Op
+	{
+		uint64_t time;
+		OpType type;
+		std::string path;
+		uint64_t offset;
+		uint64_t length;
+	};
+
+	struct Result
+	{
+		uint64_t latency;	/* nanoseconds */
+		size_t blocks;
+		uint64_t bytes;
+		bool failed;
+	};
+
+	enum CacheMode
+	{
+		FRESH,	/* starts empty, keeps whatever ops read */
+		COLD,	/* dropped before every op */
+		WARM	/* filled by an unmeasured pass over the trace */
+	};
+
+	std::vector<Op> load_trace(std::istream &in)
+	{
+		std::vector<Op> ops;
+		std::string line;
+		size_t no = 0;
+
+		while (std::getline(in, line))
+		{
+			std::istringstream fields(line);
+			std::string type;
+			Op op = Op();
+
+			++no;
+			if (!(fields >> op.time))
+			{
+				fields.clear();
+				if ((fields >> type) && type[0] != '#')
+					throw std::runtime_error("bad trace line " + std::to_string(no));
+				continue;
+			}
+
+			fields >> type >> op.path;
+			op.type = static_cast<OpType>(std::find(op_names, op_names + OP_TYPES, type) - op_names);
+			if (op.type == OP_TYPES || op.path.empty())
+				throw std::runtime_error("bad trace line " + std::to_string(no));
+			if (op.type == READ && !(fields >> op.offset >> op.length))
+				throw std::runtime_error("read needs offset and length at line " + std::to_string(no));
+			ops.push_back(op);
+		}
+
+		return ops;
+	}
+
+	/* device, cache and open files of a single replay thread */
+	class Worker
+	{
+	public:
+		Worker(std::string const &img, uint32_t block_size, DeviceModel const *model)
+			: file_(img, block_size, false)
+			, model_(model ? new ModelDevice(file_, *model) : nullptr)
+			, device_(model_ ? static_cast<Device &>(*model_) : file_)
+			, cache_(device_)
+			, reader_(cache_)
+		{ }
+
+		~Worker()
+		{ cache_.drop(); }
+
+		Result run(Op const &op)
+		{
+			Result result = Result();
+			size_t const reads = device_.reads();
+			double const modeled = model_ ? model_->elapsed() : 0;
+			Clock::time_point const start = Clock::now();
+
+			try
+			{
+				result.bytes = execute(op);
+			}
+			catch (std::exception const &)
+			{
+				result.failed = true;
+			}
+
+			/* a model makes the device time the latency, the same on any box */
+			if (model_)
+				result.latency = static_cast<uint64_t>((model_->elapsed() - modeled) * 1000);
+			else
+				result.latency = std::chrono::duration_cast<std::chrono::nanoseconds>(
+						Clock::now() - start).count();
+			result.blocks = device_.reads() - reads;
+			return result;
+		}
+
+		/* files stay open, as they do over dropping the page cache */
+		void drop()
+		{ cache_.drop(); }
+
+		ModelDevice *model()
+		{ return model_.get(); }
+
+	private:
+		uint64_t execute(Op const &op)
+		{
+			switch (op.type)
+			{
+			case OPEN:
+				open_[op.path] = reader_.resolve(op.path).inode();
+				return 0;
+			case LOOKUP:
+			{
+				size_t const slash = op.path.find_last_of('/');
+				Inode const dir = slash == std::string::npos ?
+						reader_.inode(reader_.root_inode()) :
+						reader_.resolve(op.path.substr(0, slash));
+				reader_.lookup(dir, slash == std::string::npos ? op.path : op.path.substr(slash + 1));
+				return 0;
+			}
+			case READDIR:
+				reader_.children(reader_.resolve(op.path));
+				return 0;
+			case READ:
+			{
+				/* reads go to the file opened before, as with a descriptor */
+				std::map<std::string, uint32_t>::const_iterator const it = open_.find(op.path);
+				Inode const file = it == open_.end() ? reader_.resolve(op.path) : reader_.inode(it->second);
+				buffer_.resize(op.length);
+				return reader_.read(file, op.offset, buffer_.data(), buffer_.size());
+			}
+			default:
+				return 0;
+			}
+		}
+
+		FileDevice file_;
+		std::unique_ptr<ModelDevice> model_;
+		CountingDevice device_;
+		BlockCache cache_;
+		Reader reader_;
+		std::map<std::string, uint32_t> open_;
+		std::vector<uint8_t> buffer_;
+	};
+
+	uint64_t percentile(std::vector<uint64_t> const &sorted, unsigned pct)
+	{
+		if (sorted.empty())
+			return 0;
+		return sorted[std::min(sorted.size() - 1, (sorted.size() * pct + 99) / 100 - 1)];
+	}
+
+	void report(std::ostream &out, std::vector<Op> const &ops, std::vector<Result> const &results,
+			double seconds, std::vector<std::unique_ptr<Worker>> const &workers)
+	{
+		uint64_t total_bytes = 0;
+		size_t total_blocks = 0;
+
+		out << "op        count  failed   p50 us   p90 us   p99 us   max us  blocks/op" << std::endl;
+		for (size_t type = 0; type != OP_TYPES; ++type)
+		{
+			std::vector<uint64_t> latencies;
+			size_t failed = 0;
+			size_t blocks = 0;
+
+			for (size_t it = 0; it != ops.size(); ++it)
+			{
+				if (ops[it].type != type)
+					continue;
+				latencies.push_back(results[it].latency);
+				failed += results[it].failed;
+				blocks += results[it].blocks;
+				total_bytes += results[it].bytes;
+			}
+			total_blocks += blocks;
+			if (latencies.empty())
+				continue;
+
+			std::sort(latencies.begin(), latencies.end());
+			char line[128];
+			snprintf(line, sizeof(line), "%-8s %6zu  %6zu %8.1f %8.1f %8.1f %8.1f %10.2f",
+					op_names[type], latencies.size(), failed,
+					percentile(latencies, 50) / 1000.0, percentile(latencies, 90) / 1000.0,
+					percentile(latencies, 99) / 1000.0, latencies.back() / 1000.0,
+					static_cast<double>(blocks) / latencies.size());
+			out << line << std::endl;
+		}
+
+		out << "ops: " << ops.size() << " in " << seconds << " s, "
+			<< ops.size() / seconds << " ops/s" << std::endl;
+		out << "read: " << total_bytes << " bytes, " << total_bytes / seconds / 1048576.0 << " MB/s" << std::endl;
+		out << "block reads: " << total_blocks << std::endl;
+
+		if (!workers.front()->model())
+			return;
+
+		double modeled = 0;
+		size_t requests = 0;
+		size_t seeks = 0;
+		for (std::unique_ptr<Worker> const &worker : workers)
+		{
+			std::vector<Access> const &trace = worker->model()->trace();
+			modeled += worker->model()->elapsed();
+			requests += trace.size();
+			seeks += std::count_if(trace.begin(), trace.end(),
+					[](Access const &access) { return access.seek; });
+		}
+		out << "device: " << workers.front()->model()->model().name << " model, "
+			<< modeled / 1000000 << " s in " << requests << " requests, "
+			<< seeks << " seeks" << std::endl;
+	}
+
+	/* <worker> r|w <block> <count> <seek> <cost us> per request */
+	void write_io_trace(std::ostream &out, std::vector<std::unique_ptr<Worker>> const &workers)
+	{
+		for (size_t it = 0; it != workers.size(); ++it)
+		{
+			for (Access const &access : workers[it]->model()->trace())
+				out << it << ' ' << (access.write ? 'w' : 'r') << ' ' << access.block << ' '
+					<< access.count << ' ' << access.seek << ' ' << access.cost << std::endl;
+		}
+	}
+
+}
+
+int main(int argc, char **argv)
+{
+	static struct option const options[] = {
+		{ "threads", required_argument, nullptr, 't' },
+		{ "cold", no_argument, nullptr, 'c' },
+		{ "warm", no_argument, nullptr, 'w' },
+		{ "timed", no_argument, nullptr, 'T' },
+		{ "model", required_argument, nullptr, 'm' },
+		{ "io-trace", required_argument, nullptr, 'o' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	size_t threads = 1;
+	CacheMode mode = FRESH;
+	bool timed = false;
+	DeviceModel const *model = nullptr;
+	std::string io_trace;
+
+	int opt;
+	try
+	{
+		while ((opt = getopt_long(argc, argv, "t:cwTm:o:", options, nullptr)) != -1)
+		{
+			switch (opt)
+			{
+			case 't':
+				threads = parse_threads(optarg);
+				break;
+			case 'c':
+				mode = COLD;
+				break;
+			case 'w':
+				mode = WARM;
+				break;
+			case 'T':
+				timed = true;
+				break;
+			case 'm':
+				model = &device_model(optarg);
+				break;
+			case 'o':
+				io_trace = optarg;
+				break;
+			default:
+				std::cout << "usage: " << argv[0]
+					<< " [--threads=N] [--cold|--warm] [--timed]"
+					<< " [--model=hdd|ssd|nbd [--io-trace=FILE]] image trace|-"
+					<< std::endl;
+				return 1;
+			}
+		}
+	}
+	catch (std::exception const &ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return 1;
+	}
+
+	argc -= optind - 1;
+	argv += optind - 1;
+
+	if (argc != 3)
+	{
+		std::cout << "image and trace expected" << std::endl;
+		return 1;
+	}
+
+	if (!io_trace.empty() && !model)
+	{
+		std::cout << "io trace needs a device model" << std::endl;
+		return 1;
+	}
+
+	try
+	{
+		std::string const img(argv[1]);
+		std::vector<Op> ops;
+		if (std::string(argv[2]) == "-")
+			ops = load_trace(std::cin);
+		else
+		{
+			std::ifstream trace(argv[2]);
+			if (!trace)
+				throw std::runtime_error("cannot open trace");
+			ops = load_trace(trace);
+		}
+
+		uint32_t const block_size = Reader::probe_block_size(img);
+		std::vector<std::unique_ptr<Worker>> workers;
+		for (size_t it = 0; it != threads; ++it)
+			workers.emplace_back(new Worker(img, block_size, model));
+
+		/* dropping the page cache of a file needs no privileges */
+		int const fd = open(img.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("image open error");
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+
+		/* any worker may get any op, so each one sees the whole trace */
+		if (mode == WARM)
+		{
+			for (std::unique_ptr<Worker> const &worker : workers)
+			{
+				for (Op const &op : ops)
+					worker->run(op);
+				if (worker->model())
+					worker->model()->clear();
+			}
+		}
+
+		std::vector<Result> results(ops.size());
+		std::atomic<size_t> next(0);
+		Clock::time_point const start = Clock::now();
+		uint64_t const base = ops.empty() ? 0 : ops.front().time;
+
+		std::vector<std::thread> pool;
+		for (size_t it = 0; it != threads; ++it)
+		{
+			pool.emplace_back([&, it]()
+			{
+				Worker &worker = *workers[it];
+				for (size_t op = next++; op < ops.size(); op = next++)
+				{
+					if (timed && ops[op].time > base)
+						std::this_thread::sleep_until(start +
+								std::chrono::microseconds(ops[op].time - base));
+					if (mode == COLD)
+					{
+						worker.drop();
+						posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+					}
+					results[op] = worker.run(ops[op]);
+				}
+			});
+		}
+		for (std::thread &thread : pool)
+			thread.join();
+
+		double const seconds = std::chrono::duration<double>(Clock::now() - start).count();
+		close(fd);
+
+		report(std::cout, ops, results, seconds, workers);
+
+		if (!io_trace.empty())
+		{
+			std::ofstream out(io_trace);
+			if (!out)
+				throw std::runtime_error("cannot create io trace");
+			write_io_trace(out, workers);
+		}
+	}
+	catch (std::exception const &ex)
+	{
+		std::cout << ex.what() << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,172 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+
+#include <unistd.h>
+
+#include "stream.hpp"
+
+namespace {
+
+	size_t const INPUT_BUFFER = 1 << 20;
+
+	uint8_t const GZIP_MAGIC[] = { 0x1f, 0x8b };
+	uint8_t const ZSTD_MAGIC[] = { 0x28, 0xb5, 0x2f, 0xfd };
+	uint8_t const LZ4_MAGIC[] = { 0x04, 0x22, 0x4d, 0x18 };
+
+	template <size_t N>
+	bool has_magic(std::vector<uint8_t> const &in, size_t len, uint8_t const (&magic)[N])
+	{ return len >= N && std::equal(magic, magic + N, in.data()); }
+
+}
+
+InputStream::InputStream(int fd)
+	: fd_(fd)
+	, format_(RAW)
+	, eof_(false)
+	, in_(INPUT_BUFFER)
+	, in_pos_(0)
+	, in_len_(0)
+	, zstd_(nullptr)
+	, lz4_(nullptr)
+{
+	std::memset(&gzip_, 0, sizeof(gzip_));
+
+	while (in_len_ < sizeof(ZSTD_MAGIC) && fill())
+		;
+
+	if (has_magic(in_, in_len_, GZIP_MAGIC))
+	{
+		/* 32 lets zlib take the gzip header */
+		if (inflateInit2(&gzip_, 32 + MAX_WBITS) != Z_OK)
+			throw std::runtime_error("cannot initialize gzip");
+		format_ = GZIP;
+	}
+	else if (has_magic(in_, in_len_, ZSTD_MAGIC))
+	{
+		zstd_ = ZSTD_createDStream();
+		if (!zstd_)
+			throw std::runtime_error("cannot initialize zstd");
+		ZSTD_initDStream(zstd_);
+		format_ = ZSTD;
+	}
+	else if (has_magic(in_, in_len_, LZ4_MAGIC))
+	{
+		if (LZ4F_isError(LZ4F_createDecompressionContext(&lz4_, LZ4F_VERSION)))
+			throw std::runtime_error("cannot initialize lz4");
+		format_ = LZ4;
+	}
+}
+
+InputStream::~InputStream()
+{
+	if (format_ == GZIP)
+		inflateEnd(&gzip_);
+	ZSTD_freeDStream(zstd_);
+	LZ4F_freeDecompressionContext(lz4_);
+}
+
+/* appends raw input to the buffer, returns false at the end of input */
+bool InputStream::fill()
+{
+	if (eof_)
+		return false;
+
+	if (in_pos_ == in_len_)
+		in_pos_ = in_len_ = 0;
+
+	if (in_len_ == in_.size())
+	{
+		std::copy(in_.begin() + in_pos_, in_.begin() + in_len_, in_.begin());
+		in_len_ -= in_pos_;
+		in_pos_ = 0;
+	}
+
+	ssize_t ret;
+	do
+		ret = ::read(fd_, in_.data() + in_len_, in_.size() - in_len_);
+	while (ret < 0 && errno == EINTR);
+
+	if (ret < 0)
+		throw std::runtime_error("cannot read input");
+
+	in_len_ += ret;
+	eof_ = !ret;
+	return ret;
+}
+
+/* decodes buffered input, returns the number of bytes produced */
+size_t InputStream::decode(uint8_t *data, size_t len)
+{
+	uint8_t *const in = in_.data() + in_pos_;
+	size_t const avail = in_len_ - in_pos_;
+
+	switch (format_)
+	{
+	case GZIP:
+	{
+		gzip_.next_in = in;
+		gzip_.avail_in = avail;
+		gzip_.next_out = data;
+		gzip_.avail_out = len;
+
+		int const ret = inflate(&gzip_, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+			throw std::runtime_error("corrupted gzip input");
+		/* concatenated gzip members make one stream */
+		if (ret == Z_STREAM_END)
+			inflateReset(&gzip_);
+
+		in_pos_ += avail - gzip_.avail_in;
+		return len - gzip_.avail_out;
+	}
+	case ZSTD:
+	{
+		ZSTD_inBuffer input = { in, avail, 0 };
+		ZSTD_outBuffer output = { data, len, 0 };
+
+		if (ZSTD_isError(ZSTD_decompressStream(zstd_, &output, &input)))
+			throw std::runtime_error("corrupted zstd input");
+
+		in_pos_ += input.pos;
+		return output.pos;
+	}
+	case LZ4:
+	{
+		size_t out_len = len;
+		size_t in_len = avail;
+
+		if (LZ4F_isError(LZ4F_decompress(lz4_, data, &out_len, in, &in_len, nullptr)))
+			throw std::runtime_error("corrupted lz4 input");
+
+		in_pos_ += in_len;
+		return out_len;
+	}
+	default:
+	{
+		size_t const count = std::min(len, avail);
+
+		std::copy_n(in, count, data);
+		in_pos_ += count;
+		return count;
+	}
+	}
+}
+
+size_t InputStream::read(void *data, size_t len)
+{
+	uint8_t *const out = static_cast<uint8_t *>(data);
+	size_t done = 0;
+
+	while (done != len)
+	{
+		size_t const count = decode(out + done, len - done);
+
+		done += count;
+		if (!count && !fill())
+			break;
+	}
+
+	return done;
+}
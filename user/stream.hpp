@@ -0,0 +1,52 @@
+#ifndef __STREAM_HPP__
+#define __STREAM_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include <lz4frame.h>
+#include <zlib.h>
+#include <zstd.h>
+
+/*
+ * Reads a file descriptor undoing gzip, zstd or lz4 frame compression,
+ * whichever the magic number at the start of the input says.
+ */
+class InputStream
+{
+public:
+	explicit InputStream(int fd);
+	~InputStream();
+
+	InputStream(InputStream const &) = delete;
+	InputStream &operator=(InputStream const &) = delete;
+
+	/* reads less than len bytes only at the end of the input */
+	size_t read(void *data, size_t len);
+
+private:
+	enum Format
+	{
+		RAW,
+		GZIP,
+		ZSTD,
+		LZ4
+	};
+
+	bool fill();
+	size_t decode(uint8_t *data, size_t len);
+
+	int fd_;
+	Format format_;
+	bool eof_;
+	std::vector<uint8_t> in_;
+	size_t in_pos_;
+	size_t in_len_;
+
+	z_stream gzip_;
+	ZSTD_DStream *zstd_;
+	LZ4F_dctx *lz4_;
+};
+
+#endif /*__STREAM_HPP__*/
@@ -0,0 +1,290 @@
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "tar.hpp"
+
+namespace {
+
+	size_t const TAR_BLOCK = 512;
+
+	struct tar_header
+	{
+		char name[100];
+		char mode[8];
+		char uid[8];
+		char gid[8];
+		char size[12];
+		char mtime[12];
+		char chksum[8];
+		char typeflag;
+		char linkname[100];
+		char magic[6];
+		char version[2];
+		char uname[32];
+		char gname[32];
+		char devmajor[8];
+		char devminor[8];
+		char prefix[155];
+		char pad[12];
+	};
+
+	static_assert(sizeof(struct tar_header) == TAR_BLOCK, "tar header is a block");
+
+	std::string field(char const *data, size_t size)
+	{ return std::string(data, strnlen(data, size)); }
+
+	/* octal, or base-256 when the high bit of the first byte is set */
+	uint64_t number(char const *data, size_t size)
+	{
+		uint64_t value = 0;
+
+		if (static_cast<uint8_t>(data[0]) & 0x80)
+		{
+			value = static_cast<uint8_t>(data[0]) & 0x7f;
+			for (size_t it = 1; it != size; ++it)
+				value = (value << 8) | static_cast<uint8_t>(data[it]);
+			return value;
+		}
+
+		size_t it = 0;
+		while (it != size && (data[it] == ' ' || data[it] == '\0'))
+			++it;
+		for (; it != size && data[it] >= '0' && data[it] <= '7'; ++it)
+			value = (value << 3) | (data[it] - '0');
+		return value;
+	}
+
+	bool checksum_ok(struct tar_header const &header)
+	{
+		uint8_t const *const bytes = reinterpret_cast<uint8_t const *>(&header);
+		uint64_t sum = 0;
+
+		for (size_t it = 0; it != TAR_BLOCK; ++it)
+		{
+			bool const in_chksum = it >= offsetof(struct tar_header, chksum) &&
+				it < offsetof(struct tar_header, chksum) + sizeof(header.chksum);
+			sum += in_chksum ? ' ' : bytes[it];
+		}
+		return sum == number(header.chksum, sizeof(header.chksum));
+	}
+
+	/* drops ".", empty components and leading slashes, ".." is refused */
+	std::string normalize(std::string const &path)
+	{
+		std::string result;
+		size_t pos = 0;
+
+		while (pos <= path.size())
+		{
+			size_t const end = std::min(path.find('/', pos), path.size());
+			std::string const name = path.substr(pos, end - pos);
+
+			if (name == "..")
+				throw std::runtime_error("archive path escapes the root: " + path);
+			if (!name.empty() && name != ".")
+				result += (result.empty() ? "" : "/") + name;
+			pos = end + 1;
+		}
+
+		return result;
+	}
+
+}
+
+TarReader::TarReader(InputStream &in)
+	: in_(&in)
+	, left_(0)
+	, padding_(0)
+{ }
+
+void TarReader::read_block(char *block)
+{
+	if (in_->read(block, TAR_BLOCK) != TAR_BLOCK)
+		throw std::runtime_error("truncated archive");
+}
+
+size_t TarReader::read(void *data, size_t len)
+{
+	size_t const count = in_->read(data, std::min(static_cast<uint64_t>(len), left_));
+
+	if (count != std::min(static_cast<uint64_t>(len), left_))
+		throw std::runtime_error("truncated archive");
+	left_ -= count;
+	return count;
+}
+
+void TarReader::skip()
+{
+	char buffer[TAR_BLOCK];
+
+	while (left_)
+		read(buffer, sizeof(buffer));
+	if (padding_ && in_->read(buffer, padding_) != padding_)
+		throw std::runtime_error("truncated archive");
+	padding_ = 0;
+}
+
+std::string TarReader::read_string(uint64_t size)
+{
+	std::string data(size, '\0');
+
+	read(&data[0], size);
+	skip();
+	return data;
+}
+
+void TarReader::parse_pax(std::string const &records, Entry &entry, bool &has_path, bool &has_link)
+{
+	size_t pos = 0;
+
+	/* every record is "length key=value\n" */
+	while (pos < records.size())
+	{
+		size_t const space = records.find(' ', pos);
+		if (space == std::string::npos)
+			break;
+
+		size_t const length = std::stoul(records.substr(pos, space - pos));
+		if (!length || pos + length > records.size())
+			throw std::runtime_error("malformed pax header");
+
+		std::string const record = records.substr(space + 1, pos + length - space - 2);
+		size_t const eq = record.find('=');
+		std::string const key = record.substr(0, eq);
+		std::string const value = eq == std::string::npos ? "" : record.substr(eq + 1);
+
+		if (key == "path")
+		{
+			entry.path = value;
+			has_path = true;
+		}
+		else if (key == "linkpath")
+		{
+			entry.link = value;
+			has_link = true;
+		}
+		else if (key == "size")
+			entry.st.st_size = std::stoull(value);
+		else if (key == "mtime")
+			entry.st.st_mtim.tv_sec = std::stoll(value);
+		else if (key == "uid")
+			entry.st.st_uid = std::stoul(value);
+		else if (key == "gid")
+			entry.st.st_gid = std::stoul(value);
+
+		pos += length;
+	}
+}
+
+bool TarReader::next(Entry &entry)
+{
+	bool has_path = false;
+	bool has_link = false;
+	bool has_size = false;
+
+	skip();
+	std::memset(&entry.st, 0, sizeof(entry.st));
+	entry.path.clear();
+	entry.link.clear();
+
+	for (;;)
+	{
+		struct tar_header header;
+
+		read_block(reinterpret_cast<char *>(&header));
+		if (!header.name[0])
+			return false;
+		if (!checksum_ok(header))
+			throw std::runtime_error("tar header checksum mismatch");
+
+		uint64_t const size = number(header.size, sizeof(header.size));
+		left_ = size;
+		padding_ = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+
+		/* extension headers describe the entry that follows */
+		if (header.typeflag == 'L')
+		{
+			entry.path = read_string(size).c_str();
+			has_path = true;
+			continue;
+		}
+		if (header.typeflag == 'K')
+		{
+			entry.link = read_string(size).c_str();
+			has_link = true;
+			continue;
+		}
+		if (header.typeflag == 'x')
+		{
+			struct stat const before = entry.st;
+			parse_pax(read_string(size), entry, has_path, has_link);
+			has_size = entry.st.st_size != before.st_size;
+			continue;
+		}
+		if (header.typeflag == 'g')
+		{
+			skip();
+			continue;
+		}
+
+		if (!has_path)
+		{
+			entry.path = field(header.name, sizeof(header.name));
+			if (!std::strncmp(header.magic, "ustar", 5) && header.prefix[0])
+				entry.path = field(header.prefix, sizeof(header.prefix)) + "/" + entry.path;
+		}
+		if (!has_link)
+			entry.link = field(header.linkname, sizeof(header.linkname));
+		if (!has_size)
+			entry.st.st_size = size;
+		else
+		{
+			left_ = entry.st.st_size;
+			padding_ = (TAR_BLOCK - left_ % TAR_BLOCK) % TAR_BLOCK;
+		}
+		if (!entry.st.st_mtim.tv_sec)
+			entry.st.st_mtim.tv_sec = number(header.mtime, sizeof(header.mtime));
+		if (!entry.st.st_uid)
+			entry.st.st_uid = number(header.uid, sizeof(header.uid));
+		if (!entry.st.st_gid)
+			entry.st.st_gid = number(header.gid, sizeof(header.gid));
+		entry.st.st_mode = number(header.mode, sizeof(header.mode)) & 07777;
+
+		switch (header.typeflag)
+		{
+		case '0':
+		case '\0':
+		case '7':
+			entry.type = REGULAR;
+			entry.st.st_mode |= S_IFREG;
+			break;
+		case '1':
+			entry.type = HARDLINK;
+			entry.link = normalize(entry.link);
+			break;
+		case '2':
+			entry.type = SYMLINK;
+			entry.st.st_mode |= S_IFLNK;
+			break;
+		case '5':
+			entry.type = DIRECTORY;
+			entry.st.st_mode |= S_IFDIR;
+			break;
+		default:
+			entry.type = OTHER;
+			break;
+		}
+
+		if (entry.type != REGULAR)
+		{
+			/* only regular files carry data */
+			skip();
+			entry.st.st_size = 0;
+		}
+
+		entry.path = normalize(entry.path);
+		return true;
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef __TAR_HPP__
+#define __TAR_HPP__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "stream.hpp"
+
+/* reads ustar, GNU and pax archives one entry at a time */
+class TarReader
+{
+public:
+	enum Type
+	{
+		REGULAR,
+		HARDLINK,
+		SYMLINK,
+		DIRECTORY,
+		OTHER
+	};
+
+	struct Entry
+	{
+		std::string path;	/* normalized, the root is an empty path */
+		std::string link;
+		Type type;
+		struct stat st;
+	};
+
+	explicit TarReader(InputStream &in);
+
+	TarReader(TarReader const &) = delete;
+	TarReader &operator=(TarReader const &) = delete;
+
+	/* skips whatever is left of the current entry */
+	bool next(Entry &entry);
+
+	/* reads data of the current entry */
+	size_t read(void *data, size_t len);
+
+private:
+	void skip();
+	void read_block(char *block);
+	std::string read_string(uint64_t size);
+	void parse_pax(std::string const &records, Entry &entry, bool &has_path, bool &has_link);
+
+	InputStream *in_;
+	uint64_t left_;
+	uint64_t padding_;
+};
+
+#endif /*__TAR_HPP__*/